@@ -0,0 +1,122 @@
+/*
+Actor messaging benchmark.
+
+thread-actor  the REPL thread sends n messages to an echo actor, waiting
+              for each reply, so it measures a send, a wake-up on the pool
+              and a blocking receive on the way back.
+actor-actor   two actors bounce n messages between themselves on the pool.
+fan-out/in    each round sends one message to each of 64 worker actors and
+              collects their 64 replies.
+
+Build from the repository root:
+    cc -O2 -o actors bench/actors.c mpc.c -ledit -lm -lpthread
+Run:
+    ./actors [workers] [n]
+*/
+#define main divlisp_main
+#include "../variables.c"
+#undef main
+
+#include <time.h>
+
+mpc_parser_t *bench_lisp;
+
+/*The REPL's grammar, kept here so expressions can be read without the REPL*/
+void bench_grammar(void)
+{
+    mpc_parser_t *Number = mpc_new("number");
+    mpc_parser_t *Symbol = mpc_new("symbol");
+    mpc_parser_t *Sexpr = mpc_new("sexpr");
+    mpc_parser_t *Qexpr = mpc_new("qexpr");
+    mpc_parser_t *Expr = mpc_new("expr");
+    bench_lisp = mpc_new("divlisp");
+
+    mpca_lang(MPCA_LANG_DEFAULT,
+              " number : /-?[0-9]+/ ;                             "
+              " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+              " sexpr  : '(' <expr>* ')' ;                        "
+              " qexpr  : '{' <expr>* '}' ;                        "
+              " expr   : <number> | <symbol> | <sexpr> | <qexpr> ; "
+              " divlisp : /^/ <expr>* /$/ ;                       ",
+              Number, Symbol, Sexpr, Qexpr, Expr, bench_lisp);
+}
+
+/*First expression in 's'*/
+lval *bench_read(const char *s)
+{
+    mpc_result_t r;
+    if (!mpc_parse("<bench>", s, bench_lisp, &r))
+    {
+        mpc_err_print(r.error);
+        exit(1);
+    }
+    lval *x = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    return lval_take(x, 0);
+}
+
+double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*Seconds taken to evaluate 's', exits on an error*/
+double bench_eval(lenv *e, const char *s)
+{
+    lval *x = bench_read(s);
+    double t = bench_now();
+    lval *r = lval_eval(e, x);
+    t = bench_now() - t;
+    if (r->type == LVAL_ERR)
+    {
+        printf("%s\n  ", s);
+        lval_println(r);
+        exit(1);
+    }
+    lval_del(r);
+    return t;
+}
+
+int main(int argc, char **argv)
+{
+    int workers = argc > 1 ? atoi(argv[1]) : 4;
+    long n = argc > 2 ? atol(argv[2]) : 100000;
+    char src[512];
+
+    bench_grammar();
+    lenv *e = lenv_new();
+    lenv_add_builtins(e);
+
+    /*The pool cannot be resized once there are actors*/
+    snprintf(src, sizeof(src), "(parallel %d)", workers);
+    bench_eval(e, src);
+    printf("%d workers, %ld messages\n", workers, n);
+
+    bench_eval(e, "(def {echo} (spawn {while {1} {list (def {m} (receive {})) (send (nth m 0) (nth m 1))}}))");
+    snprintf(src, sizeof(src), "(dotimes {i} %ld {list (send echo (list (self {}) i)) (receive {})})", n);
+    double t = bench_eval(e, src);
+    printf("  thread-actor  %7.3f s  %7.0f ns per round trip\n", t, t / n * 1e9);
+
+    bench_eval(e, "(def {pong} (spawn {while {1} {send (receive {}) 0}}))");
+    snprintf(src, sizeof(src),
+             "(def {ping} (spawn {list (def {m} (receive {})) "
+             "(dotimes {i} %ld {list (send (nth m 0) (self {})) (receive {})}) (send (nth m 1) 0)}))",
+             n);
+    bench_eval(e, src);
+    t = bench_eval(e, "(list (send ping (list pong (self {}))) (receive {}))");
+    printf("  actor-actor   %7.3f s  %7.0f ns per round trip\n", t, t / n * 1e9);
+
+    bench_eval(e, "(def {ws} (pmap {i} {spawn {while {1} {list (def {m} (receive {})) "
+                  "(send (nth m 0) (* 2 (nth m 1)))}}} (range 0 64)))");
+    long rounds = n / 64 > 0 ? n / 64 : 1;
+    snprintf(src, sizeof(src),
+             "(dotimes {r} %ld {list (for-each {w} ws {send w (list (self {}) r)}) (dotimes {k} 64 {receive {}})})",
+             rounds);
+    t = bench_eval(e, src);
+    printf("  fan-out/in    %7.3f s  %7.0f ns per message, 64 actors\n", t, t / (rounds * 64) * 1e9);
+
+    lenv_del(e);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+Coroutine benchmark.
+
+Times a bare lctx_switch between two stacks, then a (resume g) whose body
+yields straight back, then creates many coroutines that are each suspended
+at their first yield, resumes them all once and reports the peak RSS.
+
+Build from the repository root:
+    cc -O2 -o coroutine bench/coroutine.c mpc.c -ledit -lm -lpthread
+Run:
+    ./coroutine [switches] [live coroutines]
+*/
+#define main divlisp_main
+#include "../variables.c"
+#undef main
+
+#include <time.h>
+#include <sys/resource.h>
+
+mpc_parser_t *bench_lisp;
+
+/*The REPL's grammar, kept here so expressions can be read without the REPL*/
+void bench_grammar(void)
+{
+    mpc_parser_t *Number = mpc_new("number");
+    mpc_parser_t *Symbol = mpc_new("symbol");
+    mpc_parser_t *Sexpr = mpc_new("sexpr");
+    mpc_parser_t *Qexpr = mpc_new("qexpr");
+    mpc_parser_t *Expr = mpc_new("expr");
+    bench_lisp = mpc_new("divlisp");
+
+    mpca_lang(MPCA_LANG_DEFAULT,
+              " number : /-?[0-9]+/ ;                             "
+              " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+              " sexpr  : '(' <expr>* ')' ;                        "
+              " qexpr  : '{' <expr>* '}' ;                        "
+              " expr   : <number> | <symbol> | <sexpr> | <qexpr> ; "
+              " divlisp : /^/ <expr>* /$/ ;                       ",
+              Number, Symbol, Sexpr, Qexpr, Expr, bench_lisp);
+}
+
+/*First expression in 's'*/
+lval *bench_read(const char *s)
+{
+    mpc_result_t r;
+    if (!mpc_parse("<bench>", s, bench_lisp, &r))
+    {
+        mpc_err_print(r.error);
+        exit(1);
+    }
+    lval *x = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    return lval_take(x, 0);
+}
+
+double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+lctx bench_main_ctx, bench_co_ctx;
+
+void bench_spin(void)
+{
+    for (;;)
+        lctx_switch(&bench_co_ctx, &bench_main_ctx);
+}
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 20000000;
+    long live = argc > 2 ? atol(argv[2]) : 100000;
+
+    /*Bare context switch, there and back*/
+    char *stack = lcoro_stack_alloc();
+    lctx_make(&bench_co_ctx, stack, LCORO_STACK_SIZE, bench_spin);
+    double t = bench_now();
+    for (long k = 0; k < n; k++)
+        lctx_switch(&bench_main_ctx, &bench_co_ctx);
+    t = bench_now() - t;
+    printf("lctx_switch          %6.1f ns per switch, %6.1f ns round trip\n", t / n / 2 * 1e9, t / n * 1e9);
+
+    bench_grammar();
+    lenv *e = lenv_new();
+    lenv_add_builtins(e);
+
+    /*A resume that goes straight back to the same yield*/
+    lval_del(lval_eval(e, bench_read("(def {g} (coroutine {while {1} {yield 1}}))")));
+    lval *resume = bench_read("(resume g)");
+    long m = n / 10;
+    t = bench_now();
+    for (long k = 0; k < m; k++)
+        lval_del(lval_eval(e, lval_copy(resume)));
+    t = bench_now() - t;
+    printf("resume + yield       %6.1f ns per round trip\n", t / m * 1e9);
+
+    /*Many suspended coroutines at once*/
+    char src[128];
+    snprintf(src, sizeof(src), "(def {gs} (pmap {i} {coroutine {yield i}} (range 0 %ld)))", live);
+    t = bench_now();
+    lval_del(lval_eval(e, bench_read(src)));
+    double made = bench_now() - t;
+    t = bench_now();
+    lval *sum = lval_eval(e, bench_read("(preduce {a b} {+ a b} 0 (pmap {c} {eval (head (resume c))} gs))"));
+    double resumed = bench_now() - t;
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%ld live coroutines: created in %.3f s, each resumed once in %.3f s, sum ", live, made, resumed);
+    lval_println(sum);
+    printf("  peak RSS %.1f MB, %.0f bytes per coroutine\n", ru.ru_maxrss / 1024.0, ru.ru_maxrss * 1024.0 / live);
+
+    lval_del(sum);
+    lval_del(resume);
+    lenv_del(e);
+    return 0;
+}
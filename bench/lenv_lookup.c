@@ -0,0 +1,133 @@
+/*
+Read-heavy lookup benchmark for the shared global environment.
+
+Reader threads look up random symbols among the builtins and 100 defined
+variables, going offline and back online every 1000 lookups as the REPL
+and pool workers do. An optional writer thread re-defs one variable, or
+defines a new one, every 10 microseconds.
+
+Build from the repository root:
+    cc -O2 -o lenv_lookup bench/lenv_lookup.c mpc.c -ledit -lm -lpthread
+Run:
+    ./lenv_lookup readers [none|def|add] [seconds]
+*/
+#define main divlisp_main
+#include "../variables.c"
+#undef main
+
+lenv *bench_env;
+lval *bench_syms[256];
+int bench_nsyms = 0;
+int bench_writer = 0;
+atomic_int bench_stop = 0;
+
+void *bench_reader(void *arg)
+{
+    unsigned seed = (unsigned)(long)arg * 7919 + 1;
+    long n = 0;
+
+    lrcu_online();
+    while (!atomic_load_explicit(&bench_stop, memory_order_relaxed))
+    {
+        for (int i = 0; i < 1000; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            lval *x = lenv_get(bench_env, bench_syms[(seed >> 8) % bench_nsyms]);
+            lval_del(x);
+        }
+        n += 1000;
+
+        lrcu_offline();
+        lrcu_online();
+    }
+    lrcu_offline();
+
+    return (void *)n;
+}
+
+void *bench_writer_run(void *arg)
+{
+    long n = 0;
+    char name[32];
+
+    while (!atomic_load(&bench_stop))
+    {
+        snprintf(name, sizeof(name), bench_writer == 2 ? "w%ld" : "v7", n);
+        lval *k = lval_sym(name);
+        lval *v = lval_num(n);
+        lenv_put(bench_env, k, v);
+        lval_del(k);
+        lval_del(v);
+        n++;
+
+        struct timespec ts = {0, 10000};
+        nanosleep(&ts, NULL);
+    }
+
+    return (void *)n;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s readers [none|def|add] [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    int readers = atoi(argv[1]);
+    if (readers < 1 || readers > 64)
+        readers = 1;
+    if (argc > 2)
+        bench_writer = strcmp(argv[2], "def") == 0 ? 1 : strcmp(argv[2], "add") == 0 ? 2 : 0;
+    double seconds = argc > 3 ? atof(argv[3]) : 1.0;
+
+    bench_env = lenv_new();
+    bench_env->shared = 1;
+    lenv_add_builtins(bench_env);
+
+    char name[32];
+    for (int i = 0; i < 100; i++)
+    {
+        snprintf(name, sizeof(name), "v%d", i);
+        lval *k = lval_sym(name);
+        lval *v = lval_num(i);
+        lenv_put(bench_env, k, v);
+        lval_del(k);
+        lval_del(v);
+    }
+    for (int i = 0; i < bench_env->count && bench_nsyms < 256; i++)
+    {
+        bench_syms[bench_nsyms++] = lval_sym(bench_env->syms[i]);
+    }
+
+    pthread_t threads[64], writer;
+    for (int i = 0; i < readers; i++)
+    {
+        pthread_create(&threads[i], NULL, bench_reader, (void *)(long)i);
+    }
+    if (bench_writer)
+        pthread_create(&writer, NULL, bench_writer_run, NULL);
+
+    struct timespec ts = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    nanosleep(&ts, NULL);
+    atomic_store(&bench_stop, 1);
+
+    long lookups = 0, defs = 0;
+    for (int i = 0; i < readers; i++)
+    {
+        void *r;
+        pthread_join(threads[i], &r);
+        lookups += (long)r;
+    }
+    if (bench_writer)
+    {
+        void *r;
+        pthread_join(writer, &r);
+        defs = (long)r;
+    }
+
+    printf("%d readers, writer %s: %.1f M lookups/s, %ld defs\n", readers,
+           bench_writer == 2 ? "add" : bench_writer ? "def" : "none", lookups / seconds / 1e6, defs);
+    return 0;
+}
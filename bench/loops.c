@@ -0,0 +1,101 @@
+/*
+Loop benchmark: a small body run n times.
+
+The old way is to rebind i with def and eval a fresh copy of the body each
+iteration, as recursion through eval does. The new way is dotimes, which
+walks the same body in place and updates i through its environment slot.
+
+Build from the repository root:
+    cc -O2 -o loops bench/loops.c mpc.c -ledit -lm -lpthread
+Run:
+    ./loops [iterations]
+*/
+#define main divlisp_main
+#include "../variables.c"
+#undef main
+
+#include <time.h>
+
+mpc_parser_t *bench_lisp;
+
+/*The REPL's grammar, kept here so expressions can be read without the REPL*/
+void bench_grammar(void)
+{
+    mpc_parser_t *Number = mpc_new("number");
+    mpc_parser_t *Symbol = mpc_new("symbol");
+    mpc_parser_t *Sexpr = mpc_new("sexpr");
+    mpc_parser_t *Qexpr = mpc_new("qexpr");
+    mpc_parser_t *Expr = mpc_new("expr");
+    bench_lisp = mpc_new("divlisp");
+
+    mpca_lang(MPCA_LANG_DEFAULT,
+              " number : /-?[0-9]+/ ;                             "
+              " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+              " sexpr  : '(' <expr>* ')' ;                        "
+              " qexpr  : '{' <expr>* '}' ;                        "
+              " expr   : <number> | <symbol> | <sexpr> | <qexpr> ; "
+              " divlisp : /^/ <expr>* /$/ ;                       ",
+              Number, Symbol, Sexpr, Qexpr, Expr, bench_lisp);
+}
+
+/*First expression in 's'*/
+lval *bench_read(const char *s)
+{
+    mpc_result_t r;
+    if (!mpc_parse("<bench>", s, bench_lisp, &r))
+    {
+        mpc_err_print(r.error);
+        exit(1);
+    }
+    lval *x = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    return lval_take(x, 0);
+}
+
+double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 10000000;
+    if (n < 1)
+        n = 1;
+
+    bench_grammar();
+    lenv *e = lenv_new();
+    lenv_add_builtins(e);
+
+    /*Before: def the counter, then eval a copy of the stored body*/
+    lval *body = bench_read("(+ i 1)");
+    lval *i = lval_sym("i");
+    double t = bench_now();
+    for (long k = 0; k < n; k++)
+    {
+        lval *v = lval_num(k);
+        lenv_put(e, i, v);
+        lval_del(v);
+        lval_del(lval_eval(e, lval_copy(body)));
+    }
+    double copied = bench_now() - t;
+
+    /*After: dotimes runs the body in place*/
+    char src[64];
+    snprintf(src, sizeof(src), "(dotimes {i} %ld {+ i 1})", n);
+    lval *loop = bench_read(src);
+    t = bench_now();
+    lval_del(lval_eval(e, loop));
+    double dotimes = bench_now() - t;
+
+    printf("%ld iterations of (+ i 1)\n", n);
+    printf("  copy body + lval_eval   %7.2f s  %6.1f ns/iter\n", copied, copied / n * 1e9);
+    printf("  dotimes                 %7.2f s  %6.1f ns/iter\n", dotimes, dotimes / n * 1e9);
+
+    lval_del(body);
+    lval_del(i);
+    lenv_del(e);
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+** Benchmark of mpc file input: stdio against mmap.
+**
+** Writes a DivLisp source file of the given size, then parses it with the
+** DivLisp grammar through mpc_parse_file (a getc per character, fseek to
+** backtrack) and through mpc_parse_contents (the file mapped and read as
+** a string). The best of the given number of runs is reported.
+**
+** Build from the repository root:
+**   cc -std=c99 -O2 -o mpc_contents bench/mpc_contents.c mpc.c -lm
+** Run:
+**   ./mpc_contents [megabytes] [runs]
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mpc.h"
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void write_source(const char *filename, long size) {
+  FILE *f = fopen(filename, "w");
+  long n = 0, i = 0;
+  while (n < size) {
+    n += fprintf(f, "(def {v%ld} (+ %ld (* 2 %ld) (head {a b %ld})))\n", i % 1000, i, i % 97, i);
+    i++;
+  }
+  fclose(f);
+}
+
+static double time_file(const char *filename, mpc_parser_t *p) {
+  mpc_result_t r;
+  double t = now();
+  FILE *f = fopen(filename, "rb");
+  if (!mpc_parse_file(filename, f, p, &r)) { mpc_err_print(r.error); exit(1); }
+  fclose(f);
+  t = now() - t;
+  mpc_ast_delete(r.output);
+  return t;
+}
+
+static double time_contents(const char *filename, mpc_parser_t *p) {
+  mpc_result_t r;
+  double t = now();
+  if (!mpc_parse_contents(filename, p, &r)) { mpc_err_print(r.error); exit(1); }
+  t = now() - t;
+  mpc_ast_delete(r.output);
+  return t;
+}
+
+int main(int argc, char **argv) {
+
+  double megabytes = argc > 1 ? atof(argv[1]) : 8;
+  int runs = argc > 2 ? atoi(argv[2]) : 3;
+  const char *filename = "mpc_contents.lsp";
+  double best_file = 1e9, best_contents = 1e9, t;
+  int j;
+
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *Sexpr = mpc_new("sexpr");
+  mpc_parser_t *Qexpr = mpc_new("qexpr");
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *DivLisp = mpc_new("divlisp");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " number : /-?[0-9]+/ ;                             "
+    " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+    " sexpr  : '(' <expr>* ')' ;                        "
+    " qexpr  : '{' <expr>* '}' ;                        "
+    " expr   : <number> | <symbol> | <sexpr> | <qexpr> ; "
+    " divlisp : /^/ <expr>* /$/ ;                       ",
+    Number, Symbol, Sexpr, Qexpr, Expr, DivLisp);
+
+  write_source(filename, (long)(megabytes * 1024 * 1024));
+
+  for (j = 0; j < runs; j++) {
+    t = time_file(filename, DivLisp);
+    if (t < best_file) { best_file = t; }
+    t = time_contents(filename, DivLisp);
+    if (t < best_contents) { best_contents = t; }
+  }
+
+  printf("%.1f MB, best of %d\n", megabytes, runs);
+  printf("  stdio (mpc_parse_file)     %.3f s  %.2f MB/s\n", best_file, megabytes / best_file);
+  printf("  mmap  (mpc_parse_contents) %.3f s  %.2f MB/s\n", best_contents, megabytes / best_contents);
+
+  remove(filename);
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, DivLisp);
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*
+** Benchmark of mpc on many short inputs.
+**
+** Parses short DivLisp expressions of about 20 bytes, as a REPL does
+** line by line, and reports parses per second for each way of calling
+** the parser:
+**
+**   mpc_parse                   a new input state for every parse
+**   mpc_parse_with, slices      no copy of the string, slice AST
+**   mpc_parse_context           one input state kept between parses
+**   mpc_parse_context, slices   both of the above
+**
+** Build from the repository root:
+**   cc -std=c99 -O2 -o mpc_context bench/mpc_context.c mpc.c -lm
+** Run:
+**   ./mpc_context [parses]
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mpc.h"
+
+enum { PLAIN, WITH, CONTEXT };
+
+static const char *inputs[] = {
+  "(+ 1 (* 2 3) (- 4 5))",
+  "(def {x} (list 1 2))",
+  "(head {a b c d e f})",
+  "(== (len xs) 10)    ",
+};
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static double time_parses(long n, mpc_parser_t *p, int how, int flags) {
+  mpc_context_t *c = mpc_context_new();
+  mpc_result_t r;
+  const char *s;
+  double t = now();
+  long k;
+  int ok = 0;
+
+  for (k = 0; k < n; k++) {
+    s = inputs[k % 4];
+    switch (how) {
+      case PLAIN:   ok = mpc_parse("<bench>", s, p, &r); break;
+      case WITH:    ok = mpc_parse_with("<bench>", s, p, flags, &r); break;
+      case CONTEXT: ok = mpc_parse_context(c, "<bench>", s, p, flags, &r); break;
+    }
+    if (!ok) { mpc_err_print(r.error); exit(1); }
+    mpc_ast_delete(r.output);
+  }
+
+  t = now() - t;
+  mpc_context_delete(c);
+  return t;
+}
+
+int main(int argc, char **argv) {
+
+  long n = argc > 1 ? atol(argv[1]) : 300000;
+  double t;
+
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *Sexpr = mpc_new("sexpr");
+  mpc_parser_t *Qexpr = mpc_new("qexpr");
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *DivLisp = mpc_new("divlisp");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " number : /-?[0-9]+/ ;                             "
+    " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+    " sexpr  : '(' <expr>* ')' ;                        "
+    " qexpr  : '{' <expr>* '}' ;                        "
+    " expr   : <number> | <symbol> | <sexpr> | <qexpr> ; "
+    " divlisp : /^/ <expr>* /$/ ;                       ",
+    Number, Symbol, Sexpr, Qexpr, Expr, DivLisp);
+
+  printf("%ld parses\n", n);
+
+  t = time_parses(n, DivLisp, PLAIN, 0);
+  printf("  mpc_parse                   %7.3f s  %7.0f parses/s\n", t, n / t);
+  t = time_parses(n, DivLisp, WITH, MPC_PARSE_SLICES);
+  printf("  mpc_parse_with, slices      %7.3f s  %7.0f parses/s\n", t, n / t);
+  t = time_parses(n, DivLisp, CONTEXT, 0);
+  printf("  mpc_parse_context           %7.3f s  %7.0f parses/s\n", t, n / t);
+  t = time_parses(n, DivLisp, CONTEXT, MPC_PARSE_SLICES);
+  printf("  mpc_parse_context, slices   %7.3f s  %7.0f parses/s\n", t, n / t);
+
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, DivLisp);
+  return 0;
+}
@@ -0,0 +1,103 @@
+/*
+** Benchmark of mpc on deeply nested and very wide input.
+**
+** Parses each given file as a string with mpc_parse and the DivLisp
+** grammar, and reports the best of the given number of runs. The inputs
+** in bench/inputs stress the two ends of the input's bookkeeping:
+**
+**   deep.lsp  500 expressions of the form (+ 1 (+ 1 ... 1)), 100 deep,
+**             so the mark stack swings up and down on every line.
+**   wide.lsp  one list of 100,000 numbers, so a single sexpr holds
+**             many children and the small-object pool turns over.
+**
+** Build from the repository root:
+**   cc -std=c99 -O2 -o mpc_nesting bench/mpc_nesting.c mpc.c -lm
+** Run:
+**   ./mpc_nesting [runs] [file ...]
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mpc.h"
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static char *read_source(const char *filename, long *size) {
+  FILE *f = fopen(filename, "rb");
+  char *s;
+  if (f == NULL) { perror(filename); exit(1); }
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  s = malloc(*size + 1);
+  if (fread(s, 1, *size, f) != (size_t)*size) { perror(filename); exit(1); }
+  s[*size] = '\0';
+  fclose(f);
+  return s;
+}
+
+static double time_parse(const char *filename, const char *s, mpc_parser_t *p) {
+  mpc_result_t r;
+  double t = now();
+  if (!mpc_parse(filename, s, p, &r)) { mpc_err_print(r.error); exit(1); }
+  t = now() - t;
+  mpc_ast_delete(r.output);
+  return t;
+}
+
+int main(int argc, char **argv) {
+
+  const char *defaults[] = { "bench/inputs/deep.lsp", "bench/inputs/wide.lsp" };
+  const char **files = defaults;
+  int nfiles = 2;
+  int runs = argc > 1 ? atoi(argv[1]) : 10;
+  double best, t;
+  long size;
+  char *s;
+  int j, k;
+
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *Sexpr = mpc_new("sexpr");
+  mpc_parser_t *Qexpr = mpc_new("qexpr");
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *DivLisp = mpc_new("divlisp");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " number : /-?[0-9]+/ ;                             "
+    " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+    " sexpr  : '(' <expr>* ')' ;                        "
+    " qexpr  : '{' <expr>* '}' ;                        "
+    " expr   : <number> | <symbol> | <sexpr> | <qexpr> ; "
+    " divlisp : /^/ <expr>* /$/ ;                       ",
+    Number, Symbol, Sexpr, Qexpr, Expr, DivLisp);
+
+  if (argc > 2) {
+    files = (const char **)argv + 2;
+    nfiles = argc - 2;
+  }
+
+  printf("best of %d\n", runs);
+  for (k = 0; k < nfiles; k++) {
+    s = read_source(files[k], &size);
+    best = 1e9;
+    for (j = 0; j < runs; j++) {
+      t = time_parse(files[k], s, DivLisp);
+      if (t < best) { best = t; }
+    }
+    printf("  %-24s %7ld bytes  %8.1f ms  %6.2f MB/s\n",
+      files[k], size, best * 1e3, size / best / (1024 * 1024));
+    free(s);
+  }
+
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, DivLisp);
+  return 0;
+}
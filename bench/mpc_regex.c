@@ -0,0 +1,105 @@
+/*
+** Benchmark of mpc's regex parsers.
+**
+** Reports the best of the given number of runs of three parses over about
+** 1 MB of text each:
+**
+**   symbol   the DivLisp symbol regex matching one 1 MB long symbol, so
+**            the time is almost all spent inside a single regex.
+**   tokens   many(tok(number | symbol)) over words separated by spaces,
+**            so each short match is entered and left again.
+**   divlisp  the DivLisp grammar on repeated lines of source, where the
+**            regexes are one part of the work.
+**
+** Build from the repository root:
+**   cc -std=c99 -O2 -o mpc_regex bench/mpc_regex.c mpc.c -lm
+** Run:
+**   ./mpc_regex [runs]
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mpc.h"
+
+#define SIZE (1024 * 1024)
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static double best_parse(const char *s, mpc_parser_t *p, mpc_dtor_t del, int runs) {
+  mpc_result_t r;
+  double best = 1e9, t;
+  int j;
+  for (j = 0; j < runs; j++) {
+    t = now();
+    if (!mpc_parse("<bench>", s, p, &r)) { mpc_err_print(r.error); exit(1); }
+    t = now() - t;
+    del(r.output);
+    if (t < best) { best = t; }
+  }
+  return best;
+}
+
+static void report(const char *name, size_t len, double t) {
+  printf("  %-8s %8zu bytes  %8.1f ms  %8.2f MB/s\n", name, len, t * 1e3, len / t / (1024 * 1024));
+}
+
+int main(int argc, char **argv) {
+
+  int runs = argc > 1 ? atoi(argv[1]) : 3;
+  const char *words[] = { "define-something-long", "x", "12345", "-3", "list->vector", "+", "foo_bar_baz", "42" };
+  const char *line = "(def {fib} (\\ {n} {if (== n 0) {0} {if (== n 1) {1} {+ (fib (- n 1)) (fib (- n 2))}}}))\n";
+  size_t len, n = strlen(line);
+  char *s = malloc(SIZE + 64);
+  int k;
+
+  mpc_parser_t *Sym = mpc_re("[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+");
+  mpc_parser_t *Num = mpc_re("-?[0-9]+");
+  mpc_parser_t *Tokens = mpc_many(mpcf_strfold, mpc_tok(mpc_or(2, Num, mpc_copy(Sym))));
+
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *Sexpr = mpc_new("sexpr");
+  mpc_parser_t *Qexpr = mpc_new("qexpr");
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *DivLisp = mpc_new("divlisp");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " number : /-?[0-9]+/ ;                             "
+    " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+    " sexpr  : '(' <expr>* ')' ;                        "
+    " qexpr  : '{' <expr>* '}' ;                        "
+    " expr   : <number> | <symbol> | <sexpr> | <qexpr> ; "
+    " divlisp : /^/ <expr>* /$/ ;                       ",
+    Number, Symbol, Sexpr, Qexpr, Expr, DivLisp);
+
+  printf("best of %d\n", runs);
+
+  memset(s, 'a', SIZE);
+  s[SIZE] = '\0';
+  report("symbol", SIZE, best_parse(s, Sym, free, runs));
+
+  for (len = 0, k = 0; len < SIZE; k++) {
+    len += sprintf(s + len, "%s ", words[k % 8]);
+  }
+  report("tokens", len, best_parse(s, Tokens, free, runs));
+
+  for (len = 0; len + n <= SIZE; len += n) {
+    memcpy(s + len, line, n);
+  }
+  s[len] = '\0';
+  report("divlisp", len, best_parse(s, DivLisp, (mpc_dtor_t)mpc_ast_delete, runs));
+
+  free(s);
+  mpc_delete(Sym);
+  mpc_delete(Tokens);
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, DivLisp);
+  return 0;
+}
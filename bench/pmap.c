@@ -0,0 +1,116 @@
+/*
+Scaling benchmark for the data-parallel builtins.
+
+Times (preduce {a b} {+ a b} 0 (pmap {x} {* x x} (range 0 n))) with the
+pool off and then with 1, 2, 4, ... workers up to the given maximum.
+Efficiency is the time with the pool off over workers times the time
+with that many workers, so 1.00 is perfect scaling.
+
+Build from the repository root:
+    cc -O2 -o pmap bench/pmap.c mpc.c -ledit -lm -lpthread
+Run:
+    ./pmap [max workers] [n] [runs]
+*/
+#define main divlisp_main
+#include "../variables.c"
+#undef main
+
+#include <time.h>
+
+mpc_parser_t *bench_lisp;
+
+/*The REPL's grammar, kept here so expressions can be read without the REPL*/
+void bench_grammar(void)
+{
+    mpc_parser_t *Number = mpc_new("number");
+    mpc_parser_t *Symbol = mpc_new("symbol");
+    mpc_parser_t *Sexpr = mpc_new("sexpr");
+    mpc_parser_t *Qexpr = mpc_new("qexpr");
+    mpc_parser_t *Expr = mpc_new("expr");
+    bench_lisp = mpc_new("divlisp");
+
+    mpca_lang(MPCA_LANG_DEFAULT,
+              " number : /-?[0-9]+/ ;                             "
+              " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+              " sexpr  : '(' <expr>* ')' ;                        "
+              " qexpr  : '{' <expr>* '}' ;                        "
+              " expr   : <number> | <symbol> | <sexpr> | <qexpr> ; "
+              " divlisp : /^/ <expr>* /$/ ;                       ",
+              Number, Symbol, Sexpr, Qexpr, Expr, bench_lisp);
+}
+
+/*First expression in 's'*/
+lval *bench_read(const char *s)
+{
+    mpc_result_t r;
+    if (!mpc_parse("<bench>", s, bench_lisp, &r))
+    {
+        mpc_err_print(r.error);
+        exit(1);
+    }
+    lval *x = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    return lval_take(x, 0);
+}
+
+double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*Best time of 'runs' evaluations of 'x' with 'workers' pool threads, 0 for none*/
+double bench_run(lenv *e, lval *x, int workers, int runs)
+{
+    char src[32];
+    snprintf(src, sizeof(src), "(parallel %d)", workers);
+    lval_del(lval_eval(e, bench_read(src)));
+
+    double best = 1e9;
+    for (int k = 0; k < runs; k++)
+    {
+        double t = bench_now();
+        lval *r = lval_eval(e, lval_copy(x));
+        t = bench_now() - t;
+        if (r->type == LVAL_ERR)
+        {
+            lval_println(r);
+            exit(1);
+        }
+        lval_del(r);
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    int max = argc > 1 ? atoi(argv[1]) : 8;
+    long n = argc > 2 ? atol(argv[2]) : 1000000;
+    int runs = argc > 3 ? atoi(argv[3]) : 3;
+
+    bench_grammar();
+    lenv *e = lenv_new();
+    lenv_add_builtins(e);
+
+    char src[128];
+    snprintf(src, sizeof(src), "(preduce {a b} {+ a b} 0 (pmap {x} {* x x} (range 0 %ld)))", n);
+    lval *x = bench_read(src);
+
+    double base = bench_run(e, x, 0, runs);
+    printf("pmap and preduce over (range 0 %ld), best of %d\n", n, runs);
+    printf("  workers   time       efficiency\n");
+    printf("  off     %7.3f s\n", base);
+    for (int w = 1; w <= max; w *= 2)
+    {
+        double t = bench_run(e, x, w, runs);
+        printf("  %3d     %7.3f s   %5.2f\n", w, t, base / (w * t));
+    }
+
+    lval_del(lval_eval(e, bench_read("(parallel 0)")));
+    lval_del(x);
+    lenv_del(e);
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+Reader benchmark: the hand-written reader against mpc.
+
+Builds a buffer of the given size by repeating one line of mixed numbers,
+symbols and nested lists, then reads it with lval_read_text and with
+mpc_parse followed by lval_read, as the REPL does with --mpc. Both are
+timed after a warm-up read, and the number of expressions they return
+is checked to match.
+
+Build from the repository root:
+    cc -O2 -o reader bench/reader.c mpc.c -ledit -lm -lpthread
+Run:
+    ./reader [megabytes]
+*/
+#define main divlisp_main
+#include "../variables.c"
+#undef main
+
+#include <time.h>
+
+mpc_parser_t *bench_lisp;
+
+/*The REPL's grammar, kept here so expressions can be read without the REPL*/
+void bench_grammar(void)
+{
+    mpc_parser_t *Number = mpc_new("number");
+    mpc_parser_t *Symbol = mpc_new("symbol");
+    mpc_parser_t *Sexpr = mpc_new("sexpr");
+    mpc_parser_t *Qexpr = mpc_new("qexpr");
+    mpc_parser_t *Expr = mpc_new("expr");
+    bench_lisp = mpc_new("divlisp");
+
+    mpca_lang(MPCA_LANG_DEFAULT,
+              " number : /-?[0-9]+/ ;                             "
+              " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+              " sexpr  : '(' <expr>* ')' ;                        "
+              " qexpr  : '{' <expr>* '}' ;                        "
+              " expr   : <number> | <symbol> | <sexpr> | <qexpr> ; "
+              " divlisp : /^/ <expr>* /$/ ;                       ",
+              Number, Symbol, Sexpr, Qexpr, Expr, bench_lisp);
+}
+
+double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    long size = (argc > 1 ? atol(argv[1]) : 4) << 20;
+    const char *line = "(list {a b c} (+ 1 2 (* 3 -4)) foo-bar 12345 {x {y {z}}})\n";
+    long n = strlen(line);
+    long len = size / n * n;
+
+    char *s = malloc(len + 1);
+    for (long i = 0; i < len; i += n)
+    {
+        memcpy(s + i, line, n);
+    }
+    s[len] = '\0';
+
+    bench_grammar();
+
+    /*Hand-written reader*/
+    char *err = NULL;
+    lval_del(lval_read_text("<bench>", s, len, &err));
+    double t = bench_now();
+    lval *x = lval_read_text("<bench>", s, len, &err);
+    double direct = bench_now() - t;
+    if (!x)
+    {
+        printf("%s\n", err);
+        return 1;
+    }
+
+    /*mpc, then lval_read over its AST*/
+    mpc_result_t r;
+    t = bench_now();
+    if (!mpc_parse("<bench>", s, bench_lisp, &r))
+    {
+        mpc_err_print(r.error);
+        return 1;
+    }
+    double parsed = bench_now() - t;
+    t = bench_now();
+    lval *y = lval_read(r.output);
+    double built = bench_now() - t;
+    mpc_ast_delete(r.output);
+
+    double mb = len / (1024.0 * 1024.0);
+    printf("%.1f MB, %d expressions%s\n", mb, x->count, x->count == y->count ? "" : " (mpc read a different number)");
+    printf("  lval_read_text          %7.3f s  %7.1f MB/s\n", direct, mb / direct);
+    printf("  mpc_parse + lval_read   %7.3f s  %7.1f MB/s  (%.3f s + %.3f s)\n", parsed + built,
+           mb / (parsed + built), parsed, built);
+
+    lval_del(x);
+    lval_del(y);
+    free(s);
+    return 0;
+}
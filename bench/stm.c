@@ -0,0 +1,128 @@
+/*
+Software transactional memory benchmark.
+
+Four futures each run n transactions that add 1 to a ref and then do a
+little more work inside the transaction, so transactions overlap. The
+contention level decides which ref each future alters:
+
+  low     every future has a ref of its own
+  medium  two futures share each of two refs
+  high    all four share one ref
+
+Reports the commit rate and how many attempts had to be retried, and
+checks that no increment was lost.
+
+Build from the repository root:
+    cc -O2 -o stm bench/stm.c mpc.c -ledit -lm -lpthread
+Run:
+    ./stm [workers] [n]
+*/
+#define main divlisp_main
+#include "../variables.c"
+#undef main
+
+#include <time.h>
+
+mpc_parser_t *bench_lisp;
+
+/*The REPL's grammar, kept here so expressions can be read without the REPL*/
+void bench_grammar(void)
+{
+    mpc_parser_t *Number = mpc_new("number");
+    mpc_parser_t *Symbol = mpc_new("symbol");
+    mpc_parser_t *Sexpr = mpc_new("sexpr");
+    mpc_parser_t *Qexpr = mpc_new("qexpr");
+    mpc_parser_t *Expr = mpc_new("expr");
+    bench_lisp = mpc_new("divlisp");
+
+    mpca_lang(MPCA_LANG_DEFAULT,
+              " number : /-?[0-9]+/ ;                             "
+              " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+              " sexpr  : '(' <expr>* ')' ;                        "
+              " qexpr  : '{' <expr>* '}' ;                        "
+              " expr   : <number> | <symbol> | <sexpr> | <qexpr> ; "
+              " divlisp : /^/ <expr>* /$/ ;                       ",
+              Number, Symbol, Sexpr, Qexpr, Expr, bench_lisp);
+}
+
+/*First expression in 's'*/
+lval *bench_read(const char *s)
+{
+    mpc_result_t r;
+    if (!mpc_parse("<bench>", s, bench_lisp, &r))
+    {
+        mpc_err_print(r.error);
+        exit(1);
+    }
+    lval *x = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    return lval_take(x, 0);
+}
+
+double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*Value of 's', exits on an error*/
+lval *bench_eval(lenv *e, const char *s)
+{
+    lval *r = lval_eval(e, bench_read(s));
+    if (r->type == LVAL_ERR)
+    {
+        printf("%s\n  ", s);
+        lval_println(r);
+        exit(1);
+    }
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    int workers = argc > 1 ? atoi(argv[1]) : 4;
+    long n = argc > 2 ? atol(argv[2]) : 20000;
+    char *levels[] = {"low", "medium", "high"};
+    int shared[] = {1, 2, 4};
+    char src[2048];
+
+    bench_grammar();
+    lenv *e = lenv_new();
+    lenv_add_builtins(e);
+
+    snprintf(src, sizeof(src), "(parallel %d)", workers);
+    lval_del(bench_eval(e, src));
+    printf("%d workers, 4 futures of %ld transactions\n", workers, n);
+
+    for (int l = 0; l < 3; l++)
+    {
+        lval_del(bench_eval(e, "(def {r0 r1 r2 r3} (ref 0) (ref 0) (ref 0) (ref 0))"));
+
+        int len = snprintf(src, sizeof(src), "(def {fs} (list");
+        for (int f = 0; f < 4; f++)
+        {
+            len += snprintf(src + len, sizeof(src) - len,
+                            " (future {dotimes {i} %ld {dosync {list (alter {x} {+ x 1} r%d) (dotimes {k} 30 {+ k 1})}}})",
+                            n, f / shared[l]);
+        }
+        snprintf(src + len, sizeof(src) - len, "))");
+
+        atomic_store(&lstm_commits, 0);
+        atomic_store(&lstm_retries, 0);
+        double t = bench_now();
+        lval_del(bench_eval(e, src));
+        lval_del(bench_eval(e, "(for-each {f} fs {touch f})"));
+        t = bench_now() - t;
+
+        lval *total = bench_eval(e, "(+ (deref r0) (deref r1) (deref r2) (deref r3))");
+        long commits = atomic_load(&lstm_commits);
+        long retries = atomic_load(&lstm_retries);
+        printf("  %-6s  %7.3f s  %9.0f commits/s  %8ld retries (%5.1f%%)  %s\n", levels[l], t, commits / t,
+               retries, 100.0 * retries / (commits + retries), total->num == 4.0 * n ? "ok" : "LOST UPDATES");
+        lval_del(total);
+    }
+
+    lenv_del(e);
+    return 0;
+}
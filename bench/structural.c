@@ -0,0 +1,132 @@
+/*
+Structural index benchmark.
+
+Builds the given number of megabytes of indented source, then counts the
+positions the reader has to look at (brackets, both ends of each atom run
+and bytes that fit no class) four ways: a loop over every byte, and
+lread_index with the scalar, SSE2 and AVX2 classifiers. All four have to
+find the same number of positions. Finally the whole buffer is read into
+lvals with lval_read_text, which the index feeds. A size of 1024 gives
+the 1 GB run; the final read then needs several GB of memory.
+
+Build from the repository root:
+    cc -O2 -o structural bench/structural.c mpc.c -ledit -lm -lpthread
+Run:
+    ./structural [megabytes]
+*/
+#define main divlisp_main
+#include "../variables.c"
+#undef main
+
+#include <time.h>
+
+double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*Structural positions found by looking at every byte*/
+long bench_bytes(const char *s, long len)
+{
+    long count = 0;
+    int prev = 0;
+    for (long i = 0; i < len; i++)
+    {
+        char c = s[i];
+        int bracket = c == '(' || c == ')' || c == '{' || c == '}';
+        int atom = lread_is_symbol(c);
+        if (bracket || atom != prev || (!atom && !bracket && !lread_is_space(c)))
+            count++;
+        prev = atom;
+    }
+    return count;
+}
+
+/*Structural positions found through the index, using 'classify'*/
+long bench_index(const char *s, long len, lread_classify_fn classify)
+{
+    lread_index ix;
+    lread_index_init(&ix, s, len);
+    ix.classify = classify;
+
+    long count = 0;
+    while (lread_index_next(&ix) < len)
+        count++;
+    return count;
+}
+
+void bench_report(const char *name, long len, long count, double t)
+{
+    printf("  %-16s %8.3f s  %8.1f MB/s  %ld positions\n", name, t, len / t / (1024 * 1024), count);
+}
+
+int main(int argc, char **argv)
+{
+    long size = (argc > 1 ? atol(argv[1]) : 64) << 20;
+    const char *lines[] = {"(def {fib} (\\ {n} {\n", "    if (== n 0) {0}\n",
+                           "        {if (== n 1) {1} {+ (fib (- n 1)) (fib (- n 2))}}\n", "}))\n",
+                           "(def {xs} {1 2 3 4 5 6 7 8 9 10 -11 -12})   \n", "(map {x} {* x 2} xs)\n"};
+    long len = 0;
+
+    char *s = malloc(size + 128);
+    for (int k = 0; len < size; k++)
+    {
+        long n = strlen(lines[k % 6]);
+        if (len + n > size)
+            break;
+        memcpy(s + len, lines[k % 6], n);
+        len += n;
+    }
+    s[len] = '\0';
+
+    printf("%.1f MB of source\n", len / (1024.0 * 1024.0));
+
+    double t = bench_now();
+    long expect = bench_bytes(s, len);
+    bench_report("byte loop", len, expect, bench_now() - t);
+
+    struct
+    {
+        const char *name;
+        lread_classify_fn classify;
+    } index[] = {{"index scalar", lread_classify_scalar},
+#ifdef LREAD_SIMD
+                 {"index sse2", lread_classify_sse2},
+                 {"index avx2", __builtin_cpu_supports("avx2") ? lread_classify_avx2 : NULL},
+#endif
+                 {NULL, NULL}};
+
+    for (int k = 0; index[k].name; k++)
+    {
+        if (!index[k].classify)
+        {
+            printf("  %-16s not supported here\n", index[k].name);
+            continue;
+        }
+        t = bench_now();
+        long count = bench_index(s, len, index[k].classify);
+        bench_report(index[k].name, len, count, bench_now() - t);
+        if (count != expect)
+        {
+            printf("  %s found %ld positions, the byte loop %ld\n", index[k].name, count, expect);
+            return 1;
+        }
+    }
+
+    char *err = NULL;
+    t = bench_now();
+    lval *x = lval_read_text("<bench>", s, len, &err);
+    t = bench_now() - t;
+    if (!x)
+    {
+        printf("%s\n", err);
+        return 1;
+    }
+    printf("  %-16s %8.3f s  %8.1f MB/s  %d expressions\n", "lval_read_text", t, len / t / (1024 * 1024), x->count);
+
+    lval_del(x);
+    free(s);
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+Transducer benchmark: map (* x 2), filter (- x 6), then sum, over a range.
+
+fused runs the pipeline as one transduce, so each element passes through
+both stages and into the sum before the next is read. unfused builds the
+mapped list with into, then the filtered list, then sums it, as a chain
+of map and filter calls does. Run each mode in its own process so the
+peak RSS belongs to that mode alone.
+
+Build from the repository root:
+    cc -O2 -o transduce bench/transduce.c mpc.c -ledit -lm -lpthread
+Run:
+    ./transduce fused|unfused [n]
+*/
+#define main divlisp_main
+#include "../variables.c"
+#undef main
+
+#include <time.h>
+#include <sys/resource.h>
+
+mpc_parser_t *bench_lisp;
+
+/*The REPL's grammar, kept here so expressions can be read without the REPL*/
+void bench_grammar(void)
+{
+    mpc_parser_t *Number = mpc_new("number");
+    mpc_parser_t *Symbol = mpc_new("symbol");
+    mpc_parser_t *Sexpr = mpc_new("sexpr");
+    mpc_parser_t *Qexpr = mpc_new("qexpr");
+    mpc_parser_t *Expr = mpc_new("expr");
+    bench_lisp = mpc_new("divlisp");
+
+    mpca_lang(MPCA_LANG_DEFAULT,
+              " number : /-?[0-9]+/ ;                             "
+              " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+              " sexpr  : '(' <expr>* ')' ;                        "
+              " qexpr  : '{' <expr>* '}' ;                        "
+              " expr   : <number> | <symbol> | <sexpr> | <qexpr> ; "
+              " divlisp : /^/ <expr>* /$/ ;                       ",
+              Number, Symbol, Sexpr, Qexpr, Expr, bench_lisp);
+}
+
+/*First expression in 's'*/
+lval *bench_read(const char *s)
+{
+    mpc_result_t r;
+    if (!mpc_parse("<bench>", s, bench_lisp, &r))
+    {
+        mpc_err_print(r.error);
+        exit(1);
+    }
+    lval *x = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    return lval_take(x, 0);
+}
+
+double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || (strcmp(argv[1], "fused") != 0 && strcmp(argv[1], "unfused") != 0))
+    {
+        fprintf(stderr, "usage: %s fused|unfused [n]\n", argv[0]);
+        return 1;
+    }
+    int fused = strcmp(argv[1], "fused") == 0;
+    long n = argc > 2 ? atol(argv[2]) : 10000000;
+
+    bench_grammar();
+    lenv *e = lenv_new();
+    lenv_add_builtins(e);
+
+    char src[512];
+    if (fused)
+        snprintf(src, sizeof(src),
+                 "(transduce (comp (xmap {x} {* x 2}) (xfilter {x} {- x 6})) {a x} {+ a x} 0 (range 0 %ld))", n);
+    else
+        snprintf(src, sizeof(src),
+                 "(stream-reduce {a x} {+ a x} 0 (into (xfilter {x} {- x 6}) (into (xmap {x} {* x 2}) (range 0 %ld))))", n);
+    lval *x = bench_read(src);
+
+    double t = bench_now();
+    lval *r = lval_eval(e, x);
+    t = bench_now() - t;
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%s over (range 0 %ld)\n", argv[1], n);
+    printf("  result  ");
+    lval_println(r);
+    printf("  time    %.2f s\n", t);
+    printf("  peak    %.1f MB RSS\n", ru.ru_maxrss / 1024.0);
+
+    lval_del(r);
+    lenv_del(e);
+    return 0;
+}
@@ -1,5 +1,15 @@
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#define MPC_MMAP
+#define MPC_THREADS
+#endif
+
 /*
 ** State Type
 */
@@ -41,11 +51,11 @@ static mpc_state_t mpc_state_new(void) {
 ** by seeking in the file at different positions.
 **
 ** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and
-** only support a single character lookahead at
-** any point, when the input is marked for a
-** potential backtracking we start buffering any
-** input.
+** one. As we assume pipes cannot be seeked, every
+** character read is kept in a ring buffer for as
+** long as some mark could still seek back to it.
+** Characters before the oldest mark (or before
+** the cursor, when nothing is marked) are dropped.
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
@@ -63,18 +73,59 @@ enum {
   MPC_INPUT_PIPE   = 2
 };
 
+/*
+** The text of a string input is either a copy the input owns, the caller's
+** own buffer borrowed for the length of the parse, or a file mapped into
+** memory. All three are read the same way and are bounded by `length`, so
+** borrowed and mapped text needs no terminator.
+*/
+
+enum {
+  MPC_STRING_OWNED    = 0,
+  MPC_STRING_BORROWED = 1,
+  MPC_STRING_MAPPED   = 2
+};
+
 enum {
   MPC_INPUT_MARKS_MIN = 32
 };
 
+enum {
+  MPC_INPUT_BUFFER_MIN = 4096
+};
+
 enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
-typedef struct {
+typedef union mpc_mem_t {
+  union mpc_mem_t *next;
   char mem[64];
 } mpc_mem_t;
 
+enum {
+  MPC_MEMO_SLOTS_MIN = 256,
+  MPC_MEMO_SLOTS_MAX = 262144
+};
+
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  int mode;
+  int stored;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_result_t result;
+} mpc_memo_entry_t;
+
+typedef struct {
+  long mask;
+  mpc_memo_entry_t *entries;
+} mpc_memo_t;
+
+static void mpc_memo_delete(mpc_memo_t *m);
+
 typedef struct {
 
   int type;
@@ -82,7 +133,12 @@ typedef struct {
   mpc_state_t state;
 
   char *string;
+  long length;
+  int storage;
   char *buffer;
+  long buffer_start;
+  long buffer_length;
+  long buffer_mask;
   FILE *file;
 
   int suppress;
@@ -94,10 +150,14 @@ typedef struct {
   char *lasts;
   char last;
 
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
+  int mem_used;
+  mpc_mem_t *mem_free;
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
+  mpc_memo_t *memo;
+  int slices;
+  int errors;
+
 } mpc_input_t;
 
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
@@ -110,9 +170,14 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
 
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->length = strlen(string);
+  i->storage = MPC_STRING_OWNED;
+  i->string = malloc(i->length + 1);
+  memcpy(i->string, string, i->length + 1);
   i->buffer = NULL;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_mask = 0;
   i->file = NULL;
 
   i->suppress = 0;
@@ -123,8 +188,12 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mem_used = 0;
+  i->mem_free = NULL;
+
+  i->memo = NULL;
+  i->slices = 0;
+  i->errors = 0;
 
   return i;
 }
@@ -139,10 +208,15 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
 
   i->state = mpc_state_new();
 
+  i->length = length;
+  i->storage = MPC_STRING_OWNED;
   i->string = malloc(length + 1);
   strncpy(i->string, string, length);
   i->string[length] = '\0';
   i->buffer = NULL;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_mask = 0;
   i->file = NULL;
 
   i->suppress = 0;
@@ -153,8 +227,12 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mem_used = 0;
+  i->mem_free = NULL;
+
+  i->memo = NULL;
+  i->slices = 0;
+  i->errors = 0;
 
   return i;
 
@@ -171,7 +249,12 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
 
   i->string = NULL;
+  i->length = 0;
+  i->storage = MPC_STRING_OWNED;
   i->buffer = NULL;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_mask = 0;
   i->file = pipe;
 
   i->suppress = 0;
@@ -182,8 +265,12 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mem_used = 0;
+  i->mem_free = NULL;
+
+  i->memo = NULL;
+  i->slices = 0;
+  i->errors = 0;
 
   return i;
 
@@ -199,7 +286,12 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
 
   i->string = NULL;
+  i->length = 0;
+  i->storage = MPC_STRING_OWNED;
   i->buffer = NULL;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_mask = 0;
   i->file = file;
 
   i->suppress = 0;
@@ -210,18 +302,152 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mem_used = 0;
+  i->mem_free = NULL;
+
+  i->memo = NULL;
+  i->slices = 0;
+  i->errors = 0;
+
+  return i;
+}
+
+static mpc_input_t *mpc_input_new_borrowed(const char *filename, const char *string, size_t length) {
+
+  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  i->type = MPC_INPUT_STRING;
+
+  i->state = mpc_state_new();
+
+  i->string = (char*)string;
+  i->length = length;
+  i->storage = MPC_STRING_BORROWED;
+  i->buffer = NULL;
+  i->buffer_start = 0;
+  i->buffer_length = 0;
+  i->buffer_mask = 0;
+  i->file = NULL;
+
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->lasts = malloc(sizeof(char) * i->marks_slots);
+  i->last = '\0';
+
+  i->mem_used = 0;
+  i->mem_free = NULL;
+
+  i->memo = NULL;
+  i->slices = 0;
+  i->errors = 0;
+
+  return i;
+}
+
+/*
+** Maps a regular file read-only and reads it as a string, so the parser
+** gets random access to it with no copy and no stdio call per character.
+** Returns NULL when the file cannot be mapped (pipes, terminals, empty
+** files, or platforms without mmap), for the caller to fall back to stdio.
+*/
+
+static mpc_input_t *mpc_input_new_mapped(const char *filename) {
+#ifdef MPC_MMAP
+  struct stat st;
+  void *m = MAP_FAILED;
+  mpc_input_t *i;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) { return NULL; }
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+
+  if (m == MAP_FAILED) { return NULL; }
 
+  i = mpc_input_new_borrowed(filename, m, st.st_size);
+  i->storage = MPC_STRING_MAPPED;
   return i;
+#else
+  (void)filename;
+  return NULL;
+#endif
+}
+
+/*
+** Reads the character at the cursor of a pipe into the ring buffer if it
+** is not there already. The buffer holds the characters from stream
+** position `buffer_start` on, at index `pos & buffer_mask`, and doubles
+** when full, so each character is read from the pipe exactly once.
+** Returns 0 at the end of the stream.
+*/
+
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+
+  long j, slots;
+  char *buffer;
+  int c;
+
+  if (i->state.pos < i->buffer_start + i->buffer_length) { return 1; }
+
+  c = getc(i->file);
+  if (c == EOF) { return 0; }
+
+  if (i->buffer_length == i->buffer_mask + 1 || !i->buffer) {
+    slots = i->buffer ? (i->buffer_mask + 1) * 2 : MPC_INPUT_BUFFER_MIN;
+    buffer = malloc(slots);
+    for (j = i->buffer_start; j < i->buffer_start + i->buffer_length; j++) {
+      buffer[j & (slots - 1)] = i->buffer[j & i->buffer_mask];
+    }
+    free(i->buffer);
+    i->buffer = buffer;
+    i->buffer_mask = slots - 1;
+  }
+
+  i->buffer[(i->buffer_start + i->buffer_length) & i->buffer_mask] = c;
+  i->buffer_length++;
+  return 1;
+}
+
+static char mpc_input_buffer_get(mpc_input_t *i) {
+  return i->buffer[i->state.pos & i->buffer_mask];
+}
+
+/* Drops the buffered characters before the cursor once no mark can reach them */
+static void mpc_input_buffer_drop(mpc_input_t *i) {
+  i->buffer_length -= i->state.pos - i->buffer_start;
+  i->buffer_start = i->state.pos;
+}
+
+/* Hands characters read ahead but never consumed back to the pipe */
+static void mpc_input_buffer_unread(mpc_input_t *i) {
+  long j;
+  for (j = i->buffer_start + i->buffer_length - 1; j >= i->state.pos; j--) {
+    ungetc((unsigned char)i->buffer[j & i->buffer_mask], i->file);
+  }
 }
 
 static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->filename);
 
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  if (i->type == MPC_INPUT_STRING && i->storage == MPC_STRING_OWNED) { free(i->string); }
+#ifdef MPC_MMAP
+  if (i->type == MPC_INPUT_STRING && i->storage == MPC_STRING_MAPPED) { munmap(i->string, i->length); }
+#endif
+  if (i->type == MPC_INPUT_PIPE) {
+    mpc_input_buffer_unread(i);
+    free(i->buffer);
+  }
+
+  if (i->memo) { mpc_memo_delete(i->memo); }
 
   free(i->marks);
   free(i->lasts);
@@ -234,22 +460,26 @@ static int mpc_mem_ptr(mpc_input_t *i, void *p) {
     (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
 }
 
+/*
+** Small blocks come from the input's pool. Freed blocks are threaded onto
+** a free list through their first word and handed out again first; the
+** rest of the pool is handed out in order, so a new input needs no setup.
+*/
+
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
+  mpc_mem_t *p;
 
   if (n > sizeof(mpc_mem_t)) { return malloc(n); }
 
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  if (i->mem_free) {
+    p = i->mem_free;
+    i->mem_free = p->next;
+    return p;
+  }
+
+  if (i->mem_used < MPC_INPUT_MEM_NUM) {
+    return i->mem + i->mem_used++;
+  }
 
   return malloc(n);
 }
@@ -261,10 +491,10 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
+  mpc_mem_t *m = p;
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  m->next = i->mem_free;
+  i->mem_free = m;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
@@ -298,6 +528,18 @@ static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 static void mpc_input_suppress_disable(mpc_input_t *i) { i->suppress--; }
 static void mpc_input_suppress_enable(mpc_input_t *i) { i->suppress++; }
 
+/*
+** The mark stack doubles when full and halves once less than a quarter of
+** it is in use, so nesting that swings around one size does not resize it
+** on every mark and unmark.
+*/
+
+static void mpc_input_marks_resize(mpc_input_t *i, int slots) {
+  i->marks_slots = slots;
+  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+}
+
 static void mpc_input_mark(mpc_input_t *i) {
 
   if (i->backtrack < 1) { return; }
@@ -305,42 +547,27 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks_num++;
 
   if (i->marks_num > i->marks_slots) {
-    i->marks_slots = i->marks_num + i->marks_num / 2;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
-    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+    mpc_input_marks_resize(i, i->marks_slots * 2);
   }
 
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
   i->marks_num--;
 
-  if (i->marks_slots > i->marks_num + i->marks_num / 2
-  &&  i->marks_slots > MPC_INPUT_MARKS_MIN) {
-    i->marks_slots =
-      i->marks_num > MPC_INPUT_MARKS_MIN ?
-      i->marks_num : MPC_INPUT_MARKS_MIN;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
-    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+  if (i->marks_slots > MPC_INPUT_MARKS_MIN
+  &&  i->marks_num < i->marks_slots / 4) {
+    mpc_input_marks_resize(i, i->marks_slots / 2);
   }
 
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
+    mpc_input_buffer_drop(i);
   }
 
 }
@@ -359,33 +586,15 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
-}
-
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
-}
-
 static char mpc_input_getc(mpc_input_t *i) {
 
   char c = '\0';
 
   switch (i->type) {
 
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) { c = getc(i->file); return c; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
+    case MPC_INPUT_PIPE: return mpc_input_buffer_fill(i) ? mpc_input_buffer_get(i) : '\0';
 
     default: return c;
   }
@@ -396,7 +605,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
 
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE:
 
       c = fgetc(i->file);
@@ -405,23 +614,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
       fseek(i->file, -1, SEEK_CUR);
       return c;
 
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+    case MPC_INPUT_PIPE: return mpc_input_buffer_fill(i) ? mpc_input_buffer_get(i) : '\0';
 
     default: return c;
   }
@@ -432,21 +625,12 @@ static int mpc_input_terminated(mpc_input_t *i) {
   return mpc_input_peekc(i) == '\0';
 }
 
-static int mpc_input_failure(mpc_input_t *i, char c) {
+static int mpc_input_failure(mpc_input_t *i) {
 
   switch (i->type) {
     case MPC_INPUT_STRING: { break; }
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
+    case MPC_INPUT_PIPE: { break; }
     default: { break; }
   }
   return 0;
@@ -454,17 +638,14 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
   i->state.col++;
 
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
+    mpc_input_buffer_drop(i);
+  }
+
   if (c == '\n') {
     i->state.col = 0;
     i->state.row++;
@@ -490,35 +671,35 @@ static int mpc_input_char(mpc_input_t *i, char c, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return x == c ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return x == c ? mpc_input_success(i, x, o) : mpc_input_failure(i);
 }
 
 static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i);
 }
 
 static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i);
 }
 
 static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i);
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return cond(x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return cond(x) ? mpc_input_success(i, x, o) : mpc_input_failure(i);
 }
 
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
@@ -601,9 +782,7 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char *char_unescape_buffer) {
 
   char_unescape_buffer[0] = '\'';
   char_unescape_buffer[1] = ' ';
@@ -633,6 +812,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int pos = 0;
   int max = 1023;
   char *buffer = calloc(1, 1024);
+  char received[4];
 
   if (x->failure) {
     mpc_err_string_cat(buffer, &pos, &max,
@@ -657,7 +837,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
 
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->received));
+  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->received, received));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
 
   return realloc(buffer, strlen(buffer) + 1);
@@ -729,6 +909,27 @@ static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   return mpc_export(i, x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  int j;
+  mpc_err_t *y = malloc(sizeof(mpc_err_t));
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->received = x->received;
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   int j;
   (void)i;
@@ -862,6 +1063,7 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   mpc_err_t *y;
   int digits = n/10 + 1;
   char *prefix;
+  if (x == NULL) { return NULL; }
   prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
   sprintf(prefix, "%i of ", n);
   y = mpc_err_repeat(i, x, prefix);
@@ -914,9 +1116,19 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_DFA        = 29
 };
 
+typedef struct {
+  int states_num;
+  int classes_num;
+  unsigned char classes[256];
+  int *trans;
+  char *accept;
+} mpc_dfa_t;
+
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
@@ -934,6 +1146,7 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_dfa_t *d; } mpc_pdata_dfa_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -953,6 +1166,7 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -1011,8 +1225,36 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
   return NULL;
 }
 
+static char mpc_ast_tag_empty[] = "";
+static mpc_ast_t *mpc_ast_new_slice(int tag_id, char *tag, const char *contents, long length);
+
+/*
+** For slice ASTs a terminal's output is nearly always the text it has just
+** consumed, so the node can point at that in the input instead of copying.
+*/
+
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a;
+  long n;
+
+  if (!i->slices) {
+    a = mpc_ast_new("", c);
+    mpc_free(i, c);
+    return a;
+  }
+
+  n = strlen(c);
+  if (i->type == MPC_INPUT_STRING && n <= i->state.pos
+  &&  memcmp(i->string + i->state.pos - n, c, n) == 0) {
+    a = mpc_ast_new_slice(MPC_AST_TAG_EMPTY, mpc_ast_tag_empty, i->string + i->state.pos - n, n);
+  } else {
+    a = mpc_ast_new_slice(MPC_AST_TAG_EMPTY, mpc_ast_tag_empty, "", 0);
+    a->contents = malloc(n + 1);
+    memcpy(a->contents, c, n + 1);
+    a->contents_len = n;
+    a->slice = 0;
+  }
+
   mpc_free(i, c);
   return a;
 }
@@ -1032,6 +1274,100 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
+/*
+** Runs a regex DFA over the `n` bytes left in a string input and returns
+** the length of the match, or -1. Like the end of input, a NUL byte never
+** has a transition.
+*/
+
+static long mpc_dfa_match(mpc_dfa_t *d, const char *s, long n) {
+  long j = 0, last = d->accept[0] ? 0 : -1;
+  int state = 0;
+  while (j < n && s[j] != '\0') {
+    state = d->trans[state * d->classes_num + d->classes[(unsigned char)s[j]]];
+    if (state < 0) { break; }
+    j++;
+    if (d->accept[state]) { last = j; }
+  }
+  return last;
+}
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_dfa_t *d, char **o) {
+
+  long j, n = mpc_dfa_match(d, i->string + i->state.pos, i->length - i->state.pos);
+  const char *s = i->string + i->state.pos;
+
+  if (n < 0) { return 0; }
+
+  for (j = 0; j < n; j++) {
+    i->state.col++;
+    if (s[j] == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
+  }
+  if (n > 0) { i->last = s[n-1]; }
+  i->state.pos += n;
+
+  *o = mpc_malloc(i, n + 1);
+  memcpy(*o, s, n);
+  (*o)[n] = '\0';
+  return 1;
+}
+
+/*
+** Packrat Memo
+**
+** Each named parser notes the position it started from. When it is tried
+** there again (as alternatives sharing a prefix do) its result is kept, and
+** any further attempts replay that result instead of re-parsing. Parsers
+** that are never retried so never pay for copying their output. The table
+** is direct-mapped: a colliding entry evicts the old one, which keeps the
+** memory bounded by the slot count.
+*/
+
+static long mpc_memo_slots(size_t length) {
+  long slots = MPC_MEMO_SLOTS_MIN;
+  while (slots < (long)length * 4 && slots < MPC_MEMO_SLOTS_MAX) { slots *= 2; }
+  return slots;
+}
+
+static mpc_memo_t *mpc_memo_new(size_t length) {
+  mpc_memo_t *m = malloc(sizeof(mpc_memo_t));
+  long slots = mpc_memo_slots(length);
+  m->mask = slots - 1;
+  m->entries = calloc(slots, sizeof(mpc_memo_entry_t));
+  return m;
+}
+
+static void mpc_memo_clear(mpc_memo_entry_t *x) {
+  if (x->p == NULL || !x->stored) { x->p = NULL; return; }
+  if (x->success) { mpc_ast_delete(x->result.output); }
+  else if (x->result.error) { mpc_err_delete(x->result.error); }
+  x->p = NULL;
+}
+
+static void mpc_memo_reset(mpc_memo_t *m) {
+  long j;
+  for (j = 0; j <= m->mask; j++) { mpc_memo_clear(&m->entries[j]); }
+}
+
+static void mpc_memo_delete(mpc_memo_t *m) {
+  mpc_memo_reset(m);
+  free(m->entries);
+  free(m);
+}
+
+static mpc_memo_entry_t *mpc_memo_slot(mpc_memo_t *m, mpc_parser_t *p, long pos) {
+  unsigned long h = ((unsigned long)p >> 4) * 0x9E3779B1UL + (unsigned long)pos;
+  return &m->entries[(h ^ (h >> 16)) & m->mask];
+}
+
+/* Suppression and backtracking change what a parser returns and where it stops */
+static int mpc_memo_mode(mpc_input_t *i) {
+  return (i->suppress ? 1 : 0) | (i->backtrack > 0 ? 2 : 0);
+}
+
 enum {
   MPC_PARSE_STACK_MIN = 4
 };
@@ -1044,7 +1380,9 @@ enum {
 
 #define MPC_MAX_RECURSION_DEPTH 1000
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
+
+static int mpc_parse_run_uncached(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
   int j = 0, k = 0;
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
@@ -1289,6 +1627,19 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
         if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
 
+    /* Compiled Regex */
+
+    case MPC_TYPE_DFA:
+      if (i->type == MPC_INPUT_STRING && !i->errors) {
+        if (mpc_input_dfa(i, p->data.dfa.d, (char**)&r->output)) { MPC_SUCCESS(r->output); }
+        if (i->suppress && i->backtrack > 0) { MPC_FAILURE(NULL); }
+      }
+      if (mpc_parse_run(i, p->data.dfa.x, r, e, depth+1)) {
+        MPC_SUCCESS(r->output);
+      } else {
+        MPC_FAILURE(r->error);
+      }
+
     /* End */
 
     default:
@@ -1304,9 +1655,94 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+
+  int mode, success, retry;
+  long pos;
+  mpc_memo_entry_t *x;
+
+  if (i->memo == NULL || p->name == NULL) {
+    return mpc_parse_run_uncached(i, p, r, e, depth);
+  }
+
+  pos = i->state.pos;
+  mode = mpc_memo_mode(i);
+  x = mpc_memo_slot(i->memo, p, pos);
+
+  retry = x->p == p && x->pos == pos && x->mode == mode;
+
+  if (retry && x->stored) {
+    i->state = x->state;
+    i->last = x->last;
+    if (x->success) {
+      r->output = mpc_ast_copy(x->result.output);
+    } else {
+      r->error = x->result.error ? mpc_err_copy(x->result.error) : NULL;
+    }
+    return x->success;
+  }
+
+  success = mpc_parse_run_uncached(i, p, r, e, depth);
+
+  /* The slot may have been reused by a nested parse in the meantime */
+  mpc_memo_clear(x);
+  x->p = p;
+  x->pos = pos;
+  x->mode = mode;
+  x->stored = retry;
+  if (!retry) { return success; }
+
+  x->success = success;
+  x->state = i->state;
+  x->last = i->last;
+  if (success) {
+    x->result.output = mpc_ast_copy(r->output);
+  } else {
+    x->result.error = r->error ? mpc_err_copy(r->error) : NULL;
+  }
+
+  return success;
+}
+
+/*
+** Most failures during a parse are only backtracked over, so errors are
+** not built on the first run: it runs with errors suppressed, which makes
+** every failure a NULL error. Only if the whole parse fails is it run again
+** from the start, building errors as it goes and reading compiled regexes
+** through their parsers so the message matches a file or pipe parse. Pipes
+** cannot be read twice, so they build errors on the first run.
+*/
+
+static void mpc_input_restart(mpc_input_t *i, mpc_state_t state, char last) {
+  i->state = state;
+  i->last = last;
+  if (i->type == MPC_INPUT_FILE) {
+    fseek(i->file, i->state.pos, SEEK_SET);
+  }
+  if (i->memo) { mpc_memo_reset(i->memo); }
+}
+
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
+  mpc_err_t *e = NULL;
+  mpc_state_t state = i->state;
+  char last = i->last;
+
+  i->errors = 0;
+
+  if (i->type != MPC_INPUT_PIPE) {
+    mpc_input_suppress_enable(i);
+    x = mpc_parse_run(i, p, r, &e, 0);
+    mpc_input_suppress_disable(i);
+    if (x) {
+      r->output = mpc_export(i, r->output);
+      return x;
+    }
+    mpc_input_restart(i, state, last);
+  }
+
+  i->errors = 1;
+  e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
   x = mpc_parse_run(i, p, r, &e, 0);
   if (x) {
@@ -1326,6 +1762,81 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
   return x;
 }
 
+int mpc_parse_with(const char *filename, const char *string, mpc_parser_t *p, int flags, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_borrowed(filename, string, strlen(string));
+  if (flags & MPC_PARSE_PACKRAT) { i->memo = mpc_memo_new(i->length); }
+  if (flags & MPC_PARSE_SLICES)  { i->slices = 1; }
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+/*
+** Parse Contexts
+**
+** A context is a string input kept between parses. Each parse only resets
+** its cursor, marks and small object pool, keeping the storage they have
+** grown, and keeps the packrat memo too while the inputs need one of the
+** same size.
+*/
+
+struct mpc_context_t {
+  mpc_input_t *input;
+};
+
+mpc_context_t *mpc_context_new(void) {
+  mpc_context_t *c = malloc(sizeof(mpc_context_t));
+  c->input = mpc_input_new_borrowed("", "", 0);
+  return c;
+}
+
+void mpc_context_reset(mpc_context_t *c) {
+  mpc_input_t *i = c->input;
+  if (i->memo) {
+    mpc_memo_delete(i->memo);
+    i->memo = NULL;
+  }
+  mpc_input_marks_resize(i, MPC_INPUT_MARKS_MIN);
+}
+
+void mpc_context_delete(mpc_context_t *c) {
+  mpc_input_delete(c->input);
+  free(c);
+}
+
+int mpc_parse_context(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, int flags, mpc_result_t *r) {
+
+  mpc_input_t *i = c->input;
+  size_t length = strlen(string);
+
+  i->filename = realloc(i->filename, strlen(filename) + 1);
+  strcpy(i->filename, filename);
+
+  i->state = mpc_state_new();
+  i->string = (char*)string;
+  i->length = length;
+
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->last = '\0';
+
+  i->mem_used = 0;
+  i->mem_free = NULL;
+
+  if (i->memo && (!(flags & MPC_PARSE_PACKRAT) || i->memo->mask + 1 != mpc_memo_slots(length))) {
+    mpc_memo_delete(i->memo);
+    i->memo = NULL;
+  }
+  if (flags & MPC_PARSE_PACKRAT) {
+    if (i->memo) { mpc_memo_reset(i->memo); } else { i->memo = mpc_memo_new(length); }
+  }
+  i->slices = (flags & MPC_PARSE_SLICES) != 0;
+
+  return mpc_parse_input(i, p, r);
+}
+
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
@@ -1334,6 +1845,14 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
   return x;
 }
 
+int mpc_parse_borrowed(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_borrowed(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
@@ -1352,9 +1871,18 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
 
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 
-  FILE *f = fopen(filename, "rb");
+  mpc_input_t *i = mpc_input_new_mapped(filename);
+  FILE *f;
   int res;
 
+  if (i) {
+    res = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return res;
+  }
+
+  f = fopen(filename, "rb");
+
   if (f == NULL) {
     r->output = NULL;
     r->error = mpc_err_file(filename, "Unable to open file!");
@@ -1372,6 +1900,22 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 
 static void mpc_undefine_unretained(mpc_parser_t *p, int force);
 
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  free(d->trans);
+  free(d->accept);
+  free(d);
+}
+
+static mpc_dfa_t *mpc_dfa_copy(mpc_dfa_t *a) {
+  mpc_dfa_t *d = malloc(sizeof(mpc_dfa_t));
+  memcpy(d, a, sizeof(mpc_dfa_t));
+  d->trans = malloc(sizeof(int) * a->states_num * a->classes_num);
+  memcpy(d->trans, a->trans, sizeof(int) * a->states_num * a->classes_num);
+  d->accept = malloc(a->states_num);
+  memcpy(d->accept, a->accept, a->states_num);
+  return d;
+}
+
 static void mpc_undefine_or(mpc_parser_t *p) {
 
   int i;
@@ -1440,6 +1984,11 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       free(p->data.check_with.e);
       break;
 
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      mpc_dfa_delete(p->data.dfa.d);
+      break;
+
     default: break;
   }
 
@@ -1564,6 +2113,11 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.check_with.e, a->data.check_with.e);
       break;
 
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.d = mpc_dfa_copy(a->data.dfa.d);
+      break;
+
     default: break;
   }
 
@@ -2287,20 +2841,13 @@ static const char *mpc_re_range_escape_char(char c) {
   }
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+static char *mpc_re_range_chars(const char *s, int comp) {
 
-  mpc_parser_t *out;
   size_t i, j;
   size_t start, end;
   const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
   char *range = calloc(1,1);
 
-  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
-  if (s[0] == '^' &&
-      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
-
   for (i = comp; i < strlen(s); i++){
 
     /* Regex Range Escape */
@@ -2342,6 +2889,21 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
 
   }
 
+  return range;
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+
+  mpc_parser_t *out;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range;
+
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  if (s[0] == '^' &&
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+
+  range = mpc_re_range_chars(s, comp);
   out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
 
   free(x);
@@ -2350,6 +2912,286 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** Regex DFA
+**
+** Regexes made only of characters, escapes, `.`, ranges, the repeats
+** `*`, `+`, `?` and `{n}` and groups are also compiled to a DFA, so long
+** as any optional group comes at the very end. Repeats in mpc never give
+** back input, so which item is being matched and how many times it has
+** matched is all the state needed, and matching takes one table lookup
+** per byte. Bytes are first mapped through a 256 entry table to classes
+** that every item treats alike, which keeps the transition table small.
+**
+** Anchors, lookarounds, `|` and repeated groups keep the combinator form
+** only. That form is also kept next to the DFA, and is run to produce an
+** error when the DFA fails on input where errors are not suppressed. A
+** successful DFA match records no errors of its own, so when a later part
+** of the parse fails the message no longer lists ways the matched token
+** could have continued.
+*/
+
+enum {
+  MPC_RE_DFA_ITEMS_MAX = 64,
+  MPC_RE_DFA_COUNT_MAX = 64
+};
+
+typedef struct {
+  char set[256];
+  int min;
+  int max;
+  int seg;
+} mpc_re_dfa_item_t;
+
+typedef struct {
+  const char *s;
+  int mode;
+  int items_num;
+  mpc_re_dfa_item_t items[MPC_RE_DFA_ITEMS_MAX];
+} mpc_re_dfa_t;
+
+static void mpc_re_dfa_chars(char *set, const char *cs) {
+  while (*cs) { set[(unsigned char)*cs++] = 1; }
+}
+
+static int mpc_re_dfa_range(mpc_re_dfa_t *b, char *set) {
+
+  size_t j = 0;
+  int k, comp;
+  char *s, *range;
+
+  while (b->s[j] != '\0' && b->s[j] != ']') {
+    if (b->s[j] == '\\') {
+      if (b->s[j+1] == '\0') { return 0; }
+      j++;
+    }
+    j++;
+  }
+
+  if (b->s[j] != ']' || j == 0) { return 0; }
+  if (j == 1 && b->s[0] == '^') { return 0; }
+
+  s = malloc(j + 1);
+  memcpy(s, b->s, j);
+  s[j] = '\0';
+  b->s += j + 1;
+
+  comp = s[0] == '^' ? 1 : 0;
+  range = mpc_re_range_chars(s, comp);
+  mpc_re_dfa_chars(set, range);
+  free(range);
+  free(s);
+
+  if (comp) {
+    for (k = 0; k < 256; k++) { set[k] = !set[k]; }
+  }
+
+  return 1;
+}
+
+static int mpc_re_dfa_set(mpc_re_dfa_t *b, char *set) {
+
+  int k;
+  char c = *b->s++;
+
+  if ((unsigned char)c >= 0x80) { return 0; }
+
+  switch (c) {
+    case '|': case '^': case '$':
+    case '*': case '+': case '?': case '{':
+      return 0;
+
+    case '.':
+      for (k = 0; k < 256; k++) { set[k] = 1; }
+      if (!(b->mode & MPC_RE_DOTALL)) { set['\n'] = 0; }
+      return 1;
+
+    case '[':
+      return mpc_re_dfa_range(b, set);
+
+    case '\\':
+      c = *b->s++;
+      if (c == '\0' || (unsigned char)c >= 0x80) { return 0; }
+      switch (c) {
+        case 'a': set['\a'] = 1; return 1;
+        case 'f': set['\f'] = 1; return 1;
+        case 'n': set['\n'] = 1; return 1;
+        case 'r': set['\r'] = 1; return 1;
+        case 't': set['\t'] = 1; return 1;
+        case 'v': set['\v'] = 1; return 1;
+        case 'd': mpc_re_dfa_chars(set, "0123456789"); return 1;
+        case 's': mpc_re_dfa_chars(set, " \f\n\r\t\v"); return 1;
+        case 'w':
+          mpc_re_dfa_chars(set, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_");
+          return 1;
+        case 'b': case 'B': case 'A': case 'Z':
+        case 'D': case 'S': case 'W':
+          return 0;
+        default: set[(unsigned char)c] = 1; return 1;
+      }
+
+    default:
+      set[(unsigned char)c] = 1;
+      return 1;
+  }
+}
+
+static int mpc_re_dfa_seq(mpc_re_dfa_t *b, int seg) {
+
+  int k, start;
+  mpc_re_dfa_item_t *x;
+
+  while (*b->s != '\0' && *b->s != ')') {
+
+    /* Groups are flattened, and optional ones start a new segment */
+    if (*b->s == '(') {
+      b->s++;
+      start = b->items_num;
+      if (!mpc_re_dfa_seq(b, seg) || *b->s != ')') { return 0; }
+      b->s++;
+
+      if (*b->s == '*' || *b->s == '+' || *b->s == '{') { return 0; }
+
+      if (*b->s == '?') {
+        b->s++;
+        if (*b->s != '\0' && *b->s != ')') { return 0; }
+        for (k = start; k < b->items_num; k++) { b->items[k].seg++; }
+        continue;
+      }
+
+      for (k = start; k < b->items_num; k++) {
+        if (b->items[k].seg != seg && *b->s != '\0' && *b->s != ')') { return 0; }
+      }
+      continue;
+    }
+
+    if (b->items_num == MPC_RE_DFA_ITEMS_MAX) { return 0; }
+
+    x = &b->items[b->items_num++];
+    memset(x->set, 0, sizeof(x->set));
+    x->seg = seg;
+
+    if (!mpc_re_dfa_set(b, x->set)) { return 0; }
+    x->set[0] = 0;
+
+    switch (*b->s) {
+      case '*': b->s++; x->min = 0; x->max = -1; break;
+      case '+': b->s++; x->min = 1; x->max = -1; break;
+      case '?': b->s++; x->min = 0; x->max =  1; break;
+      case '{':
+        b->s++;
+        if (!isdigit((unsigned char)*b->s)) { return 0; }
+        x->min = 0;
+        while (isdigit((unsigned char)*b->s) && x->min <= MPC_RE_DFA_COUNT_MAX) {
+          x->min = x->min * 10 + (*b->s++ - '0');
+        }
+        if (*b->s != '}' || x->min < 1 || x->min > MPC_RE_DFA_COUNT_MAX) { return 0; }
+        b->s++;
+        x->max = x->min;
+        break;
+      default: x->min = 1; x->max = 1; break;
+    }
+  }
+
+  return 1;
+}
+
+/* States past the start are (item, times matched), capped where it stops mattering */
+static int mpc_re_dfa_cap(mpc_re_dfa_item_t *x) {
+  return x->max > 0 ? x->max : (x->min > 0 ? x->min : 1);
+}
+
+static int mpc_re_dfa_accept(mpc_re_dfa_t *b, int k, int c, int seg) {
+  int j;
+  if (k >= 0 && c < b->items[k].min) { return 0; }
+  for (j = k + 1; j < b->items_num; j++) {
+    if (b->items[j].seg == seg && b->items[j].min > 0) { return 0; }
+  }
+  return 1;
+}
+
+static int mpc_re_dfa_step(mpc_re_dfa_t *b, int *base, int k, int c, int byte) {
+  mpc_re_dfa_item_t *x;
+  while (k < b->items_num) {
+    x = &b->items[k];
+    if ((x->max < 0 || c < x->max) && x->set[byte]) {
+      c = c + 1 > mpc_re_dfa_cap(x) ? mpc_re_dfa_cap(x) : c + 1;
+      return base[k] + c - 1;
+    }
+    if (c < x->min) { return -1; }
+    k++; c = 0;
+  }
+  return -1;
+}
+
+static mpc_dfa_t *mpc_re_dfa_build(mpc_re_dfa_t *b) {
+
+  int j, k, c, byte, state;
+  int base[MPC_RE_DFA_ITEMS_MAX];
+  int reps[256];
+  mpc_dfa_t *d = calloc(1, sizeof(mpc_dfa_t));
+
+  /* Bytes belong to the same class when every item agrees on them */
+  d->classes_num = 1;
+  reps[0] = 0;
+  for (byte = 1; byte < 256; byte++) {
+    for (j = 1; j < d->classes_num; j++) {
+      for (k = 0; k < b->items_num; k++) {
+        if (b->items[k].set[byte] != b->items[k].set[reps[j]]) { break; }
+      }
+      if (k == b->items_num) { break; }
+    }
+    if (j == d->classes_num) { reps[d->classes_num++] = byte; }
+    d->classes[byte] = j;
+  }
+
+  d->states_num = 1;
+  for (k = 0; k < b->items_num; k++) {
+    base[k] = d->states_num;
+    d->states_num += mpc_re_dfa_cap(&b->items[k]);
+  }
+
+  d->trans = malloc(sizeof(int) * d->states_num * d->classes_num);
+  d->accept = malloc(d->states_num);
+
+  d->accept[0] = mpc_re_dfa_accept(b, -1, 0, 0);
+  for (j = 0; j < d->classes_num; j++) {
+    d->trans[j] = j == 0 ? -1 : mpc_re_dfa_step(b, base, 0, 0, reps[j]);
+  }
+
+  for (k = 0; k < b->items_num; k++) {
+    for (c = 1; c <= mpc_re_dfa_cap(&b->items[k]); c++) {
+      state = base[k] + c - 1;
+      d->accept[state] = mpc_re_dfa_accept(b, k, c, b->items[k].seg);
+      for (j = 0; j < d->classes_num; j++) {
+        d->trans[state * d->classes_num + j] =
+          j == 0 ? -1 : mpc_re_dfa_step(b, base, k, c, reps[j]);
+      }
+    }
+  }
+
+  return d;
+}
+
+static mpc_parser_t *mpc_re_dfa(const char *re, int mode, mpc_parser_t *a) {
+
+  mpc_parser_t *p;
+  mpc_re_dfa_t *b = malloc(sizeof(mpc_re_dfa_t));
+
+  b->s = re;
+  b->mode = mode;
+  b->items_num = 0;
+
+  if (!mpc_re_dfa_seq(b, 0) || *b->s != '\0') { free(b); return a; }
+
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.x = a;
+  p->data.dfa.d = mpc_re_dfa_build(b);
+  free(b);
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   return mpc_re_mode(re, MPC_RE_DEFAULT);
 }
@@ -2411,6 +3253,8 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
     mpc_err_delete(r.error);
     free(err_msg);
     r.output = err_out;
+  } else {
+    r.output = mpc_re_dfa(re, mode, r.output);
   }
 
   mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
@@ -2769,6 +3613,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2883,6 +3728,185 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+/*
+** Interned Tags
+**
+** The tags of slice ASTs live in one table for the life of the program,
+** found by hash. It only ever holds the distinct tags of the grammars in
+** use (rule names joined by `|`), so it stays small. Parses on several
+** threads intern into it at once, so it is guarded by a lock where mpc
+** has threads. A tag's string never moves once interned, so nodes hold it
+** directly and only interning takes the lock. The empty and root tags are
+** static so that leaf nodes need no lock at all.
+*/
+
+enum {
+  MPC_AST_TAGS_MIN = 64
+};
+
+static char **mpc_ast_tags = NULL;
+static int mpc_ast_tags_num = 0;
+static int *mpc_ast_tags_hash = NULL;
+static long mpc_ast_tags_mask = -1;
+static char mpc_ast_tag_root[] = ">";
+
+#ifdef MPC_THREADS
+static pthread_mutex_t mpc_ast_tags_lock = PTHREAD_MUTEX_INITIALIZER;
+#define MPC_AST_TAGS_LOCK() pthread_mutex_lock(&mpc_ast_tags_lock)
+#define MPC_AST_TAGS_UNLOCK() pthread_mutex_unlock(&mpc_ast_tags_lock)
+#else
+#define MPC_AST_TAGS_LOCK()
+#define MPC_AST_TAGS_UNLOCK()
+#endif
+
+static unsigned long mpc_ast_tag_hash(const char *t, size_t n) {
+  unsigned long h = 2166136261UL;
+  size_t j;
+  for (j = 0; j < n; j++) { h = (h ^ (unsigned char)t[j]) * 16777619UL; }
+  return h;
+}
+
+static long mpc_ast_tag_find(const char *t, size_t n) {
+  long j = mpc_ast_tag_hash(t, n) & mpc_ast_tags_mask;
+  int id;
+  while ((id = mpc_ast_tags_hash[j]) >= 0) {
+    if (memcmp(mpc_ast_tags[id], t, n) == 0 && mpc_ast_tags[id][n] == '\0') { break; }
+    j = (j + 1) & mpc_ast_tags_mask;
+  }
+  return j;
+}
+
+/* Interns `t`, returning its id and setting `name` to its interned string */
+static int mpc_ast_intern_n(const char *t, size_t n, char **name) {
+
+  long j, slots;
+  int id;
+
+  MPC_AST_TAGS_LOCK();
+
+  if (mpc_ast_tags_hash == NULL || (mpc_ast_tags_num + 1) * 2 > mpc_ast_tags_mask + 1) {
+    slots = mpc_ast_tags_hash ? (mpc_ast_tags_mask + 1) * 2 : MPC_AST_TAGS_MIN;
+    free(mpc_ast_tags_hash);
+    mpc_ast_tags_hash = malloc(sizeof(int) * slots);
+    mpc_ast_tags_mask = slots - 1;
+    for (j = 0; j < slots; j++) { mpc_ast_tags_hash[j] = -1; }
+    for (id = 0; id < mpc_ast_tags_num; id++) {
+      mpc_ast_tags_hash[mpc_ast_tag_find(mpc_ast_tags[id], strlen(mpc_ast_tags[id]))] = id;
+    }
+    mpc_ast_tags = realloc(mpc_ast_tags, sizeof(char*) * slots / 2);
+    if (mpc_ast_tags_num == 0) {
+      mpc_ast_tags_num = 2;
+      mpc_ast_tags[MPC_AST_TAG_EMPTY] = mpc_ast_tag_empty;
+      mpc_ast_tags[MPC_AST_TAG_ROOT] = mpc_ast_tag_root;
+      mpc_ast_tags_hash[mpc_ast_tag_find("", 0)] = MPC_AST_TAG_EMPTY;
+      mpc_ast_tags_hash[mpc_ast_tag_find(">", 1)] = MPC_AST_TAG_ROOT;
+    }
+  }
+
+  j = mpc_ast_tag_find(t, n);
+  id = mpc_ast_tags_hash[j];
+  if (id < 0) {
+    id = mpc_ast_tags_num++;
+    mpc_ast_tags[id] = malloc(n + 1);
+    memcpy(mpc_ast_tags[id], t, n);
+    mpc_ast_tags[id][n] = '\0';
+    mpc_ast_tags_hash[j] = id;
+  }
+  *name = mpc_ast_tags[id];
+
+  MPC_AST_TAGS_UNLOCK();
+  return id;
+}
+
+int mpc_ast_intern(const char *t) {
+  char *name;
+  return mpc_ast_intern_n(t, strlen(t), &name);
+}
+
+/* Interns the concatenation of `a` (all but its last `drop` characters), `sep` and `b` */
+static int mpc_ast_intern_join(const char *a, size_t drop, const char *sep, const char *b, char **name) {
+  char local[256];
+  size_t na = strlen(a) - drop, ns = strlen(sep), nb = strlen(b);
+  char *t = na + ns + nb <= sizeof(local) ? local : malloc(na + ns + nb);
+  int id;
+  memcpy(t, a, na);
+  memcpy(t + na, sep, ns);
+  memcpy(t + na + ns, b, nb);
+  id = mpc_ast_intern_n(t, na + ns + nb, name);
+  if (t != local) { free(t); }
+  return id;
+}
+
+static mpc_ast_t *mpc_ast_new_slice(int tag_id, char *tag, const char *contents, long length) {
+
+  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+
+  a->tag = tag;
+  a->tag_id = tag_id;
+  a->contents = (char*)contents;
+  a->contents_len = length;
+  a->slice = 1;
+
+  a->state = mpc_state_new();
+
+  a->children_num = 0;
+  a->children = NULL;
+  return a;
+}
+
+/* An empty node tagged `tag`, interned when `a` is */
+static mpc_ast_t *mpc_ast_new_like(mpc_ast_t *a, const char *tag) {
+  char *name;
+  int tag_id;
+  if (a && a->tag_id >= 0) {
+    tag_id = mpc_ast_intern_n(tag, strlen(tag), &name);
+    return mpc_ast_new_slice(tag_id, name, "", 0);
+  }
+  return mpc_ast_new(tag, "");
+}
+
+static long mpc_ast_contents_len(mpc_ast_t *a) {
+  return a->slice ? a->contents_len : (long)strlen(a->contents);
+}
+
+static void mpc_ast_delete_strings(mpc_ast_t *a) {
+  if (a->tag_id < 0) { free(a->tag); }
+  if (!a->slice) { free(a->contents); }
+}
+
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *b;
+
+  if (a == NULL) { return NULL; }
+
+  if (a->tag_id >= 0 || a->slice) {
+    b = malloc(sizeof(mpc_ast_t));
+    memcpy(b, a, sizeof(mpc_ast_t));
+    if (a->tag_id < 0) {
+      b->tag = malloc(strlen(a->tag) + 1);
+      strcpy(b->tag, a->tag);
+    }
+    if (!a->slice) {
+      b->contents = malloc(strlen(a->contents) + 1);
+      strcpy(b->contents, a->contents);
+    }
+  } else {
+    b = mpc_ast_new(a->tag, a->contents);
+  }
+  b->state = a->state;
+  b->children_num = a->children_num;
+  b->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = mpc_ast_copy(a->children[i]);
+  }
+
+  return b;
+
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
 
   int i;
@@ -2894,16 +3918,14 @@ void mpc_ast_delete(mpc_ast_t *a) {
   }
 
   free(a->children);
-  free(a->tag);
-  free(a->contents);
+  mpc_ast_delete_strings(a);
   free(a);
 
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
-  free(a->tag);
-  free(a->contents);
+  mpc_ast_delete_strings(a);
   free(a);
 }
 
@@ -2914,9 +3936,13 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   a->tag = malloc(strlen(tag) + 1);
   strcpy(a->tag, tag);
 
-  a->contents = malloc(strlen(contents) + 1);
+  a->contents_len = strlen(contents);
+  a->contents = malloc(a->contents_len + 1);
   strcpy(a->contents, contents);
 
+  a->tag_id = -1;
+  a->slice = 0;
+
   a->state = mpc_state_new();
 
   a->children_num = 0;
@@ -2951,7 +3977,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_like(a, ">");
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2961,7 +3987,8 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   int i;
 
   if (strcmp(a->tag, b->tag) != 0) { return 0; }
-  if (strcmp(a->contents, b->contents) != 0) { return 0; }
+  if (mpc_ast_contents_len(a) != mpc_ast_contents_len(b)) { return 0; }
+  if (memcmp(a->contents, b->contents, mpc_ast_contents_len(a)) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
 
   for (i = 0; i < a->children_num; i++) {
@@ -2980,6 +4007,10 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  if (a->tag_id >= 0) {
+    a->tag_id = mpc_ast_intern_join(t, 0, "|", a->tag, &a->tag);
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -2989,6 +4020,10 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  if (a->tag_id >= 0) {
+    a->tag_id = mpc_ast_intern_join(t, 1, "", a->tag, &a->tag);
+    return a;
+  }
   a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
@@ -2996,6 +4031,10 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  if (a->tag_id >= 0) {
+    a->tag_id = mpc_ast_intern_n(t, strlen(t), &a->tag);
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -3018,11 +4057,11 @@ static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
 
   for (i = 0; i < d; i++) { fprintf(fp, "  "); }
 
-  if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
+  if (mpc_ast_contents_len(a)) {
+    fprintf(fp, "%s:%lu:%lu '%.*s'\n", a->tag,
       (long unsigned int)(a->state.row+1),
       (long unsigned int)(a->state.col+1),
-      a->contents);
+      (int)mpc_ast_contents_len(a), a->contents);
   } else {
     fprintf(fp, "%s \n", a->tag);
   }
@@ -3220,7 +4259,8 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
 
-  r = mpc_ast_new(">", "");
+  for (i = 0; i < n - 1 && as[i] == NULL; i++) { }
+  r = mpc_ast_new_like(as[i], ">");
 
   for (i = 0; i < n; i++) {
 
@@ -3818,11 +4858,19 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
 
   va_list va;
 
-  FILE *f = fopen(filename, "rb");
+  FILE *f = NULL;
 
-  if (f == NULL) {
-    err = mpc_err_file(filename, "Unable to open file!");
-    return err;
+  i = mpc_input_new_mapped(filename);
+
+  if (i == NULL) {
+    f = fopen(filename, "rb");
+
+    if (f == NULL) {
+      err = mpc_err_file(filename, "Unable to open file!");
+      return err;
+    }
+
+    i = mpc_input_new_file(filename, f);
   }
 
   va_start(va, filename);
@@ -3832,14 +4880,13 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   st.parsers = NULL;
   st.flags = flags;
 
-  i = mpc_input_new_file(filename, f);
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
 
   free(st.parsers);
   va_end(va);
 
-  fclose(f);
+  if (f) { fclose(f); }
 
   return err;
 }
@@ -3855,6 +4902,7 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3907,6 +4955,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_DFA)        { mpc_optimise_unretained(p->data.dfa.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
@@ -71,6 +71,51 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Parses `length` bytes of `string` in place, without copying them. The
+** string must stay alive and unchanged until the parse returns, and need
+** not be NUL terminated. `mpc_parse_contents` maps regular files into
+** memory and parses them the same way.
+*/
+
+int mpc_parse_borrowed(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+
+/*
+** Packrat parsing memoizes the result of every named parser at each input
+** position it is tried. Outputs of named parsers must be `mpc_ast_t` (as
+** with grammars built by `mpca_lang`). Errors for memoized failures only
+** list what the named parser itself expected.
+**
+** `MPC_PARSE_SLICES` builds a slice AST (see below), and `mpc_parse_with`
+** never copies the input string, so it can stay borrowed by the tree.
+*/
+
+enum {
+  MPC_PARSE_DEFAULT = 0,
+  MPC_PARSE_PACKRAT = 1,
+  MPC_PARSE_SLICES  = 2
+};
+
+int mpc_parse_with(const char *filename, const char *string, mpc_parser_t *p, int flags, mpc_result_t *r);
+
+/*
+** A parse context holds the input state `mpc_parse_with` would otherwise
+** build and free on every call, so it suits parsing many short strings.
+** `mpc_parse_context` takes the same arguments and borrows the string in
+** the same way. A context serves one parse at a time, so keep one per
+** thread; parsers can be shared, and so can the tags of slice ASTs.
+** `mpc_context_reset` gives back memory grown by unusually large or deep
+** inputs.
+*/
+
+struct mpc_context_t;
+typedef struct mpc_context_t mpc_context_t;
+
+mpc_context_t *mpc_context_new(void);
+void mpc_context_reset(mpc_context_t *c);
+void mpc_context_delete(mpc_context_t *c);
+int mpc_parse_context(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, int flags, mpc_result_t *r);
+
 /*
 ** Function Types
 */
@@ -281,14 +326,33 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+/*
+** In a slice AST every `tag` is interned: it points into a table shared by
+** all slice ASTs and `tag_id` is its index there, so tags can be told apart
+** with a switch. `contents` mostly points straight into the input string,
+** in which case `slice` is set, the contents are `contents_len` bytes long
+** and are not NUL terminated, and the input must outlive the tree. Nodes
+** that own their strings have a `tag_id` of -1 and `slice` unset.
+*/
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  int tag_id;
+  int slice;
+  long contents_len;
 } mpc_ast_t;
 
+enum {
+  MPC_AST_TAG_EMPTY = 0,
+  MPC_AST_TAG_ROOT  = 1
+};
+
+int mpc_ast_intern(const char *tag);
+
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
@@ -298,6 +362,8 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
+
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
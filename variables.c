@@ -1,5 +1,15 @@
+//MAP_ANONYMOUS, MAP_NORESERVE and clock_gettime are extensions a strict -std=c99 hides
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 #include "mpc.h"
 
 //If we are compiling on a Windows, include these functions
@@ -47,17 +57,348 @@ enum
     LVAL_SYM,   //Operator of S-Expression/Q-Expression
     LVAL_SEXPR, //Actual S-Expression
     LVAL_QEXPR, //Actual Q-Expression
-    LVAL_FUN    //Function Type
+    LVAL_FUN,   //Function Type
+    LVAL_MACRO, //Macro Type
+    LVAL_MEMO,   //Memo Table Type
+    LVAL_PROMISE, //Delayed Expression Type
+    LVAL_STREAM,  //Lazy Stream Type
+    LVAL_RANGE,   //Integer Range Type
+    LVAL_XFORM,   //Transducer Type
+    LVAL_FUTURE,  //Background Evaluation Type
+    LVAL_CORO,    //Coroutine Type
+    LVAL_ACTOR,   //Actor Type
+    LVAL_REF      //Transactional Reference Type
+};
+
+/* Create Enumeration of Possible Error Codes */
+enum
+{
+    LERR_CUSTOM,    //Message already formatted into err
+    LERR_STATIC,    //Message is the string literal in errstr
+    LERR_DIV_ZERO,
+    LERR_BAD_NUM,
+    LERR_UNBOUND,   //Symbol name stored in err
+    LERR_NOT_FUN,
+    LERR_ARG_TYPE,  //Function errstr, argument index, got type, expected type
+    LERR_ARG_COUNT, //Function errstr, got count, expected count
+    LERR_ARG_EMPTY, //Function errstr, argument index
+    LERR_RETRY      //Transaction conflict, dosync restarts the transaction
 };
 
 typedef lval *(*lbuiltin)(lenv *, lval *);
 
+/*Memo tables map argument lists to results, bounded by a byte budget with least recently used eviction*/
+struct lmemo_entry;
+typedef struct lmemo_entry lmemo_entry;
+
+struct lmemo_entry
+{
+    unsigned long hash;
+    lval *key;
+    lval *value;
+    long bytes;
+
+    /*Chain within a hash bucket, and neighbours in the recency list*/
+    lmemo_entry *next;
+    lmemo_entry *newer;
+    lmemo_entry *older;
+};
+
+typedef struct
+{
+    /*Shared by every copy of the lvals referring to the table, which may live on other threads*/
+    atomic_int refs;
+
+    long budget;
+    long bytes;
+    long hits;
+    long misses;
+    long evictions;
+
+    int count;
+    int slots;
+    lmemo_entry **buckets;
+    lmemo_entry *newest;
+    lmemo_entry *oldest;
+} lmemo;
+
+/*Budget of tables created without an explicit one*/
+#define LMEMO_DEFAULT_BUDGET (1024 * 1024)
+
+/*The numbers start, start + step, ... up to but excluding end, never stored one by one*/
+typedef struct
+{
+    double start;
+    double end;
+    double step;
+} lrange;
+
+/*A delayed expression, evaluated by the first force and then remembered*/
+typedef struct
+{
+    atomic_int refs;
+    lval *code;
+    lval *value;
+} lpromise;
+
+/*Kinds of stream, each a recipe node producing its elements on demand*/
+enum
+{
+    LSTREAM_LIST,    //Elements of the Q-Expression in items
+    LSTREAM_ITERATE, //items, then body applied to the previous element, forever
+    LSTREAM_CONS,    //items, followed by the stream the promise in tail forces to
+    LSTREAM_MAP,
+    LSTREAM_FILTER,
+    LSTREAM_TAKE,
+    LSTREAM_DROP
+};
+
+/*Streams are immutable recipes shared between copies, consuming one creates an lstream_iter*/
+struct lstream;
+typedef struct lstream lstream;
+
+struct lstream
+{
+    atomic_int refs;
+    int kind;
+    lval *items;
+    lval *binders;
+    lval *body;
+    lval *tail;
+    lstream *src;
+    double n;
+};
+
+/*Consumption state of a stream, only ever holding the element being produced*/
+struct lstream_iter;
+typedef struct lstream_iter lstream_iter;
+
+struct lstream_iter
+{
+    lstream *s;
+    lstream_iter *src;
+    lstream *node;
+    lval *cur;
+    long index;
+    double n;
+};
+
+/*Kinds of transducer stage*/
+enum
+{
+    LXFORM_MAP,
+    LXFORM_FILTER,
+    LXFORM_TAKE,
+    LXFORM_DROP
+};
+
+typedef struct
+{
+    int kind;
+    lval *binders;
+    lval *body;
+    double n;
+} lxform_stage;
+
+/*Transducers are a shared chain of stages, each element passes through all of them before the next is read*/
+typedef struct
+{
+    atomic_int refs;
+    int count;
+    lxform_stage *stages;
+} lxform;
+
+/*Unit of work for the thread pool, embedded as the first member of whatever the work needs*/
+struct ltask;
+typedef struct ltask ltask;
+
+struct ltask
+{
+    void (*run)(ltask *);
+
+    /*Decremented once the task has run, NULL if nobody waits for it*/
+    atomic_int *pending;
+};
+
+/*An expression evaluated on the pool in a snapshot of the environment, its value is kept once done*/
+typedef struct
+{
+    ltask task;
+    atomic_int refs;
+
+    lenv *env;
+    lval *code;
+    lval *value;
+
+    atomic_int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} lfuture;
+
+/*
+Saved execution context of a coroutine or of whoever resumed it.
+On x86-64 and aarch64 it is just the stack pointer, the callee saved registers live on the stack itself.
+Elsewhere (or with LCORO_UCONTEXT defined) ucontext does the job, more slowly.
+*/
+#if (defined(__x86_64__) || defined(__aarch64__)) && !defined(LCORO_UCONTEXT)
+#define LCTX_ASM
+typedef void *lctx;
+#else
+#include <ucontext.h>
+typedef ucontext_t lctx;
+#endif
+
+/*States of a coroutine*/
+enum
+{
+    LCORO_NEW,
+    LCORO_SUSPENDED,
+    LCORO_RUNNING,
+    LCORO_DONE
+};
+
+/*A body evaluated on a stack of its own, which can yield values and be resumed where it left off*/
+struct lcoro;
+typedef struct lcoro lcoro;
+
+struct lcoro
+{
+    atomic_int refs;
+    int state;
+
+    /*Set when the last reference goes away while suspended, making yield fail so the body unwinds*/
+    int cancel;
+
+    lctx ctx;
+    lctx caller;
+    char *stack;
+
+    lenv *env;
+    lval *code;
+
+    /*Value passed by resume to yield, by yield to resume, or the error that ended the body*/
+    lval *transfer;
+
+    /*Coroutine running when this one was resumed*/
+    lcoro *prev;
+};
+
+/*A message queued in a mailbox*/
+struct lmsg;
+typedef struct lmsg lmsg;
+
+struct lmsg
+{
+    _Atomic(lmsg *) next;
+    lval *v;
+};
+
+/*
+Lock free mailbox with many senders and one receiver (Vyukov's intrusive MPSC queue).
+Senders swap themselves in at head, the receiver takes from tail, 'stub' keeps the queue from ever being empty.
+*/
+typedef struct
+{
+    _Atomic(lmsg *) head;
+    _Atomic(lmsg *) tail;
+    lmsg stub;
+} lmailbox;
+
+/*
+An actor evaluates its body in an environment of its own, on a coroutine scheduled as a task on the pool.
+It only runs while it has messages to process: receive on an empty mailbox suspends it, and the next send
+schedules it again. Threads that are not actors get an external actor, whose receive blocks the thread.
+*/
+typedef struct
+{
+    ltask task;
+    atomic_int refs;
+    lmailbox mailbox;
+
+    /*Set while the actor is queued or running, only whoever sets it schedules the actor*/
+    atomic_int scheduled;
+    int waiting;
+    atomic_int done;
+    lcoro *coro;
+
+    int external;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} lactor;
+
+/*The value a ref holds as of one commit, readers pin it so a later commit cannot free it under them*/
+typedef struct
+{
+    atomic_int refs;
+    lval *v;
+} lref_box;
+
+/*
+A transactional reference cell.
+'lock' is the version of the last commit shifted left by one, its low bit is set while a commit writes the ref.
+*/
+typedef struct
+{
+    atomic_int refs;
+    atomic_long lock;
+
+    /*Held only to swap 'box' or to take a reference to it*/
+    atomic_flag pin;
+    lref_box *box;
+} lref;
+
+/*
+A transaction running on the calling thread (TL2).
+Reads are checked against the clock value 'rv' taken when the transaction started,
+writes stay private until the commit locks the refs written and publishes them all under one new version.
+*/
+typedef struct
+{
+    long rv;
+
+    int reads_count;
+    lref **reads;
+
+    int writes_count;
+    lref **writes;
+    lval **written;
+} ltx;
+
+/*Open addressing index from the hash of a symbol to its entry, -1 marks a free slot*/
+typedef struct
+{
+    int mask;
+    atomic_int slots[];
+} lenv_hindex;
+
 /*lenv struct*/
 struct lenv
 {
-    int count;
-    char **syms;
-    lval **vals;
+    /*
+    Entries are only ever added. A shared environment is read by other threads while it changes:
+    'count' publishes each new entry, and arrays and values are replaced by swapping pointers,
+    so readers never wait. What is swapped out is freed once no reader can still hold it.
+    */
+    atomic_int count;
+    int cap;
+    char **_Atomic syms;
+    _Atomic(lval *) *_Atomic vals;
+
+    /*Built once the environment has LENV_INDEX_MIN entries*/
+    _Atomic(lenv_hindex *) index;
+
+    /*Set for the global environment*/
+    int shared;
+
+    /*Environment that lookups fall back to, set for the private environments of parallel work*/
+    lenv *par;
+
+    /*Stored code running in place, def retires these here instead of deleting them if it replaces one*/
+    int running;
+    int running_cap;
+    lval **running_code;
+    int retired_count;
+    lval **retired;
 };
 
 /* Declare New lval Struct */
@@ -71,15 +412,89 @@ struct lval
     char *sym;
     lbuiltin fun;
 
+    /*Shared runtime objects, which one is in use depends on the type*/
+    union
+    {
+        lmemo *memo;         //Memoized functions and Memo Tables
+        lpromise *promise;   //Promises
+        lstream *stream;     //Streams
+        lrange range;        //Ranges
+        lxform *xform;       //Transducers
+        lfuture *future;     //Futures
+        lcoro *coro;         //Coroutines
+        lactor *actor;       //Actors
+        lref *ref;           //Transactional References
+    };
+
+    /*Error types carry a code plus the arguments of their message, formatted only when printed*/
+    int errcode;
+    const char *errstr;
+    int errargs[3];
+
     /*Count and Pointer to a list of "lval*" */
     int count;
     lval **cell;
+
+    /*S-Expressions cache their macro expansion, valid while expansion_epoch matches lmacro_epoch*/
+    lval *expansion;
+    int expansion_epoch;
 };
 
+/*Macro expansion bookkeeping, shared by every thread evaluating code*/
+atomic_int lmacro_epoch = 0;
+atomic_long lmacro_expansions = 0;
+atomic_long lmacro_hits = 0;
+
+/*
+Each thread keeps the lvals it frees in a cache of its own and allocates from it first,
+so threads building results at the same time do not contend on the allocator.
+Cached lvals are chained through 'expansion'.
+*/
+#define LVAL_CACHE_MAX 4096
+
+static __thread lval *lval_cache = NULL;
+static __thread int lval_cache_count = 0;
+
+lval *lval_alloc(void)
+{
+    lval *v = lval_cache;
+    if (!v)
+        return malloc(sizeof(lval));
+
+    lval_cache = v->expansion;
+    lval_cache_count--;
+    return v;
+}
+
+void lval_free(lval *v)
+{
+    if (lval_cache_count == LVAL_CACHE_MAX)
+    {
+        free(v);
+        return;
+    }
+
+    v->expansion = lval_cache;
+    lval_cache = v;
+    lval_cache_count++;
+}
+
+/*Give the lvals cached by the calling thread back to the allocator, before the thread exits*/
+void lval_cache_clear(void)
+{
+    while (lval_cache)
+    {
+        lval *v = lval_cache;
+        lval_cache = v->expansion;
+        free(v);
+    }
+    lval_cache_count = 0;
+}
+
 /* Construct a pointer to a new Number lval */
 lval *lval_num(double x)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_NUM;
     v->num = x;
     return v;
@@ -88,8 +503,10 @@ lval *lval_num(double x)
 /* Construct a pointer to a new Error lval */
 lval *lval_err(char *fmt, ...)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_ERR;
+    v->errcode = LERR_CUSTOM;
+    v->errstr = NULL;
 
     /* Create a va list and initialize it */
     va_list va;
@@ -110,10 +527,34 @@ lval *lval_err(char *fmt, ...)
     return v;
 }
 
+/* Construct a pointer to a new structured Error lval */
+/* Nothing is formatted here, the code and arguments are only turned into a message by lval_err_format */
+lval *lval_err_code(int code, const char *str, int a, int b, int c)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_ERR;
+    v->err = NULL;
+    v->errcode = code;
+    v->errstr = str;
+    v->errargs[0] = a;
+    v->errargs[1] = b;
+    v->errargs[2] = c;
+    return v;
+}
+
+/* Construct an Error lval for an unbound symbol, keeping a copy of its name */
+lval *lval_err_unbound(char *sym)
+{
+    lval *v = lval_err_code(LERR_UNBOUND, NULL, 0, 0, 0);
+    v->err = malloc(strlen(sym) + 1);
+    strcpy(v->err, sym);
+    return v;
+}
+
 /* Construct a pointer to a new Symbol lval */
 lval *lval_sym(char *s)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_SYM;
     v->sym = malloc(strlen(s) + 1);
     strcpy(v->sym, s);
@@ -123,32 +564,132 @@ lval *lval_sym(char *s)
 /* A pointer to a new empty Sexpr lval */
 lval *lval_sexpr(void)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_SEXPR;
     v->count = 0;
     v->cell = NULL;
+    v->expansion = NULL;
     return v;
 }
 
 /* A pointer to a new empty Qexpr lval */
 lval *lval_qexpr(void)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_QEXPR;
     v->count = 0;
     v->cell = NULL;
+    v->expansion = NULL;
     return v;
 }
 
 /* A pointer to a new empty Fun lval */
 lval *lval_fun(lbuiltin func)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc();
     v->type = LVAL_FUN;
     v->fun = func;
+    v->memo = NULL;
+    return v;
+}
+
+/*
+A pointer to a new Macro lval
+Its cells hold the parameter list, the template, and the symbols the template
+binds itself, which are renamed on every expansion to keep the macro hygienic.
+*/
+lval *lval_macro(lval *params, lval *body, lval *binders)
+{
+    lval *v = lval_qexpr();
+    v->type = LVAL_MACRO;
+    v->count = 3;
+    v->cell = malloc(sizeof(lval *) * 3);
+    v->cell[0] = params;
+    v->cell[1] = body;
+    v->cell[2] = binders;
+    return v;
+}
+
+void lmemo_release(lmemo *m);
+
+/* A pointer to a new Memo Table lval, taking a reference to 'm' */
+lval *lval_memo(lmemo *m)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_MEMO;
+    v->fun = NULL;
+    v->memo = m;
+    m->refs++;
+    return v;
+}
+
+void lpromise_release(lpromise *p);
+void lstream_release(lstream *s);
+void lxform_release(lxform *t);
+void lfuture_release(lfuture *f);
+void lcoro_release(lcoro *c);
+void lactor_release(lactor *a);
+void lref_release(lref *r);
+
+/* A pointer to a new Promise lval delaying the evaluation of 'code' */
+lval *lval_promise(lval *code)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_PROMISE;
+    v->promise = malloc(sizeof(lpromise));
+    v->promise->refs = 1;
+    v->promise->code = code;
+    v->promise->value = NULL;
+    return v;
+}
+
+/* A pointer to a new Stream lval of the given kind, its parts are filled in by the caller */
+lval *lval_stream(int kind)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_STREAM;
+    v->stream = calloc(1, sizeof(lstream));
+    v->stream->refs = 1;
+    v->stream->kind = kind;
+    return v;
+}
+
+/* A pointer to a new Transducer lval with room for 'count' stages, filled in by the caller */
+lval *lval_xform(int count)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_XFORM;
+    v->xform = malloc(sizeof(lxform));
+    v->xform->refs = 1;
+    v->xform->count = count;
+    v->xform->stages = calloc(count, sizeof(lxform_stage));
+    return v;
+}
+
+/* A pointer to a new Range lval */
+lval *lval_range(double start, double end, double step)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_RANGE;
+    v->range.start = start;
+    v->range.end = end;
+    v->range.step = step;
     return v;
 }
 
+/*Number of elements of a Range, computed rather than counted*/
+long lrange_len(lval *v)
+{
+    double n = (v->range.end - v->range.start) / v->range.step;
+    return n > 0 ? (long)ceil(n) : 0;
+}
+
+/*Element 'i' of a Range*/
+double lrange_nth(lval *v, long i)
+{
+    return v->range.start + i * v->range.step;
+}
+
 /*Destructor for lval struct field*/
 void lval_del(lval *v)
 {
@@ -167,24 +708,59 @@ void lval_del(lval *v)
         free(v->sym);
         break;
 
-    /*If Sexpr or Qexpr, then delete all elements inside*/
+    /*If Sexpr, Qexpr or Macro, then delete all elements inside*/
     case LVAL_QEXPR:
     case LVAL_SEXPR:
+    case LVAL_MACRO:
         for (int i = 0; i < v->count; i++)
         {
             lval_del(v->cell[i]);
         }
 
-    case LVAL_FUN:
-        break;
+        /*Along with any cached macro expansion*/
+        if (v->expansion)
+        {
+            lval_del(v->expansion);
+        }
 
         /*Also free the memory allocated to contain the pointers*/
         free(v->cell);
         break;
+
+    /*Drop the reference to a shared memo table*/
+    case LVAL_FUN:
+    case LVAL_MEMO:
+        if (v->memo)
+        {
+            lmemo_release(v->memo);
+        }
+        break;
+
+    case LVAL_PROMISE:
+        lpromise_release(v->promise);
+        break;
+    case LVAL_STREAM:
+        lstream_release(v->stream);
+        break;
+    case LVAL_XFORM:
+        lxform_release(v->xform);
+        break;
+    case LVAL_FUTURE:
+        lfuture_release(v->future);
+        break;
+    case LVAL_CORO:
+        lcoro_release(v->coro);
+        break;
+    case LVAL_ACTOR:
+        lactor_release(v->actor);
+        break;
+    case LVAL_REF:
+        lref_release(v->ref);
+        break;
     }
 
     /*Free the memory allocated for the "lval" struct itself*/
-    free(v);
+    lval_free(v);
 }
 
 lval *lval_add(lval *v, lval *x)
@@ -195,116 +771,651 @@ lval *lval_add(lval *v, lval *x)
     return v;
 }
 
-lval *lval_read_num(mpc_ast_t *t)
+lval *lval_sym_n(const char *s, long n);
+lval *lval_read_num_n(const char *s, long n);
+
+/*What an AST tag means to lval_read*/
+enum
 {
-    /* Check if there is some error in conversion */
-    errno = 0;
-    double x = strtof(t->contents, NULL);
-    return errno != ERANGE ? lval_num(x) : lval_err("Invalid Number!!");
-}
+    LREAD_TAG_UNSEEN,
+    LREAD_TAG_NUMBER,
+    LREAD_TAG_SYMBOL,
+    LREAD_TAG_SEXPR,
+    LREAD_TAG_QEXPR,
+    LREAD_TAG_REGEX,
+    LREAD_TAG_OTHER
+};
 
-lval *lval_read(mpc_ast_t *t)
+/*Interned tags are few, those with larger ids are matched by name every time*/
+#define LREAD_TAG_CACHE 256
+
+/*
+Kinds of the interned tags met so far, indexed by tag id, so each tag is matched by name only once.
+Threads reading slice ASTs share it. It never moves, and a racing store writes the same kind.
+*/
+_Atomic char lread_tag_kinds[LREAD_TAG_CACHE];
+
+int lread_tag_kind_of(const char *tag)
 {
+    if (strstr(tag, "number"))
+        return LREAD_TAG_NUMBER;
+    if (strstr(tag, "symbol"))
+        return LREAD_TAG_SYMBOL;
+    if (strstr(tag, "qexpr"))
+        return LREAD_TAG_QEXPR;
+    if (strstr(tag, "sexpr") || strcmp(tag, ">") == 0)
+        return LREAD_TAG_SEXPR;
+    if (strcmp(tag, "regex") == 0)
+        return LREAD_TAG_REGEX;
+    return LREAD_TAG_OTHER;
+}
 
-    /*If String or Number return conversion to that type*/
-    if (strstr(t->tag, "number"))
-    {
-        return lval_read_num(t);
-    }
+int lread_tag_kind(mpc_ast_t *t)
+{
+    if (t->tag_id < 0 || t->tag_id >= LREAD_TAG_CACHE)
+        return lread_tag_kind_of(t->tag);
 
-    if (strstr(t->tag, "symbol"))
+    int kind = atomic_load_explicit(&lread_tag_kinds[t->tag_id], memory_order_relaxed);
+    if (kind == LREAD_TAG_UNSEEN)
     {
-        return lval_sym(t->contents);
+        kind = lread_tag_kind_of(t->tag);
+        atomic_store_explicit(&lread_tag_kinds[t->tag_id], kind, memory_order_relaxed);
     }
+    return kind;
+}
 
-    /*If root(>), sexpr or qexpr then create empty list*/
+lval *lval_read(mpc_ast_t *t)
+{
+    /*If String or Number return conversion to that type, if root(>), sexpr or qexpr then create empty list*/
     lval *x = NULL;
-    if (strcmp(t->tag, ">") == 0)
-    {
-        x = lval_sexpr();
-    }
-    if (strstr(t->tag, "sexpr"))
+    switch (lread_tag_kind(t))
     {
+    case LREAD_TAG_NUMBER:
+        return lval_read_num_n(t->contents, t->contents_len);
+    case LREAD_TAG_SYMBOL:
+        return lval_sym_n(t->contents, t->contents_len);
+    case LREAD_TAG_SEXPR:
         x = lval_sexpr();
-    }
-    if (strstr(t->tag, "qexpr"))
-    {
+        break;
+    case LREAD_TAG_QEXPR:
         x = lval_qexpr();
+        break;
     }
 
     /* Fill this list with any valid expression contained within */
     for (int i = 0; i < t->children_num; i++)
     {
-        if (strcmp(t->children[i]->contents, "(") == 0)
-        {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, ")") == 0)
-        {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, "}") == 0)
+        mpc_ast_t *c = t->children[i];
+        if (c->contents_len == 1 && (c->contents[0] == '(' || c->contents[0] == ')' ||
+                                     c->contents[0] == '{' || c->contents[0] == '}'))
         {
             continue;
         }
-        if (strcmp(t->children[i]->contents, "{") == 0)
+        if (lread_tag_kind(c) == LREAD_TAG_REGEX)
         {
             continue;
         }
-        if (strcmp(t->children[i]->tag, "regex") == 0)
-        {
-            continue;
-        }
-        x = lval_add(x, lval_read(t->children[i]));
+        x = lval_add(x, lval_read(c));
     }
 
     return x;
 }
 
-/*This function is going to be useful when we put things into, and take things out of, the environment.*/
-lval *lval_copy(lval *v)
+/*
+Direct reader from text to lvals, doing in one pass what the grammar in main does through mpc.
+Tokens follow that grammar: a number is -?[0-9]+ and a symbol is a run of symbol characters.
+Where both could start the number wins, so "1-2" reads as 1 and -2, as it does with mpc.
+*/
+int lread_is_space(char c)
 {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
 
-    lval *x = malloc(sizeof(lval));
-    x->type = v->type;
+int lread_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
 
-    switch (v->type)
+int lread_is_symbol(char c)
+{
+    switch (c)
     {
-        /* Copy Functions and Numbers Directly */
-    case LVAL_FUN:
-        x->fun = v->fun;
-        break;
-    case LVAL_NUM:
-        x->num = v->num;
-        break;
+    case '_':
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '\\':
+    case '=':
+    case '<':
+    case '>':
+    case '!':
+    case '&':
+        return 1;
+    }
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || lread_is_digit(c);
+}
 
-    /* Copy Strings using malloc and strcpy */
-    case LVAL_ERR:
-        x->err = malloc(strlen(v->err) + 1);
-        strcpy(x->err, v->err);
-        break;
+/*Symbol lval from the 'n' bytes at 's', which need not be terminated*/
+lval *lval_sym_n(const char *s, long n)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_SYM;
+    v->sym = malloc(n + 1);
+    memcpy(v->sym, s, n);
+    v->sym[n] = '\0';
+    return v;
+}
 
-    case LVAL_SYM:
-        x->sym = malloc(strlen(v->sym) + 1);
-        strcpy(x->sym, v->sym);
-        break;
+lval *lval_read_num_n(const char *s, long n)
+{
+    char buf[64];
+    char *t = n < (long)sizeof(buf) ? buf : malloc(n + 1);
+    memcpy(t, s, n);
+    t[n] = '\0';
 
-    /* Copy Lists by copying each sub-expression */
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-        x->count = v->count;
-        x->cell = malloc(sizeof(lval *) * x->count);
-        for (int i = 0; i < x->count; i++)
+    /* Check if there is some error in conversion */
+    errno = 0;
+    double x = strtof(t, NULL);
+    if (t != buf)
+        free(t);
+    return errno != ERANGE ? lval_num(x) : lval_err_code(LERR_BAD_NUM, NULL, 0, 0, 0);
+}
+
+/*Format a syntax error at byte 'pos' of 's' as "filename:row:col: error: ..." into a new string*/
+char *lread_error(const char *filename, const char *s, long pos, const char *fmt, char c)
+{
+    int row = 1;
+    long line = 0;
+    for (long i = 0; i < pos; i++)
+    {
+        if (s[i] == '\n')
         {
-            x->cell[i] = lval_copy(v->cell[i]);
+            row++;
+            line = i + 1;
         }
-        break;
     }
 
-    return x;
+    char msg[128];
+    snprintf(msg, sizeof(msg), fmt, c);
+
+    int size = strlen(filename) + strlen(msg) + 64;
+    char *err = malloc(size);
+    snprintf(err, size, "%s:%i:%li: error: %s", filename, row, pos - line + 1, msg);
+    return err;
+}
+
+/*Pending elements of the lists being read, each list takes its own off the top when it is closed*/
+typedef struct
+{
+    lval **items;
+    long count;
+    long cap;
+} lread_stack;
+
+void lread_push(lread_stack *st, lval *x)
+{
+    if (st->count == st->cap)
+    {
+        st->cap = st->cap ? st->cap * 2 : 64;
+        st->items = realloc(st->items, sizeof(lval *) * st->cap);
+    }
+    st->items[st->count++] = x;
+}
+
+/*A list of type 'type' holding the elements pushed since 'from', in one allocation*/
+lval *lread_list(lread_stack *st, int type, long from)
+{
+    lval *x = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+    x->count = st->count - from;
+    if (x->count)
+    {
+        x->cell = malloc(sizeof(lval *) * x->count);
+        memcpy(x->cell, st->items + from, sizeof(lval *) * x->count);
+    }
+    st->count = from;
+    return x;
+}
+
+/*
+Structural index for the reader, a first pass in the style of simdjson.
+Each 64 byte block is classified into bitmaps of whitespace, brackets and atom bytes (those that make up numbers and symbols),
+with AVX2 or SSE2 where the CPU has them and one byte at a time otherwise.
+From the bitmaps come the only positions the reader has to look at: brackets, the first byte of each run of atom bytes,
+the byte just past each run, and bytes that fit no class (syntax errors).
+Whitespace between tokens is therefore never visited byte by byte.
+The index is filled a chunk at a time into a small fixed buffer inside the reader's frame, so it allocates nothing.
+Defining LREAD_SCALAR forces the byte at a time classifier.
+*/
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(LREAD_SCALAR)
+#include <immintrin.h>
+#define LREAD_SIMD
+#endif
+
+#define LREAD_INDEX_BLOCKS 32
+
+typedef void (*lread_classify_fn)(const char *p, uint64_t *ws, uint64_t *br, uint64_t *at);
+
+typedef struct
+{
+    const char *s;
+    long len;
+    long next;      /*Start of the next block to classify*/
+    long base;      /*Start of the chunk that 'pos' indexes*/
+    uint64_t carry; /*Whether the last byte of the previous block was an atom byte*/
+    lread_classify_fn classify;
+    unsigned short pos[64 * LREAD_INDEX_BLOCKS]; /*Offsets from 'base'*/
+    int count;
+    int at;
+} lread_index;
+
+void lread_classify_scalar(const char *p, uint64_t *ws, uint64_t *br, uint64_t *at)
+{
+    uint64_t w = 0, b = 0, a = 0;
+    for (int k = 0; k < 64; k++)
+    {
+        char c = p[k];
+        w |= (uint64_t)lread_is_space(c) << k;
+        b |= (uint64_t)(c == '(' || c == ')' || c == '{' || c == '}') << k;
+        a |= (uint64_t)lread_is_symbol(c) << k;
+    }
+    *ws = w;
+    *br = b;
+    *at = a;
+}
+
+#ifdef LREAD_SIMD
+/*Bytes of 'c' within lo..hi, compared unsigned*/
+static inline __m128i lread_range_sse2(__m128i c, char lo, char hi)
+{
+    __m128i t = _mm_sub_epi8(c, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(hi - lo)), t);
+}
+
+static inline __m128i lread_eq_sse2(__m128i c, char x)
+{
+    return _mm_cmpeq_epi8(c, _mm_set1_epi8(x));
+}
+
+void lread_classify_sse2(const char *p, uint64_t *ws, uint64_t *br, uint64_t *at)
+{
+    uint64_t w = 0, b = 0, a = 0;
+    for (int k = 0; k < 4; k++)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+
+        __m128i sp = _mm_or_si128(lread_eq_sse2(c, ' '), lread_range_sse2(c, '\t', '\r'));
+
+        __m128i bk = _mm_or_si128(_mm_or_si128(lread_eq_sse2(c, '('), lread_eq_sse2(c, ')')),
+                                  _mm_or_si128(lread_eq_sse2(c, '{'), lread_eq_sse2(c, '}')));
+
+        __m128i letter = lread_range_sse2(_mm_or_si128(c, _mm_set1_epi8(0x20)), 'a', 'z');
+        __m128i at1 = _mm_or_si128(_mm_or_si128(letter, lread_range_sse2(c, '0', '9')),
+                                   _mm_or_si128(lread_range_sse2(c, '<', '>'), lread_range_sse2(c, '*', '+')));
+        __m128i at2 = _mm_or_si128(_mm_or_si128(lread_eq_sse2(c, '_'), lread_eq_sse2(c, '-')),
+                                   _mm_or_si128(lread_eq_sse2(c, '/'), lread_eq_sse2(c, '\\')));
+        __m128i at3 = _mm_or_si128(lread_eq_sse2(c, '!'), lread_eq_sse2(c, '&'));
+
+        w |= (uint64_t)(uint16_t)_mm_movemask_epi8(sp) << (16 * k);
+        b |= (uint64_t)(uint16_t)_mm_movemask_epi8(bk) << (16 * k);
+        a |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(at1, at2), at3)) << (16 * k);
+    }
+    *ws = w;
+    *br = b;
+    *at = a;
+}
+
+/*
+Atom bytes are found with two nibble lookups, each bit of the tables standing for a block of the ASCII chart:
+bit 0 is digits and <=>, bits 1 and 2 are letters, bit 3 is backslash and _, and bit 4 is !&*+-/.
+A byte is an atom byte when the tables for its high and its low nibble share a bit.
+*/
+__attribute__((target("avx2"))) void lread_classify_avx2(const char *p, uint64_t *ws, uint64_t *br, uint64_t *at)
+{
+    const __m256i hi_tbl = _mm256_setr_epi8(0, 0, 0x10, 0x01, 0x02, 0x0c, 0x02, 0x04, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 0, 0x10, 0x01, 0x02, 0x0c, 0x02, 0x04, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i lo_tbl = _mm256_setr_epi8(0x05, 0x17, 0x07, 0x07, 0x07, 0x07, 0x17, 0x07,
+                                            0x07, 0x07, 0x16, 0x12, 0x0b, 0x13, 0x03, 0x1a,
+                                            0x05, 0x17, 0x07, 0x07, 0x07, 0x07, 0x17, 0x07,
+                                            0x07, 0x07, 0x16, 0x12, 0x0b, 0x13, 0x03, 0x1a);
+    const __m256i nib = _mm256_set1_epi8(0x0f);
+
+    uint64_t w = 0, b = 0, a = 0;
+    for (int k = 0; k < 2; k++)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + 32 * k));
+
+        __m256i t = _mm256_sub_epi8(c, _mm256_set1_epi8('\t'));
+        __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                                     _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8('\r' - '\t')), t));
+
+        __m256i bk = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('(')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8(')'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('}'))));
+
+        __m256i hi = _mm256_shuffle_epi8(hi_tbl, _mm256_and_si256(_mm256_srli_epi16(c, 4), nib));
+        __m256i lo = _mm256_shuffle_epi8(lo_tbl, _mm256_and_si256(c, nib));
+        __m256i none = _mm256_cmpeq_epi8(_mm256_and_si256(hi, lo), _mm256_setzero_si256());
+
+        w |= (uint64_t)(uint32_t)_mm256_movemask_epi8(sp) << (32 * k);
+        b |= (uint64_t)(uint32_t)_mm256_movemask_epi8(bk) << (32 * k);
+        a |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(none) << (32 * k);
+    }
+    *ws = w;
+    *br = b;
+    *at = a;
+}
+#endif
+
+void lread_index_init(lread_index *ix, const char *s, long len)
+{
+    ix->s = s;
+    ix->len = len;
+    ix->next = 0;
+    ix->base = 0;
+    ix->carry = 0;
+    ix->count = 0;
+    ix->at = 0;
+    ix->classify = lread_classify_scalar;
+#ifdef LREAD_SIMD
+    ix->classify = __builtin_cpu_supports("avx2") ? lread_classify_avx2 : lread_classify_sse2;
+#endif
+}
+
+/*Classify the next chunk of blocks and collect their structural positions*/
+void lread_index_fill(lread_index *ix)
+{
+    char pad[64];
+    ix->base = ix->next;
+    ix->count = 0;
+    ix->at = 0;
+    for (int n = 0; n < LREAD_INDEX_BLOCKS && ix->next < ix->len; n++)
+    {
+        const char *p = ix->s + ix->next;
+        long left = ix->len - ix->next;
+        if (left < 64)
+        {
+            memset(pad, ' ', sizeof(pad));
+            memcpy(pad, p, left);
+            p = pad;
+        }
+
+        uint64_t w, b, a;
+        ix->classify(p, &w, &b, &a);
+
+        uint64_t prev = (a << 1) | ix->carry;
+        ix->carry = a >> 63;
+        uint64_t bits = b | ~(w | b | a) | (a & ~prev) | (~a & prev);
+        if (left < 64)
+            bits &= ((uint64_t)1 << left) - 1;
+
+        while (bits)
+        {
+            ix->pos[ix->count++] = ix->next - ix->base + __builtin_ctzll(bits);
+            bits &= bits - 1;
+        }
+        ix->next += 64;
+    }
+}
+
+/*The next structural position, or 'len' once there are none left*/
+long lread_index_next(lread_index *ix)
+{
+    while (ix->at == ix->count)
+    {
+        if (ix->next >= ix->len)
+            return ix->len;
+        lread_index_fill(ix);
+    }
+    return ix->base + ix->pos[ix->at++];
+}
+
+/*
+Read every expression in the 'len' bytes at 's' into one S-Expression, like the root of the grammar.
+On a syntax error returns NULL and sets '*err' to a message the caller frees.
+Open lists are kept on explicit stacks, so deep nesting cannot overflow the C stack.
+*/
+lval *lval_read_text(const char *filename, const char *s, long len, char **err)
+{
+    lread_stack st = {NULL, 0, 0};
+    lread_index ix;
+    lread_index_init(&ix, s, len);
+
+    /*For each open list: where it was opened, and where its elements start on 'st'*/
+    long *opened = NULL;
+    long *from = NULL;
+    int depth = 0;
+    int cap = 0;
+
+    long i = lread_index_next(&ix);
+    while (i < len)
+    {
+        char c = s[i];
+
+        if (lread_is_space(c))
+        {
+            /*Just past a run of atom bytes*/
+            i = lread_index_next(&ix);
+        }
+        else if (c == '(' || c == '{')
+        {
+            if (depth == cap)
+            {
+                cap = cap ? cap * 2 : 16;
+                opened = realloc(opened, sizeof(long) * cap);
+                from = realloc(from, sizeof(long) * cap);
+            }
+            opened[depth] = i;
+            from[depth] = st.count;
+            depth++;
+            i = lread_index_next(&ix);
+        }
+        else if (c == ')' || c == '}')
+        {
+            if (depth == 0)
+            {
+                *err = lread_error(filename, s, i, "unexpected '%c'", c);
+                break;
+            }
+            char want = s[opened[depth - 1]] == '(' ? ')' : '}';
+            if (c != want)
+            {
+                *err = lread_error(filename, s, i, "expected '%c'", want);
+                break;
+            }
+            depth--;
+            lread_push(&st, lread_list(&st, c == ')' ? LVAL_SEXPR : LVAL_QEXPR, from[depth]));
+            i = lread_index_next(&ix);
+        }
+        else if (lread_is_symbol(c))
+        {
+            /*A run of atom bytes ends at the next position, and splits into numbers and symbols*/
+            long end = lread_index_next(&ix);
+            while (i < end)
+            {
+                long j = i + 1;
+                if (lread_is_digit(s[i]) || (s[i] == '-' && j < end && lread_is_digit(s[j])))
+                {
+                    while (j < end && lread_is_digit(s[j]))
+                    {
+                        j++;
+                    }
+                    lread_push(&st, lval_read_num_n(s + i, j - i));
+                }
+                else
+                {
+                    j = end;
+                    lread_push(&st, lval_sym_n(s + i, j - i));
+                }
+                i = j;
+            }
+        }
+        else
+        {
+            *err = lread_error(filename, s, i, "unexpected '%c'", c);
+            break;
+        }
+    }
+
+    if (i == len && depth > 0)
+        *err = lread_error(filename, s, opened[depth - 1], "'%c' is never closed", s[opened[depth - 1]]);
+
+    lval *x = NULL;
+    if (i == len && depth == 0)
+    {
+        x = lread_list(&st, LVAL_SEXPR, 0);
+    }
+    else
+    {
+        for (long k = 0; k < st.count; k++)
+        {
+            lval_del(st.items[k]);
+        }
+    }
+
+    free(st.items);
+    free(opened);
+    free(from);
+    return x;
+}
+
+/*This function is going to be useful when we put things into, and take things out of, the environment.*/
+lval *lval_copy(lval *v)
+{
+
+    lval *x = lval_alloc();
+    x->type = v->type;
+
+    switch (v->type)
+    {
+        /* Copy Functions and Numbers Directly, memo tables are shared */
+    case LVAL_FUN:
+    case LVAL_MEMO:
+        x->fun = v->fun;
+        x->memo = v->memo;
+        if (x->memo)
+        {
+            x->memo->refs++;
+        }
+        break;
+
+    /* Promises and Streams are shared */
+    case LVAL_PROMISE:
+        x->promise = v->promise;
+        x->promise->refs++;
+        break;
+    case LVAL_STREAM:
+        x->stream = v->stream;
+        x->stream->refs++;
+        break;
+    case LVAL_XFORM:
+        x->xform = v->xform;
+        x->xform->refs++;
+        break;
+    case LVAL_FUTURE:
+        x->future = v->future;
+        x->future->refs++;
+        break;
+    case LVAL_CORO:
+        x->coro = v->coro;
+        x->coro->refs++;
+        break;
+    case LVAL_ACTOR:
+        x->actor = v->actor;
+        x->actor->refs++;
+        break;
+    case LVAL_REF:
+        x->ref = v->ref;
+        x->ref->refs++;
+        break;
+
+    case LVAL_RANGE:
+        x->range = v->range;
+        break;
+    case LVAL_NUM:
+        x->num = v->num;
+        break;
+
+    /* Copy Strings using malloc and strcpy */
+    case LVAL_ERR:
+        x->errcode = v->errcode;
+        x->errstr = v->errstr;
+        memcpy(x->errargs, v->errargs, sizeof(v->errargs));
+        x->err = NULL;
+        if (v->err)
+        {
+            x->err = malloc(strlen(v->err) + 1);
+            strcpy(x->err, v->err);
+        }
+        break;
+
+    case LVAL_SYM:
+        x->sym = malloc(strlen(v->sym) + 1);
+        strcpy(x->sym, v->sym);
+        break;
+
+    /* Copy Lists by copying each sub-expression */
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_MACRO:
+        x->expansion = NULL;
+        x->count = v->count;
+        x->cell = malloc(sizeof(lval *) * x->count);
+        for (int i = 0; i < x->count; i++)
+        {
+            x->cell[i] = lval_copy(v->cell[i]);
+        }
+        break;
+    }
+
+    return x;
 }
 
 void lval_print(lval *v);
+char *ltype_name(int t);
+
+/* Format the message of an Error lval into buf */
+void lval_err_format(lval *v, char *buf, int size)
+{
+    switch (v->errcode)
+    {
+    case LERR_CUSTOM:
+        snprintf(buf, size, "%s", v->err);
+        break;
+    case LERR_STATIC:
+        snprintf(buf, size, "%s", v->errstr);
+        break;
+    case LERR_DIV_ZERO:
+        snprintf(buf, size, "Division By Zero!");
+        break;
+    case LERR_BAD_NUM:
+        snprintf(buf, size, "Invalid Number!!");
+        break;
+    case LERR_UNBOUND:
+        snprintf(buf, size, "Unbound Symbol '%s'", v->err);
+        break;
+    case LERR_NOT_FUN:
+        snprintf(buf, size, "First element is not a function!!");
+        break;
+    case LERR_ARG_TYPE:
+        snprintf(buf, size, "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.",
+                 v->errstr, v->errargs[0], ltype_name(v->errargs[1]), ltype_name(v->errargs[2]));
+        break;
+    case LERR_ARG_COUNT:
+        snprintf(buf, size, "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.",
+                 v->errstr, v->errargs[0], v->errargs[1]);
+        break;
+    case LERR_ARG_EMPTY:
+        snprintf(buf, size, "Function '%s' passed {} for argument %i.", v->errstr, v->errargs[0]);
+        break;
+    case LERR_RETRY:
+        snprintf(buf, size, "Transaction conflict");
+        break;
+    default:
+        snprintf(buf, size, "Unknown Error");
+        break;
+    }
+}
 
 void lval_expr_print(lval *v, char open, char close)
 {
@@ -333,8 +1444,12 @@ void lval_print(lval *v)
         printf("%lf", v->num);
         break;
     case LVAL_ERR:
-        printf("Error: %s", v->err);
+    {
+        char buf[512];
+        lval_err_format(v, buf, sizeof(buf));
+        printf("Error: %s", buf);
         break;
+    }
     case LVAL_SYM:
         printf("%s", v->sym);
         break;
@@ -347,6 +1462,36 @@ void lval_print(lval *v)
     case LVAL_FUN:
         printf("<function>");
         break;
+    case LVAL_MACRO:
+        printf("<macro>");
+        break;
+    case LVAL_MEMO:
+        printf("<memo table>");
+        break;
+    case LVAL_PROMISE:
+        printf("<promise>");
+        break;
+    case LVAL_STREAM:
+        printf("<stream>");
+        break;
+    case LVAL_XFORM:
+        printf("<transducer>");
+        break;
+    case LVAL_FUTURE:
+        printf("<future>");
+        break;
+    case LVAL_CORO:
+        printf("<coroutine>");
+        break;
+    case LVAL_ACTOR:
+        printf("<actor>");
+        break;
+    case LVAL_REF:
+        printf("<ref>");
+        break;
+    case LVAL_RANGE:
+        printf("<range %lf %lf %lf>", v->range.start, v->range.end, v->range.step);
+        break;
     }
 }
 /* Print an "lval" followed by a newline */
@@ -372,6 +1517,26 @@ char *ltype_name(int t)
         return "S-Expression";
     case LVAL_QEXPR:
         return "Q-Expression";
+    case LVAL_MACRO:
+        return "Macro";
+    case LVAL_MEMO:
+        return "Memo Table";
+    case LVAL_PROMISE:
+        return "Promise";
+    case LVAL_STREAM:
+        return "Stream";
+    case LVAL_XFORM:
+        return "Transducer";
+    case LVAL_FUTURE:
+        return "Future";
+    case LVAL_CORO:
+        return "Coroutine";
+    case LVAL_ACTOR:
+        return "Actor";
+    case LVAL_REF:
+        return "Ref";
+    case LVAL_RANGE:
+        return "Range";
     default:
         return "Unknown";
     }
@@ -430,6 +1595,13 @@ lval *lval_join(lval *x, lval *y)
 }
 
 lval *lval_eval_sexpr(lenv *e, lval *v);
+lval *lval_eval_call(lenv *e, lval *v);
+lval *lmemo_call(lenv *e, lval *f, lval *a);
+lval *lval_macro_target(lenv *e, lval *v);
+lval *lmacro_expand(lval *m, lval *call);
+
+/*Nesting limit for read time expansion of macros that expand into macro calls*/
+#define LMACRO_MAX_DEPTH 1000
 
 lval *lenv_get(lenv *e, lval *k);
 /*Helper function to evaluate S-Expression*/
@@ -450,286 +1622,4261 @@ lval *lval_eval(lenv *e, lval *v)
     return v;
 }
 
-/*Main function for evaluating S-Expressions*/
-lval *lval_eval_sexpr(lenv *e, lval *v)
+lval *lenv_lookup(lenv *e, lval *k);
+void lenv_release(lenv *e);
+lval *builtin_eval(lenv *e, lval *a);
+lval *lval_eval_const_sexpr(lenv *e, lval *v);
+
+/*
+If 'v' is (eval x) where x is a Q-Expression, or a symbol bound to one,
+return that Q-Expression so it can be run in place. Otherwise return NULL.
+*/
+lval *lval_eval_target(lenv *e, lval *v)
 {
+    if (v->count != 2 || v->cell[0]->type != LVAL_SYM)
+        return NULL;
 
-    /*Evaluate Children*/
-    for (int i = 0; i < v->count; i++)
-    {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-    }
+    lval *f = lenv_lookup(e, v->cell[0]);
+    if (!f || f->type != LVAL_FUN || f->fun != builtin_eval || f->memo)
+        return NULL;
 
-    /*Error Checking*/
-    for (int i = 0; i < v->count; i++)
-    {
-        if (v->cell[i]->type == LVAL_ERR)
-            return lval_take(v, i);
-    }
+    lval *x = v->cell[1];
+    if (x->type == LVAL_SYM)
+        x = lenv_lookup(e, x);
 
-    /*Empty Expression*/
-    if (v->count == 0)
-        return v;
+    if (!x || x->type != LVAL_QEXPR)
+        return NULL;
 
-    /*Single Expression*/
-    if (v->count == 1)
-        return lval_take(v, 0);
+    return x;
+}
 
-    /*Ensure that first element is a function after evaluation*/
-    lval *f = lval_pop(v, 0);
+/*Coroutine running on the calling thread, NULL on the thread's own stack*/
+static __thread lcoro *lcoro_current = NULL;
 
-    if (f->type != LVAL_FUN)
+/*
+Run a Q-Expression owned by someone else (usually the environment) without copying it.
+If def replaces 'code' meanwhile it is only retired, so it stays alive until we finish.
+A coroutine can be suspended inside 'code' while the code that resumes it defs away, so it runs a copy.
+*/
+lval *lval_eval_stored(lenv *e, lval *code)
+{
+    if (lcoro_current)
     {
-        lval_del(v);
-        lval_del(f);
-        return lval_err("First element is not a function!!");
+        lval *x = lval_copy(code);
+        x->type = LVAL_SEXPR;
+        return lval_eval(e, x);
+    }
+
+    if (e->running == e->running_cap)
+    {
+        e->running_cap = e->running_cap ? e->running_cap * 2 : 8;
+        e->running_code = realloc(e->running_code, sizeof(lval *) * e->running_cap);
     }
+    e->running_code[e->running++] = code;
 
-    /* If so call function to get result */
-    lval *result = f->fun(e, v);
+    lval *result = lval_eval_const_sexpr(e, code);
+    e->running--;
 
-    lval_del(f);
+    if (e->running == 0)
+        lenv_release(e);
 
     return result;
 }
 
-#define LASSERT(args, cond, fmt, ...)             \
-    if (!(cond))                                  \
-    {                                             \
-        lval *err = lval_err(fmt, ##__VA_ARGS__); \
-        lval_del(args);                           \
-        return err;                               \
-    }
-
-#define LASSERT_TYPE(func, args, index, expect)                                          \
-    LASSERT(args, args->cell[index]->type == expect,                                     \
-            "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-            func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+/*If 'v' is a call to a macro, return the Macro lval, otherwise NULL*/
+lval *lval_macro_target(lenv *e, lval *v)
+{
+    if (v->count == 0 || v->cell[0]->type != LVAL_SYM)
+        return NULL;
 
-#define LASSERT_NUM(func, args, num)                                                    \
-    LASSERT(args, args->count == num,                                                   \
-            "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
-            func, args->count, num)
+    lval *m = lenv_lookup(e, v->cell[0]);
+    return m && m->type == LVAL_MACRO ? m : NULL;
+}
 
-#define LASSERT_NOT_EMPTY(func, args, index)     \
-    LASSERT(args, args->cell[index]->count != 0, \
-            "Function '%s' passed {} for argument %i.", func, index);
+/*Number of the last expansion, used to make fresh names for the symbols a template binds*/
+atomic_long lmacro_gensym = 0;
 
-/*Evaluation function which performs switch on operator passed*/
-lval *builtin_op(lenv *e, lval *a, char *op)
+/*Index of symbol 's' in list 'l', or -1*/
+int lval_sym_index(lval *l, char *s)
 {
-    /*First ensure all arguments are numbers*/
-    for (int i = 0; i < a->count; i++)
+    for (int i = 0; i < l->count; i++)
     {
-        LASSERT_TYPE(op, a, i, LVAL_NUM);
+        if (strcmp(l->cell[i]->sym, s) == 0)
+            return i;
     }
+    return -1;
+}
 
-    /*Pop the first element*/
-    lval *x = lval_pop(a, 0);
-
-    /*If no arguments and sub then perform unary negation*/
-    if ((strcmp(op, "-") == 0) && a->count == 0)
+/*Copy template 't' replacing parameters by the call's arguments and renaming the template's own binders*/
+lval *lmacro_subst(lval *m, lval *call, lval *t, long id)
+{
+    if (t->type == LVAL_SYM)
     {
-        x->num = -x->num;
-    }
+        int i = lval_sym_index(m->cell[0], t->sym);
+        if (i >= 0)
+            return lval_copy(call->cell[i + 1]);
 
-    /* While there are still elements remaining */
-    while (a->count > 0)
+        if (lval_sym_index(m->cell[2], t->sym) >= 0)
+        {
+            char name[512];
+            snprintf(name, sizeof(name), "%s#%ld", t->sym, id);
+            return lval_sym(name);
+        }
+
+        return lval_copy(t);
+    }
+
+    if (t->type != LVAL_SEXPR && t->type != LVAL_QEXPR)
+        return lval_copy(t);
+
+    lval *x = t->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+    x->cell = malloc(sizeof(lval *) * t->count);
+    for (int i = 0; i < t->count; i++)
     {
+        x->cell[x->count++] = lmacro_subst(m, call, t->cell[i], id);
+    }
+    return x;
+}
 
-        /* Pop the next element */
-        lval *y = lval_pop(a, 0);
+/*Expand one macro call, the result is a new S-Expression and 'call' is left untouched*/
+lval *lmacro_expand(lval *m, lval *call)
+{
+    if (call->count - 1 != m->cell[0]->count)
+        return lval_err_code(LERR_STATIC, "Macro passed incorrect number of arguments", 0, 0, 0);
 
-        if (strcmp(op, "+") == 0)
+    lval *x = lmacro_subst(m, call, m->cell[1], ++lmacro_gensym);
+    x->type = LVAL_SEXPR;
+    return x;
+}
+
+/*
+Builtins that bind a list of symbols locally, and which argument holds the list.
+def is left out, it binds globally so a macro can use it to define things.
+*/
+typedef struct
+{
+    char *name;
+    int arg;
+} lmacro_binder;
+
+lmacro_binder lmacro_binders[] = {{"dotimes", 0}, {"for-each", 0},
+                                  {"stream-iterate", 0}, {"stream-map", 0}, {"stream-filter", 0}, {"stream-reduce", 0},
+                                  {"xmap", 0}, {"xfilter", 0}, {"transduce", 1},
+                                  {"pmap", 0}, {"pfilter", 0}, {"preduce", 0}, {"alter", 0}, {NULL, 0}};
+
+/*Collect into 'out' the symbols bound by binder forms anywhere in template 't' that are not parameters*/
+void lmacro_collect_binders(lval *params, lval *t, lval *out)
+{
+    if (t->type != LVAL_SEXPR && t->type != LVAL_QEXPR)
+        return;
+
+    if (t->count >= 2 && t->cell[0]->type == LVAL_SYM)
+    {
+        for (int b = 0; lmacro_binders[b].name; b++)
         {
-            x->num += y->num;
+            int n = lmacro_binders[b].arg + 1;
+            if (strcmp(t->cell[0]->sym, lmacro_binders[b].name) != 0 ||
+                n >= t->count || t->cell[n]->type != LVAL_QEXPR)
+                continue;
+
+            lval *syms = t->cell[n];
+            for (int i = 0; i < syms->count; i++)
+            {
+                if (syms->cell[i]->type == LVAL_SYM &&
+                    lval_sym_index(params, syms->cell[i]->sym) < 0 &&
+                    lval_sym_index(out, syms->cell[i]->sym) < 0)
+                {
+                    lval_add(out, lval_copy(syms->cell[i]));
+                }
+            }
         }
-        if (strcmp(op, "-") == 0)
+    }
+
+    for (int i = 0; i < t->count; i++)
+    {
+        lmacro_collect_binders(params, t->cell[i], out);
+    }
+}
+
+/*
+Expand the macro calls already known when the input is read, replacing each
+call site by its expansion so evaluating the code later pays nothing for it.
+Q-Expressions are data and are left alone, calls inside them expand when first run.
+*/
+lval *lval_expand(lenv *e, lval *v)
+{
+    if (v->type != LVAL_SEXPR)
+        return v;
+
+    lval *m;
+    for (int depth = 0; v->type == LVAL_SEXPR && (m = lval_macro_target(e, v)); depth++)
+    {
+        if (depth == LMACRO_MAX_DEPTH)
         {
-            x->num -= y->num;
+            lval_del(v);
+            return lval_err_code(LERR_STATIC, "Macro expansion too deep", 0, 0, 0);
         }
-        if (strcmp(op, "*") == 0)
+
+        lval *x = lmacro_expand(m, v);
+        lmacro_expansions++;
+        lval_del(v);
+        v = x;
+    }
+
+    if (v->type == LVAL_SEXPR)
+    {
+        for (int i = 0; i < v->count; i++)
         {
-            x->num *= y->num;
+            v->cell[i] = lval_expand(e, v->cell[i]);
         }
-        if (strcmp(op, "/") == 0)
+    }
+
+    return v;
+}
+
+/*
+Reclamation for shared environments, in the style of quiescent state based RCU.
+A thread is online while it may hold values or arrays taken from a shared environment. Whatever a writer swaps out
+is tagged with the current epoch and freed once every other thread has gone offline or came online after that epoch.
+The writer itself is covered by 'running', which keeps values its own stored code runs in from being retired early.
+*/
+typedef struct lrcu_thread
+{
+    /*Epoch the thread came online in, LRCU_OFFLINE while it holds nothing*/
+    atomic_long seen;
+    int depth;
+    struct lrcu_thread *next;
+} lrcu_thread;
+
+typedef struct lrcu_garbage
+{
+    void *p;
+    void (*del)(void *);
+    long epoch;
+    struct lrcu_garbage *next;
+} lrcu_garbage;
+
+#define LRCU_OFFLINE 0
+
+atomic_long lrcu_epoch = 1;
+
+/*Every thread that ever came online, threads are never removed so the list can be walked without a lock*/
+_Atomic(lrcu_thread *) lrcu_threads = NULL;
+static __thread lrcu_thread *lrcu_self = NULL;
+
+/*Retired memory, oldest first*/
+pthread_mutex_t lrcu_lock = PTHREAD_MUTEX_INITIALIZER;
+lrcu_garbage *lrcu_oldest = NULL;
+lrcu_garbage *lrcu_newest = NULL;
+
+/*Serializes writers to shared environments*/
+pthread_mutex_t lenv_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Mark the calling thread as possibly holding what it reads from shared environments. Calls nest*/
+void lrcu_online(void)
+{
+    if (!lrcu_self)
+    {
+        lrcu_self = calloc(1, sizeof(lrcu_thread));
+        lrcu_self->next = atomic_load(&lrcu_threads);
+        while (!atomic_compare_exchange_weak(&lrcu_threads, &lrcu_self->next, lrcu_self))
+            ;
+    }
+
+    if (lrcu_self->depth++ == 0)
+    {
+        atomic_store(&lrcu_self->seen, atomic_load(&lrcu_epoch));
+        /*Pairs with the fence in lrcu_oldest_reader: either the writer sees us online, or we see what it unpublished*/
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+void lrcu_offline(void)
+{
+    if (--lrcu_self->depth == 0)
+        atomic_store(&lrcu_self->seen, LRCU_OFFLINE);
+}
+
+/*Oldest epoch another online thread may still hold something from, or 0 if no other thread is online*/
+long lrcu_oldest_reader(void)
+{
+    /*What the caller unpublished must be visible before we look at who is online*/
+    atomic_thread_fence(memory_order_seq_cst);
+
+    long oldest = 0;
+    for (lrcu_thread *t = atomic_load(&lrcu_threads); t; t = t->next)
+    {
+        long seen = atomic_load(&t->seen);
+        if (t != lrcu_self && seen != LRCU_OFFLINE && (!oldest || seen < oldest))
+            oldest = seen;
+    }
+    return oldest;
+}
+
+/*Free what no online thread can hold anymore*/
+void lrcu_reclaim(void)
+{
+    pthread_mutex_lock(&lrcu_lock);
+    long oldest = lrcu_oldest_reader();
+    while (lrcu_oldest && (!oldest || lrcu_oldest->epoch < oldest))
+    {
+        lrcu_garbage *g = lrcu_oldest;
+        lrcu_oldest = g->next;
+        if (!lrcu_oldest)
+            lrcu_newest = NULL;
+        g->del(g->p);
+        free(g);
+    }
+    pthread_mutex_unlock(&lrcu_lock);
+}
+
+/*Free 'p' with 'del' once the other threads are done with it, 'p' must already be unreachable for newcomers*/
+void lrcu_retire(void *p, void (*del)(void *))
+{
+    if (!lrcu_oldest_reader() && !lrcu_oldest)
+    {
+        del(p);
+        return;
+    }
+
+    lrcu_garbage *g = malloc(sizeof(lrcu_garbage));
+    g->p = p;
+    g->del = del;
+    g->epoch = atomic_fetch_add(&lrcu_epoch, 1);
+    g->next = NULL;
+
+    pthread_mutex_lock(&lrcu_lock);
+    if (lrcu_newest)
+        lrcu_newest->next = g;
+    else
+        lrcu_oldest = g;
+    lrcu_newest = g;
+    pthread_mutex_unlock(&lrcu_lock);
+
+    lrcu_reclaim();
+}
+
+void lrcu_free_lval(void *p)
+{
+    lval_del(p);
+}
+
+/*Free 'p' once no other thread can be reading it through 'e'*/
+void lenv_retire(lenv *e, void *p, void (*del)(void *))
+{
+    if (e->shared)
+        lrcu_retire(p, del);
+    else
+        del(p);
+}
+
+/*FNV-1a hash of a symbol name*/
+unsigned long lenv_hash(char *s)
+{
+    unsigned long h = 1469598103934665603UL;
+    for (; *s; s++)
+    {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/*Environments with this many entries get a hash index*/
+#define LENV_INDEX_MIN 16
+
+/*
+Work stealing thread pool.
+Each worker owns a deque of tasks: it pushes and pops at the tail, idle workers steal from the head of the others.
+Threads outside the pool share one extra deque. A thread waiting for its tasks keeps running tasks meanwhile,
+so nested parallel work never blocks a worker.
+*/
+typedef struct
+{
+    pthread_mutex_t lock;
+    ltask **tasks;
+    int head;
+    int tail;
+    int cap;
+} ldeque;
+
+typedef struct
+{
+    int workers;
+    pthread_t *threads;
+    ldeque *deques;
+
+    atomic_int queued;
+    atomic_int stop;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t sleep_cond;
+} lpool;
+
+/*The pool parallel work runs on, started by the first user*/
+lpool *lpar_pool = NULL;
+
+/*Whether independent arguments and collection builtins are spread over the pool*/
+int lpar_on = 0;
+
+/*Live actors and futures not yet run, they queue work on the pool so it is not replaced while there are any*/
+atomic_int lpool_users = 0;
+
+/*Deque of the calling thread, -1 outside the pool*/
+static __thread int lpool_self = -1;
+
+ldeque *lpool_deque(lpool *p)
+{
+    return &p->deques[lpool_self >= 0 ? lpool_self : p->workers];
+}
+
+void lpool_push(lpool *p, ltask *t)
+{
+    ldeque *d = lpool_deque(p);
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail - d->head == d->cap)
+    {
+        /*Grow the ring, keeping the tasks in order from head to tail*/
+        int cap = d->cap ? d->cap * 2 : 64;
+        ltask **tasks = malloc(sizeof(ltask *) * cap);
+        for (int i = d->head; i < d->tail; i++)
         {
-            if (y->num == 0)
+            tasks[i - d->head] = d->tasks[i % d->cap];
+        }
+        free(d->tasks);
+        d->tasks = tasks;
+        d->tail -= d->head;
+        d->head = 0;
+        d->cap = cap;
+    }
+    d->tasks[d->tail++ % d->cap] = t;
+    pthread_mutex_unlock(&d->lock);
+
+    atomic_fetch_add(&p->queued, 1);
+    pthread_mutex_lock(&p->sleep_lock);
+    pthread_cond_signal(&p->sleep_cond);
+    pthread_mutex_unlock(&p->sleep_lock);
+}
+
+/*Newest task of our own deque, else the oldest task of another one, else NULL*/
+ltask *lpool_take(lpool *p)
+{
+    int n = p->workers + 1;
+    int self = lpool_self >= 0 ? lpool_self : p->workers;
+    ltask *t = NULL;
+
+    for (int k = 0; k < n && !t; k++)
+    {
+        ldeque *d = &p->deques[(self + k) % n];
+        pthread_mutex_lock(&d->lock);
+        if (d->tail > d->head)
+            t = k == 0 ? d->tasks[--d->tail % d->cap] : d->tasks[d->head++ % d->cap];
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    if (t)
+        atomic_fetch_sub(&p->queued, 1);
+    return t;
+}
+
+/*Transaction running on the calling thread, NULL if none is*/
+static __thread ltx *ltx_current = NULL;
+
+void lpool_run(ltask *t)
+{
+    /*The task may free itself, so remember what to signal first*/
+    atomic_int *pending = t->pending;
+
+    /*A task run while waiting inside a transaction is not part of it*/
+    ltx *tx = ltx_current;
+    ltx_current = NULL;
+    lrcu_online();
+    t->run(t);
+    lrcu_offline();
+    ltx_current = tx;
+
+    if (pending)
+        atomic_fetch_sub(pending, 1);
+}
+
+void *lpool_worker(void *arg)
+{
+    lpool *p = lpar_pool;
+    lpool_self = (int)(long)arg;
+
+    while (!atomic_load(&p->stop))
+    {
+        ltask *t = lpool_take(p);
+        if (t)
+        {
+            lpool_run(t);
+            continue;
+        }
+
+        pthread_mutex_lock(&p->sleep_lock);
+        while (!atomic_load(&p->queued) && !atomic_load(&p->stop))
+        {
+            pthread_cond_wait(&p->sleep_cond, &p->sleep_lock);
+        }
+        pthread_mutex_unlock(&p->sleep_lock);
+    }
+
+    lval_cache_clear();
+    return NULL;
+}
+
+/*Run tasks until the ones counted by 'pending' are finished*/
+void lpool_wait(lpool *p, atomic_int *pending)
+{
+    while (atomic_load(pending) > 0)
+    {
+        ltask *t = lpool_take(p);
+        if (t)
+            lpool_run(t);
+        else
+            sched_yield();
+    }
+}
+
+void lpool_start(int workers)
+{
+    lpool *p = calloc(1, sizeof(lpool));
+    p->workers = workers;
+    p->threads = malloc(sizeof(pthread_t) * workers);
+    p->deques = calloc(workers + 1, sizeof(ldeque));
+    for (int i = 0; i <= workers; i++)
+    {
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&p->sleep_lock, NULL);
+    pthread_cond_init(&p->sleep_cond, NULL);
+
+    lpar_pool = p;
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_create(&p->threads[i], NULL, lpool_worker, (void *)(long)i);
+    }
+}
+
+/*Stop the workers once the tasks already queued have run*/
+void lpool_stop(void)
+{
+    lpool *p = lpar_pool;
+    if (!p)
+        return;
+
+    while (atomic_load(&p->queued) > 0)
+    {
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&p->sleep_lock);
+    atomic_store(&p->stop, 1);
+    pthread_cond_broadcast(&p->sleep_cond);
+    pthread_mutex_unlock(&p->sleep_lock);
+
+    for (int i = 0; i < p->workers; i++)
+    {
+        pthread_join(p->threads[i], NULL);
+    }
+    for (int i = 0; i <= p->workers; i++)
+    {
+        pthread_mutex_destroy(&p->deques[i].lock);
+        free(p->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&p->sleep_lock);
+    pthread_cond_destroy(&p->sleep_cond);
+
+    free(p->deques);
+    free(p->threads);
+    free(p);
+    lpar_pool = NULL;
+}
+
+lval *builtin_add(lenv *e, lval *a);
+lval *builtin_sub(lenv *e, lval *a);
+lval *builtin_mul(lenv *e, lval *a);
+lval *builtin_div(lenv *e, lval *a);
+lval *builtin_list(lenv *e, lval *a);
+lval *builtin_join(lenv *e, lval *a);
+lval *builtin_while(lenv *e, lval *a);
+lval *builtin_eval(lenv *e, lval *a);
+lval *builtin_delay(lenv *e, lval *a);
+lval *builtin_coroutine(lenv *e, lval *a);
+lval *builtin_future(lenv *e, lval *a);
+
+/*Builtins whose arguments may be evaluated at the same time, they only combine values*/
+lbuiltin lpar_builtins[] = {builtin_add, builtin_sub, builtin_mul, builtin_div,
+                            builtin_list, builtin_join, NULL};
+
+/*Builtins that change state other code can see, anything calling them is evaluated in order*/
+char *lpar_impure[] = {"def", "defmacro", "parallel",
+                       "memo-put", "memo-get", "memo-clear", "memo-budget",
+                       "yield", "spawn", "send", "receive", "self",
+                       "ref", "deref", "alter", "dosync", NULL};
+
+/*Builtins that run their arguments as code, the walk only sees that code if it is written out as Q-Expressions*/
+lbuiltin lpar_runners[] = {builtin_eval, builtin_while, builtin_delay, builtin_coroutine, builtin_future, NULL};
+
+/*An argument is worth a task of its own from this estimated cost on*/
+#define LPAR_MIN_COST 64
+
+/*Cost charged for code that loops*/
+#define LPAR_LOOP_COST 1024
+
+/*Nesting limit when looking into the macros code calls*/
+#define LPAR_MAX_DEPTH 16
+
+/*
+Estimated cost of evaluating 'v', or -1 if it is not safe to evaluate beside other code.
+That is the case if it may redefine something, bind symbols that code after it can see (loops
+and the other binders macros rename), run code it computes or a stored program, or touch a value
+shared by reference count (memo tables, promises, streams, transducers) from the environment.
+*/
+long lval_par_cost(lenv *e, lval *v, int depth)
+{
+    if (depth > LPAR_MAX_DEPTH)
+        return -1;
+
+    if (v->type == LVAL_SYM)
+    {
+        for (int i = 0; lpar_impure[i]; i++)
+        {
+            if (strcmp(v->sym, lpar_impure[i]) == 0)
+                return -1;
+        }
+
+        for (int i = 0; lmacro_binders[i].name; i++)
+        {
+            if (strcmp(v->sym, lmacro_binders[i].name) == 0)
+                return -1;
+        }
+
+        lval *x = lenv_lookup(e, v);
+        if (!x)
+            return 1;
+
+        switch (x->type)
+        {
+        case LVAL_MACRO:
+            return lval_par_cost(e, x->cell[1], depth + 1);
+        case LVAL_FUN:
+            if (x->memo)
+                return -1;
+            return x->fun == builtin_while ? LPAR_LOOP_COST : 1;
+        case LVAL_MEMO:
+        case LVAL_PROMISE:
+        case LVAL_STREAM:
+        case LVAL_XFORM:
+        case LVAL_FUTURE:
+        case LVAL_CORO:
+        case LVAL_ACTOR:
+        case LVAL_REF:
+            return -1;
+        }
+        return 1;
+    }
+
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR)
+        return 1;
+
+    /*Code that is looked up or computed, such as (eval x) or (eval (join q {})), is not seen by the walk*/
+    lval *f = v->count > 0 && v->cell[0]->type == LVAL_SYM ? lenv_lookup(e, v->cell[0]) : NULL;
+    if (f && f->type == LVAL_FUN)
+    {
+        for (int i = 0; lpar_runners[i]; i++)
+        {
+            if (f->fun != lpar_runners[i])
+                continue;
+
+            for (int j = 1; j < v->count; j++)
             {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division By Zero!");
-                break;
+                if (v->cell[j]->type != LVAL_QEXPR)
+                    return -1;
             }
-            x->num /= y->num;
         }
-        if (strcmp(op, "%") == 0)
+
+        /*The body of a coroutine only runs once it is resumed, on an environment of its own*/
+        if (f->fun == builtin_coroutine && v->count == 2)
+            return 2;
+    }
+
+    long cost = 1;
+    for (int i = 0; i < v->count; i++)
+    {
+        long c = lval_par_cost(e, v->cell[i], depth);
+        if (c < 0)
+            return -1;
+        cost += c;
+    }
+    return cost;
+}
+
+lenv *lenv_new(void);
+lenv *lenv_child(lenv *par);
+void lenv_del(lenv *e);
+
+/*Evaluation of one argument on the pool, in its own environment*/
+typedef struct
+{
+    ltask task;
+    lenv *e;
+    lval **slot;
+} lpar_arg;
+
+void lpar_arg_run(ltask *t)
+{
+    lpar_arg *a = (lpar_arg *)t;
+    lenv *c = lenv_child(a->e);
+    *a->slot = lval_eval(c, *a->slot);
+    lenv_del(c);
+}
+
+/*
+If the arguments of 'v' may be evaluated at the same time, do so and return 1, otherwise return 0.
+Each argument is evaluated into its own cell, so the result is the same as evaluating them in order.
+*/
+int lval_eval_par(lenv *e, lval *v)
+{
+    if (v->count < 3 || v->cell[0]->type != LVAL_SYM)
+        return 0;
+
+    lval *f = lenv_lookup(e, v->cell[0]);
+    if (!f || f->type != LVAL_FUN || f->memo)
+        return 0;
+
+    int pure = 0;
+    for (int i = 0; lpar_builtins[i]; i++)
+    {
+        pure |= f->fun == lpar_builtins[i];
+    }
+    if (!pure)
+        return 0;
+
+    /*Every argument has to be safe, as any of them may run while another one is being evaluated*/
+    int heavy = 0;
+    long *cost = malloc(sizeof(long) * v->count);
+    for (int i = 1; i < v->count; i++)
+    {
+        cost[i] = lval_par_cost(e, v->cell[i], 0);
+        if (cost[i] < 0)
         {
-            x->num = fmod(x->num, y->num);
+            free(cost);
+            return 0;
         }
-        if (strcmp(op, "^") == 0)
+        heavy += v->cell[i]->type == LVAL_SEXPR && cost[i] >= LPAR_MIN_COST;
+    }
+    if (heavy < 2)
+    {
+        free(cost);
+        return 0;
+    }
+
+    /*Hand out all heavy arguments but the last, which we evaluate ourselves along with the light ones*/
+    atomic_int pending = 0;
+    lpar_arg *args = malloc(sizeof(lpar_arg) * v->count);
+    int own = -1;
+    for (int i = v->count - 1; i >= 1; i--)
+    {
+        if (v->cell[i]->type != LVAL_SEXPR || cost[i] < LPAR_MIN_COST)
+            continue;
+
+        args[i].task.run = lpar_arg_run;
+        args[i].task.pending = &pending;
+        args[i].e = e;
+        args[i].slot = &v->cell[i];
+        if (own < 0)
         {
-            x->num = (double)(pow(x->num, y->num));
+            own = i;
+            continue;
         }
-        lval_del(y);
+        atomic_fetch_add(&pending, 1);
+        lpool_push(lpar_pool, &args[i].task);
+    }
+
+    lenv *c = lenv_child(e);
+    for (int i = 1; i < v->count; i++)
+    {
+        if (i == own || v->cell[i]->type != LVAL_SEXPR || cost[i] < LPAR_MIN_COST)
+            v->cell[i] = lval_eval(c, v->cell[i]);
     }
+    lenv_del(c);
+    lpool_wait(lpar_pool, &pending);
+
+    free(args);
+    free(cost);
+    return 1;
+}
+
+/*Coroutine stacks are this small, evaluation stops with an error once less than the reserve is left*/
+#define LCORO_STACK_SIZE (64 * 1024)
+#define LCORO_STACK_RESERVE (16 * 1024)
+
+/*
+Overrunning a coroutine stack hits its guard page and kills the process,
+so evaluation checks it is not nesting too deep and fails with an error first.
+*/
+int lcoro_stack_low(void *sp)
+{
+    return lcoro_current && (char *)sp < lcoro_current->stack + LCORO_STACK_RESERVE;
+}
+
+/*Main function for evaluating S-Expressions*/
+lval *lval_eval_sexpr(lenv *e, lval *v)
+{
+    if (lcoro_stack_low(&v))
+    {
+        lval_del(v);
+        return lval_err_code(LERR_STATIC, "Coroutine stack exhausted", 0, 0, 0);
+    }
+
+    /*Macro calls are expanded and the expansion evaluated in their place*/
+    lval *m = lval_macro_target(e, v);
+    if (m)
+    {
+        lval *x = lmacro_expand(m, v);
+        lmacro_expansions++;
+        lval_del(v);
+        return lval_eval(e, x);
+    }
+
+    /*Stored programs passed to eval are run in place rather than copied out of the environment*/
+    lval *code = lval_eval_target(e, v);
+    if (code)
+    {
+        lval *result = lval_eval_stored(e, code);
+        lval_del(v);
+        return result;
+    }
+
+    /*Independent arguments of a pure builtin are evaluated on the pool when parallel evaluation is on*/
+    if (lpar_on && lval_eval_par(e, v))
+    {
+        for (int i = 1; i < v->count; i++)
+        {
+            if (v->cell[i]->type == LVAL_ERR)
+                return lval_take(v, i);
+        }
+        v->cell[0] = lval_eval(e, v->cell[0]);
+        return lval_eval_call(e, v);
+    }
+
+    /*Evaluate Children, stopping at the first error without evaluating the remaining siblings*/
+    for (int i = 0; i < v->count; i++)
+    {
+        v->cell[i] = lval_eval(e, v->cell[i]);
+        if (v->cell[i]->type == LVAL_ERR)
+            return lval_take(v, i);
+    }
+
+    return lval_eval_call(e, v);
+}
+
+/*Call the function at the head of an S-Expression whose children are already evaluated*/
+lval *lval_eval_call(lenv *e, lval *v)
+{
+    /*Empty Expression*/
+    if (v->count == 0)
+        return v;
+
+    /*Single Expression*/
+    if (v->count == 1)
+        return lval_take(v, 0);
+
+    /*Ensure that first element is a function after evaluation*/
+    lval *f = lval_pop(v, 0);
+
+    if (f->type != LVAL_FUN)
+    {
+        lval_del(v);
+        lval_del(f);
+        return lval_err_code(LERR_NOT_FUN, NULL, 0, 0, 0);
+    }
+
+    /* If so call function to get result, going through its memo table if it has one */
+    lval *result = f->memo ? lmemo_call(e, f, v) : f->fun(e, v);
+
+    lval_del(f);
+
+    return result;
+}
+
+/*
+Evaluate a code tree without consuming or mutating it.
+Results are always built in fresh lvals, so the same tree (e.g. a loop body)
+can be evaluated again and again without being copied first.
+*/
+lval *lval_eval_const(lenv *e, lval *v)
+{
+    if (v->type == LVAL_SYM)
+        return lenv_get(e, v);
+
+    if (v->type == LVAL_SEXPR)
+        return lval_eval_const_sexpr(e, v);
+
+    return lval_copy(v);
+}
+
+/*Evaluate the children of 'v' as an S-Expression, whatever the type of 'v' itself*/
+lval *lval_eval_const_sexpr(lenv *e, lval *v)
+{
+    if (lcoro_stack_low(&v))
+        return lval_err_code(LERR_STATIC, "Coroutine stack exhausted", 0, 0, 0);
+
+    /*A call site expands its macro once, then reuses the cached expansion*/
+    if (lval_macro_target(e, v))
+    {
+        if (v->expansion && v->expansion_epoch == lmacro_epoch)
+        {
+            lmacro_hits++;
+        }
+        else
+        {
+            if (v->expansion)
+                lval_del(v->expansion);
+            v->expansion = lmacro_expand(lval_macro_target(e, v), v);
+            v->expansion_epoch = lmacro_epoch;
+            lmacro_expansions++;
+        }
+        return lval_eval_const(e, v->expansion);
+    }
+
+    lval *code = lval_eval_target(e, v);
+    if (code)
+        return lval_eval_stored(e, code);
+
+    lval *args = lval_sexpr();
+    args->cell = malloc(sizeof(lval *) * v->count);
+
+    for (int i = 0; i < v->count; i++)
+    {
+        lval *x = lval_eval_const(e, v->cell[i]);
+        if (x->type == LVAL_ERR)
+        {
+            lval_del(args);
+            return x;
+        }
+        args->cell[args->count++] = x;
+    }
+
+    return lval_eval_call(e, args);
+}
+
+#define LASSERT(args, cond, fmt, ...)             \
+    if (!(cond))                                  \
+    {                                             \
+        lval *err = lval_err(fmt, ##__VA_ARGS__); \
+        lval_del(args);                           \
+        return err;                               \
+    }
+
+/*Like LASSERT but returns a structured error built by the given expression*/
+#define LASSERT_ERR(args, cond, error) \
+    if (!(cond))                       \
+    {                                  \
+        lval *err = error;             \
+        lval_del(args);                \
+        return err;                    \
+    }
+
+#define LASSERT_TYPE(func, args, index, expect)          \
+    LASSERT_ERR(args, args->cell[index]->type == expect, \
+                lval_err_code(LERR_ARG_TYPE, func, index, args->cell[index]->type, expect))
+
+#define LASSERT_NUM(func, args, num)                \
+    LASSERT_ERR(args, args->count == num,           \
+                lval_err_code(LERR_ARG_COUNT, func, args->count, num, 0))
+
+#define LASSERT_NOT_EMPTY(func, args, index)         \
+    LASSERT_ERR(args, args->cell[index]->count != 0, \
+                lval_err_code(LERR_ARG_EMPTY, func, index, 0, 0));
+
+/*List builtins accept Q-Expressions and Ranges alike*/
+#define LASSERT_LIST(func, args, index)                                                               \
+    LASSERT_ERR(args, args->cell[index]->type == LVAL_QEXPR || args->cell[index]->type == LVAL_RANGE, \
+                lval_err_code(LERR_ARG_TYPE, func, index, args->cell[index]->type, LVAL_QEXPR))
+
+#define LASSERT_LIST_NOT_EMPTY(func, args, index)         \
+    LASSERT_ERR(args, lval_len(args->cell[index]) != 0, \
+                lval_err_code(LERR_ARG_EMPTY, func, index, 0, 0))
+
+#define LASSERT_STATIC(args, cond, msg) \
+    LASSERT_ERR(args, cond, lval_err_code(LERR_STATIC, msg, 0, 0, 0))
+
+/*Length of a Q-Expression or Range*/
+long lval_len(lval *v)
+{
+    return v->type == LVAL_RANGE ? lrange_len(v) : v->count;
+}
+
+/*Q-Expression holding the elements of a Range*/
+lval *lrange_list(lval *v)
+{
+    lval *x = lval_qexpr();
+    long n = lrange_len(v);
+    x->cell = malloc(sizeof(lval *) * n);
+    for (long i = 0; i < n; i++)
+    {
+        x->cell[x->count++] = lval_num(lrange_nth(v, i));
+    }
+    return x;
+}
+
+/*Evaluation function which performs switch on operator passed*/
+lval *builtin_op(lenv *e, lval *a, char *op)
+{
+    LASSERT_ERR(a, a->count > 0, lval_err_code(LERR_ARG_COUNT, op, 0, 1, 0));
+
+    /*First ensure all arguments are numbers*/
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT_TYPE(op, a, i, LVAL_NUM);
+    }
+
+    /*Accumulate into the first element, walking the rest in place instead of popping each one*/
+    lval *x = a->cell[0];
+
+    /*If no arguments and sub then perform unary negation*/
+    if ((strcmp(op, "-") == 0) && a->count == 1)
+    {
+        x->num = -x->num;
+    }
+
+    /* For each of the remaining elements */
+    for (int i = 1; i < a->count; i++)
+    {
+        lval *y = a->cell[i];
+
+        if (strcmp(op, "+") == 0)
+        {
+            x->num += y->num;
+        }
+        if (strcmp(op, "-") == 0)
+        {
+            x->num -= y->num;
+        }
+        if (strcmp(op, "*") == 0)
+        {
+            x->num *= y->num;
+        }
+        if (strcmp(op, "/") == 0)
+        {
+            if (y->num == 0)
+            {
+                lval_del(a);
+                return lval_err_code(LERR_DIV_ZERO, NULL, 0, 0, 0);
+            }
+            x->num /= y->num;
+        }
+        if (strcmp(op, "%") == 0)
+        {
+            x->num = fmod(x->num, y->num);
+        }
+        if (strcmp(op, "^") == 0)
+        {
+            x->num = (double)(pow(x->num, y->num));
+        }
+    }
+
+    return lval_take(a, 0);
+}
+
+lval *builtin_add(lenv *e, lval *a)
+{
+    return builtin_op(e, a, "+");
+}
+
+lval *builtin_sub(lenv *e, lval *a)
+{
+    return builtin_op(e, a, "-");
+}
+
+lval *builtin_mul(lenv *e, lval *a)
+{
+    return builtin_op(e, a, "*");
+}
+
+lval *builtin_div(lenv *e, lval *a)
+{
+    return builtin_op(e, a, "/");
+}
+
+//Implementation of head function
+lval *builtin_head(lenv *e, lval *a)
+{
+    /*Check Error Conditions*/
+    LASSERT_NUM("head", a, 1);
+    LASSERT_LIST("head", a, 0);
+    LASSERT_LIST_NOT_EMPTY("head", a, 0);
+
+    /*The head of a Range is just its start*/
+    if (a->cell[0]->type == LVAL_RANGE)
+    {
+        lval *x = lval_add(lval_qexpr(), lval_num(a->cell[0]->range.start));
+        lval_del(a);
+        return x;
+    }
+
+    /*Otherwise take first argument*/
+    lval *v = lval_take(a, 0);
+
+    /* Delete all elements that are not head and return */
+    while (v->count > 1)
+    {
+        lval_del(lval_pop(v, 1));
+    }
+    return v;
+}
+
+//Implementation of tail function
+lval *builtin_tail(lenv *e, lval *a)
+{
+    /* Check Error Conditions */
+    LASSERT_NUM("tail", a, 1);
+    LASSERT_LIST("tail", a, 0);
+    LASSERT_LIST_NOT_EMPTY("tail", a, 0);
+
+    /* Take first argument */
+    lval *v = lval_take(a, 0);
+
+    /* The tail of a Range starts one step later */
+    if (v->type == LVAL_RANGE)
+    {
+        v->range.start += v->range.step;
+        return v;
+    }
+
+    /* Delete first element and return */
+    lval_del(lval_pop(v, 0));
+    return v;
+}
+
+//Implementation of list function
+//It just converts the input S-Expression to a Q-Expression and returns it.
+lval *builtin_list(lenv *e, lval *a)
+{
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+//Implementation of eval function
+//It takes as input some single Q-Expression, which it converts to an S-Expression, and evaluates using lval_eval.
+lval *builtin_eval(lenv *e, lval *a)
+{
+    LASSERT_NUM("eval", a, 1);
+    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+
+    lval *x = lval_take(a, 0);
+    x->type = LVAL_SEXPR;
+    return lval_eval(e, x);
+}
+
+//Implementation of join function
+lval *builtin_join(lenv *e, lval *a)
+{
+    LASSERT_ERR(a, a->count > 0, lval_err_code(LERR_ARG_COUNT, "join", 0, 1, 0));
+
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT_LIST("join", a, i);
+
+        /* Joining has to produce real elements, so Ranges are expanded here */
+        if (a->cell[i]->type == LVAL_RANGE)
+        {
+            lval *x = lrange_list(a->cell[i]);
+            lval_del(a->cell[i]);
+            a->cell[i] = x;
+        }
+    }
+
+    lval *x = lval_pop(a, 0);
+
+    while (a->count)
+    {
+        x = lval_join(x, lval_pop(a, 0));
+    }
+
+    lval_del(a);
+    return x;
+}
+
+//Implemented the builtin function len
+lval *builtin_len(lenv *e, lval *a)
+{
+    /* Check Error Conditions */
+    LASSERT_NUM("len", a, 1);
+    LASSERT_LIST("len", a, 0);
+
+    long listLen = lval_len(a->cell[0]);
+
+    lval_del(a);
+    return lval_num(listLen);
+}
+
+//Implemented the builtin function init
+//It returns all of a Q-Expression except the final element.
+lval *builtin_init(lenv *e, lval *a)
+{
+    /* Check Error Conditions */
+    LASSERT_NUM("init", a, 1);
+    LASSERT_LIST("init", a, 0);
+    LASSERT_LIST_NOT_EMPTY("init", a, 0);
+
+    /* A Range simply ends at its last element instead */
+    if (a->cell[0]->type == LVAL_RANGE)
+    {
+        lval *v = lval_take(a, 0);
+        v->range.end = lrange_nth(v, lrange_len(v) - 1);
+        return v;
+    }
+
+    int lastItemIndex = a->cell[0]->count - 1;
+
+    lval *v = lval_take(a, 0);
+    lval_del(lval_pop(v, lastItemIndex));
+    return v;
+}
+
+//Implementation of nth
+//(nth list i) returns element i of a Q-Expression or Range, counting from 0.
+lval *builtin_nth(lenv *e, lval *a)
+{
+    LASSERT_NUM("nth", a, 2);
+    LASSERT_LIST("nth", a, 0);
+    LASSERT_TYPE("nth", a, 1, LVAL_NUM);
+
+    double i = a->cell[1]->num;
+    LASSERT_STATIC(a, i >= 0 && i < lval_len(a->cell[0]) && i == floor(i),
+                   "Function 'nth' passed an index out of range");
+
+    lval *x = a->cell[0]->type == LVAL_RANGE
+                  ? lval_num(lrange_nth(a->cell[0], (long)i))
+                  : lval_copy(a->cell[0]->cell[(long)i]);
+    lval_del(a);
+    return x;
+}
+
+//Implementation of range
+//(range end), (range start end) or (range start end step), the numbers from start up to but excluding end.
+lval *builtin_range(lenv *e, lval *a)
+{
+    LASSERT_ERR(a, a->count >= 1 && a->count <= 3, lval_err_code(LERR_ARG_COUNT, "range", a->count, 2, 0));
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT_TYPE("range", a, i, LVAL_NUM);
+    }
+
+    double start = a->count > 1 ? a->cell[0]->num : 0;
+    double end = a->count > 1 ? a->cell[1]->num : a->cell[0]->num;
+    double step = a->count > 2 ? a->cell[2]->num : 1;
+    LASSERT_STATIC(a, step != 0, "Function 'range' passed a step of 0");
+
+    lval_del(a);
+    return lval_range(start, end, step);
+}
+
+void lenv_put(lenv *e, lval *k, lval *v);
+
+lval *builtin_def(lenv *e, lval *a)
+{
+    LASSERT_ERR(a, a->count > 0, lval_err_code(LERR_ARG_COUNT, "def", 0, 1, 0));
+    LASSERT_STATIC(a, a->cell[0]->type == LVAL_QEXPR, "Function 'def' passed incorrect type!");
+
+    /* First argument is symbol list */
+    lval *syms = a->cell[0];
+
+    /* Ensure all elements of first list are symbols */
+    for (int i = 0; i < syms->count; i++)
+    {
+        LASSERT_STATIC(a, syms->cell[i]->type == LVAL_SYM,
+                       "Function 'def' cannot define non-symbol");
+    }
+
+    /* Check correct number of symbols and values */
+    LASSERT_STATIC(a, syms->count == a->count - 1,
+                   "Function 'def' cannot define incorrect "
+                   "number of values to symbols");
+
+    /* Assign copies of values to symbols */
+    for (int i = 0; i < syms->count; i++)
+    {
+        lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+int lenv_index(lenv *e, lval *k);
+
+/*Loop conditions are Numbers, anything other than zero counts as true*/
+int lval_truthy(lval *v)
+{
+    return v->type == LVAL_NUM && v->num != 0;
+}
+
+/*
+Implementation of while
+(while {cond} {body}) evaluates body for as long as cond evaluates to a non-zero number.
+Both are evaluated in place with lval_eval_const, so neither is copied per iteration.
+*/
+lval *builtin_while(lenv *e, lval *a)
+{
+    LASSERT_NUM("while", a, 2);
+    LASSERT_TYPE("while", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("while", a, 1, LVAL_QEXPR);
+
+    lval *cond = a->cell[0];
+    lval *body = a->cell[1];
+
+    while (1)
+    {
+        lval *c = lval_eval_const_sexpr(e, cond);
+        if (c->type == LVAL_ERR)
+        {
+            lval_del(a);
+            return c;
+        }
+
+        int truthy = lval_truthy(c);
+        lval_del(c);
+        if (!truthy)
+            break;
+
+        lval *r = lval_eval_const_sexpr(e, body);
+        if (r->type == LVAL_ERR)
+        {
+            lval_del(a);
+            return r;
+        }
+        lval_del(r);
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/*
+Implementation of dotimes
+(dotimes {i} n {body}) evaluates body n times with i bound to 0 .. n-1.
+*/
+lval *builtin_dotimes(lenv *e, lval *a)
+{
+    LASSERT_NUM("dotimes", a, 3);
+    LASSERT_TYPE("dotimes", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("dotimes", a, 1, LVAL_NUM);
+    LASSERT_TYPE("dotimes", a, 2, LVAL_QEXPR);
+    LASSERT_STATIC(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+                   "Function 'dotimes' needs exactly one symbol to bind");
+
+    lval *sym = a->cell[0]->cell[0];
+    lval *body = a->cell[2];
+    double n = a->cell[1]->num;
+
+    /*Bind the counter once, then update it in place while it still holds a Number*/
+    lval *counter = lval_num(0);
+    lenv_put(e, sym, counter);
+    lval_del(counter);
+    int slot = lenv_index(e, sym);
+
+    for (double i = 0; i < n; i++)
+    {
+        /*Other threads may be reading a shared environment, so it only ever gets new values*/
+        if (!e->shared && e->vals[slot]->type == LVAL_NUM)
+        {
+            e->vals[slot]->num = i;
+        }
+        else
+        {
+            counter = lval_num(i);
+            lenv_put(e, sym, counter);
+            lval_del(counter);
+        }
+
+        lval *r = lval_eval_const_sexpr(e, body);
+        if (r->type == LVAL_ERR)
+        {
+            lval_del(a);
+            return r;
+        }
+        lval_del(r);
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/*
+Implementation of for-each
+(for-each {x} {list} {body}) evaluates body once per element of list with x bound to it.
+*/
+lval *builtin_for_each(lenv *e, lval *a)
+{
+    LASSERT_NUM("for-each", a, 3);
+    LASSERT_TYPE("for-each", a, 0, LVAL_QEXPR);
+    LASSERT_LIST("for-each", a, 1);
+    LASSERT_TYPE("for-each", a, 2, LVAL_QEXPR);
+    LASSERT_STATIC(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+                   "Function 'for-each' needs exactly one symbol to bind");
+
+    lval *sym = a->cell[0]->cell[0];
+    lval *list = a->cell[1];
+    lval *body = a->cell[2];
+
+    long n = lval_len(list);
+    for (long i = 0; i < n; i++)
+    {
+        if (list->type == LVAL_RANGE)
+        {
+            lval *x = lval_num(lrange_nth(list, i));
+            lenv_put(e, sym, x);
+            lval_del(x);
+        }
+        else
+        {
+            lenv_put(e, sym, list->cell[i]);
+        }
+
+        lval *r = lval_eval_const_sexpr(e, body);
+        if (r->type == LVAL_ERR)
+        {
+            lval_del(a);
+            return r;
+        }
+        lval_del(r);
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/*
+Implementation of defmacro
+(defmacro {name params...} {template}) binds name to a macro. A call (name args...)
+is replaced by the template with each parameter substituted by its unevaluated argument.
+*/
+lval *builtin_defmacro(lenv *e, lval *a)
+{
+    LASSERT_NUM("defmacro", a, 2);
+    LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("defmacro", a, 0);
+
+    for (int i = 0; i < a->cell[0]->count; i++)
+    {
+        LASSERT_STATIC(a, a->cell[0]->cell[i]->type == LVAL_SYM,
+                       "Function 'defmacro' cannot define non-symbol");
+    }
+
+    lval *params = lval_pop(a, 0);
+    lval *name = lval_pop(params, 0);
+    lval *body = lval_take(a, 0);
+
+    lval *binders = lval_qexpr();
+    lmacro_collect_binders(params, body, binders);
+
+    lval *m = lval_macro(params, body, binders);
+    lenv_put(e, name, m);
+    lmacro_epoch++;
+
+    lval_del(m);
+    lval_del(name);
+    return lval_sexpr();
+}
+
+/*
+Implementation of macroexpand
+Takes a Q-Expression holding a macro call and returns its expansion as a Q-Expression,
+expanding again for as long as the result is itself a macro call.
+*/
+lval *builtin_macroexpand(lenv *e, lval *a)
+{
+    LASSERT_NUM("macroexpand", a, 1);
+    LASSERT_TYPE("macroexpand", a, 0, LVAL_QEXPR);
+
+    lval *x = lval_take(a, 0);
+    x->type = LVAL_SEXPR;
+
+    lval *m;
+    for (int depth = 0; x->type == LVAL_SEXPR && (m = lval_macro_target(e, x)); depth++)
+    {
+        if (depth == LMACRO_MAX_DEPTH)
+        {
+            lval_del(x);
+            return lval_err_code(LERR_STATIC, "Macro expansion too deep", 0, 0, 0);
+        }
+
+        lval *y = lmacro_expand(m, x);
+        lmacro_expansions++;
+        lval_del(x);
+        x = y;
+    }
+
+    if (x->type == LVAL_SEXPR)
+        x->type = LVAL_QEXPR;
+    return x;
+}
+
+/*Implementation of macro-stats, (macro-stats {}) returns {expansions cache-hits}*/
+lval *builtin_macro_stats(lenv *e, lval *a)
+{
+    LASSERT_NUM("macro-stats", a, 1);
+    lval_del(a);
+    lval *x = lval_qexpr();
+    lval_add(x, lval_num(lmacro_expansions));
+    lval_add(x, lval_num(lmacro_hits));
+    return x;
+}
+
+/*Structural hash of an lval, equal values always hash the same*/
+unsigned long lval_hash(lval *v)
+{
+    unsigned long h = 1469598103934665603UL ^ (unsigned long)v->type;
+
+    switch (v->type)
+    {
+    case LVAL_NUM:
+    {
+        /*Fold -0 into 0 so they hash like they compare*/
+        double x = v->num == 0 ? 0 : v->num;
+        unsigned long bits;
+        memcpy(&bits, &x, sizeof(bits));
+        h ^= bits;
+        h *= 1099511628211UL;
+        break;
+    }
+    case LVAL_SYM:
+        for (char *c = v->sym; *c; c++)
+        {
+            h ^= (unsigned char)*c;
+            h *= 1099511628211UL;
+        }
+        break;
+    case LVAL_ERR:
+        h ^= (unsigned long)v->errcode;
+        h *= 1099511628211UL;
+        break;
+    case LVAL_FUN:
+    case LVAL_MEMO:
+        h ^= (unsigned long)v->fun ^ (unsigned long)v->memo;
+        h *= 1099511628211UL;
+        break;
+    case LVAL_PROMISE:
+    case LVAL_STREAM:
+    case LVAL_XFORM:
+    case LVAL_FUTURE:
+    case LVAL_CORO:
+    case LVAL_ACTOR:
+    case LVAL_REF:
+        h ^= (unsigned long)v->stream;
+        h *= 1099511628211UL;
+        break;
+    case LVAL_RANGE:
+    {
+        unsigned long bits[3];
+        memcpy(bits, &v->range, sizeof(bits));
+        for (int i = 0; i < 3; i++)
+        {
+            h ^= bits[i];
+            h *= 1099511628211UL;
+        }
+        break;
+    }
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_MACRO:
+        for (int i = 0; i < v->count; i++)
+        {
+            h ^= lval_hash(v->cell[i]);
+            h *= 1099511628211UL;
+        }
+        break;
+    }
+
+    return h;
+}
+
+/*Structural equality of two lvals*/
+int lval_eq(lval *x, lval *y)
+{
+    if (x->type != y->type)
+        return 0;
+
+    switch (x->type)
+    {
+    case LVAL_NUM:
+        return x->num == y->num;
+    case LVAL_SYM:
+        return strcmp(x->sym, y->sym) == 0;
+    case LVAL_ERR:
+        return x == y;
+    case LVAL_FUN:
+    case LVAL_MEMO:
+        return x->fun == y->fun && x->memo == y->memo;
+    case LVAL_PROMISE:
+        return x->promise == y->promise;
+    case LVAL_STREAM:
+        return x->stream == y->stream;
+    case LVAL_XFORM:
+        return x->xform == y->xform;
+    case LVAL_FUTURE:
+        return x->future == y->future;
+    case LVAL_CORO:
+        return x->coro == y->coro;
+    case LVAL_ACTOR:
+        return x->actor == y->actor;
+    case LVAL_REF:
+        return x->ref == y->ref;
+    case LVAL_RANGE:
+        return x->range.start == y->range.start && x->range.end == y->range.end &&
+               x->range.step == y->range.step;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_MACRO:
+        if (x->count != y->count)
+            return 0;
+        for (int i = 0; i < x->count; i++)
+        {
+            if (!lval_eq(x->cell[i], y->cell[i]))
+                return 0;
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+/*Approximate number of bytes of memory held by an lval*/
+long lval_bytes(lval *v)
+{
+    long n = sizeof(lval);
+
+    switch (v->type)
+    {
+    case LVAL_SYM:
+        n += strlen(v->sym) + 1;
+        break;
+    case LVAL_ERR:
+        n += v->err ? strlen(v->err) + 1 : 0;
+        break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_MACRO:
+        n += sizeof(lval *) * v->count;
+        for (int i = 0; i < v->count; i++)
+        {
+            n += lval_bytes(v->cell[i]);
+        }
+        break;
+    }
+
+    return n;
+}
+
+lmemo *lmemo_new(long budget)
+{
+    lmemo *m = malloc(sizeof(lmemo));
+    m->refs = 0;
+    m->budget = budget;
+    m->bytes = 0;
+    m->hits = 0;
+    m->misses = 0;
+    m->evictions = 0;
+    m->count = 0;
+    m->slots = 64;
+    m->buckets = calloc(m->slots, sizeof(lmemo_entry *));
+    m->newest = NULL;
+    m->oldest = NULL;
+    return m;
+}
+
+/*Unlink entry 'x' from the recency list*/
+void lmemo_unlink(lmemo *m, lmemo_entry *x)
+{
+    if (x->newer)
+        x->newer->older = x->older;
+    else
+        m->newest = x->older;
+
+    if (x->older)
+        x->older->newer = x->newer;
+    else
+        m->oldest = x->newer;
+}
+
+/*Make entry 'x' the most recently used*/
+void lmemo_touch(lmemo *m, lmemo_entry *x)
+{
+    x->newer = NULL;
+    x->older = m->newest;
+    if (m->newest)
+        m->newest->newer = x;
+    m->newest = x;
+    if (!m->oldest)
+        m->oldest = x;
+}
+
+/*Remove entry 'x' from the table and free it*/
+void lmemo_remove(lmemo *m, lmemo_entry *x)
+{
+    lmemo_entry **p = &m->buckets[x->hash & (m->slots - 1)];
+    while (*p != x)
+        p = &(*p)->next;
+    *p = x->next;
+
+    lmemo_unlink(m, x);
+    m->bytes -= x->bytes;
+    m->count--;
+
+    lval_del(x->key);
+    lval_del(x->value);
+    free(x);
+}
+
+/*Evict least recently used entries until the table fits its budget*/
+void lmemo_shrink(lmemo *m)
+{
+    while (m->oldest && m->bytes > m->budget)
+    {
+        lmemo_remove(m, m->oldest);
+        m->evictions++;
+    }
+}
+
+void lmemo_clear(lmemo *m)
+{
+    while (m->oldest)
+        lmemo_remove(m, m->oldest);
+}
+
+void lmemo_release(lmemo *m)
+{
+    if (--m->refs > 0)
+        return;
+
+    lmemo_clear(m);
+    free(m->buckets);
+    free(m);
+}
+
+/*Find the entry for 'key', counting a hit or a miss*/
+lmemo_entry *lmemo_find(lmemo *m, lval *key, unsigned long hash)
+{
+    for (lmemo_entry *x = m->buckets[hash & (m->slots - 1)]; x; x = x->next)
+    {
+        if (x->hash == hash && lval_eq(x->key, key))
+        {
+            lmemo_unlink(m, x);
+            lmemo_touch(m, x);
+            m->hits++;
+            return x;
+        }
+    }
+
+    m->misses++;
+    return NULL;
+}
+
+/*Store 'value' under 'key', taking ownership of both*/
+void lmemo_insert(lmemo *m, lval *key, lval *value, unsigned long hash)
+{
+    /*Replace any existing entry for the same key*/
+    for (lmemo_entry *x = m->buckets[hash & (m->slots - 1)]; x; x = x->next)
+    {
+        if (x->hash == hash && lval_eq(x->key, key))
+        {
+            lmemo_remove(m, x);
+            break;
+        }
+    }
+
+    /*Double the bucket array once it is full*/
+    if (m->count >= m->slots)
+    {
+        int slots = m->slots * 2;
+        lmemo_entry **buckets = calloc(slots, sizeof(lmemo_entry *));
+        for (int i = 0; i < m->slots; i++)
+        {
+            lmemo_entry *x = m->buckets[i];
+            while (x)
+            {
+                lmemo_entry *next = x->next;
+                x->next = buckets[x->hash & (slots - 1)];
+                buckets[x->hash & (slots - 1)] = x;
+                x = next;
+            }
+        }
+        free(m->buckets);
+        m->buckets = buckets;
+        m->slots = slots;
+    }
+
+    lmemo_entry *x = malloc(sizeof(lmemo_entry));
+    x->hash = hash;
+    x->key = key;
+    x->value = value;
+    x->bytes = sizeof(lmemo_entry) + lval_bytes(key) + lval_bytes(value);
+    x->next = m->buckets[hash & (m->slots - 1)];
+    m->buckets[hash & (m->slots - 1)] = x;
+    lmemo_touch(m, x);
+    m->bytes += x->bytes;
+    m->count++;
+
+    lmemo_shrink(m);
+}
+
+lval *builtin_parallel(lenv *e, lval *a);
+lval *builtin_macroexpand(lenv *e, lval *a);
+lval *builtin_macro_stats(lenv *e, lval *a);
+lval *builtin_stm_stats(lenv *e, lval *a);
+lval *builtin_yield(lenv *e, lval *a);
+lval *builtin_spawn(lenv *e, lval *a);
+lval *builtin_send(lenv *e, lval *a);
+lval *builtin_receive(lenv *e, lval *a);
+lval *builtin_self(lenv *e, lval *a);
+lval *builtin_ref(lenv *e, lval *a);
+lval *builtin_deref(lenv *e, lval *a);
+lval *builtin_alter(lenv *e, lval *a);
+lval *builtin_dosync(lenv *e, lval *a);
+
+/*Builtins whose results depend on more than the code and bindings, or that reach outside the code running*/
+lbuiltin lmemo_impure[] = {builtin_parallel, builtin_macroexpand, builtin_macro_stats, builtin_stm_stats,
+                           builtin_yield, builtin_spawn, builtin_send, builtin_receive, builtin_self,
+                           builtin_ref, builtin_deref, builtin_alter, builtin_dosync, NULL};
+
+/*Whether 'v' is or holds a value shared by reference count, whose state can change under a remembered result*/
+int lmemo_shared(lval *v)
+{
+    switch (v->type)
+    {
+    case LVAL_FUN:
+        return v->memo != NULL;
+    case LVAL_MEMO:
+    case LVAL_PROMISE:
+    case LVAL_STREAM:
+    case LVAL_XFORM:
+    case LVAL_FUTURE:
+    case LVAL_CORO:
+    case LVAL_ACTOR:
+    case LVAL_REF:
+        return 1;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_MACRO:
+        for (int i = 0; i < v->count; i++)
+        {
+            if (lmemo_shared(v->cell[i]))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Add to 'reads' each symbol 'v' mentions, as {sym value} or {sym} if it is unbound. Return 0 if that
+cannot decide the result. Code can only look up symbols that are written in it or in the values it
+reads, so values that are lists or macros are walked as well.
+*/
+int lmemo_reads(lenv *e, lval *v, lval *reads)
+{
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR || v->type == LVAL_MACRO)
+    {
+        for (int i = 0; i < v->count; i++)
+        {
+            if (!lmemo_reads(e, v->cell[i], reads))
+                return 0;
+        }
+        return 1;
+    }
+
+    if (v->type != LVAL_SYM)
+        return !lmemo_shared(v);
+
+    for (int i = 0; i < reads->count; i++)
+    {
+        if (strcmp(reads->cell[i]->cell[0]->sym, v->sym) == 0)
+            return 1;
+    }
+
+    lval *r = lval_add(lval_qexpr(), lval_copy(v));
+    lval_add(reads, r);
+
+    lval *x = lenv_lookup(e, v);
+    if (!x)
+        return 1;
+
+    if (x->type == LVAL_FUN)
+    {
+        for (int i = 0; lmemo_impure[i]; i++)
+        {
+            if (x->fun == lmemo_impure[i])
+                return 0;
+        }
+    }
+
+    lval_add(r, lval_copy(x));
+    return lmemo_reads(e, x, reads);
+}
+
+/*Call memoized function 'f' on arguments 'a', answering from its memo table when possible*/
+lval *lmemo_call(lenv *e, lval *f, lval *a)
+{
+    lmemo *m = f->memo;
+
+    /*The code runs in a private environment, so what it defines and binds stays there*/
+    lenv *c = lenv_child(e);
+
+    /*The key is the code and the bindings it reads, a def of any of them makes a new key*/
+    lval *key = lval_qexpr();
+    if (!lmemo_reads(e, a, key))
+    {
+        lval_del(key);
+        lval *result = f->fun(c, a);
+        lenv_del(c);
+        return result;
+    }
+    lval_add(key, lval_copy(a));
+
+    unsigned long hash = lval_hash(key);
+    lmemo_entry *x = lmemo_find(m, key, hash);
+    if (x)
+    {
+        lval_del(key);
+        lval_del(a);
+        lenv_del(c);
+        return lval_copy(x->value);
+    }
+
+    lval *result = f->fun(c, a);
+    lenv_del(c);
+
+    /*Errors are not remembered, and neither are results that share state with the code that made them*/
+    if (result->type == LVAL_ERR || lmemo_shared(result))
+    {
+        lval_del(key);
+        return result;
+    }
+
+    lmemo_insert(m, key, lval_copy(result), hash);
+    return result;
+}
+
+/*Optional byte budget argument at 'index', or the default budget*/
+#define LMEMO_BUDGET(func, args, index)                   \
+    if (args->count > index)                              \
+    {                                                     \
+        LASSERT_TYPE(func, args, index, LVAL_NUM);        \
+        LASSERT_STATIC(args, args->cell[index]->num >= 0, \
+                       "Memo budget cannot be negative"); \
+    }
+
+//Implementation of memo
+//(memo eval) or (memo eval budget) returns an eval that remembers the result of each program it runs.
+//A program runs in a private environment, and is run again whenever a binding it reads has changed.
+//Programs that yield, send, receive, use refs or read global counters are always run.
+lval *builtin_memo(lenv *e, lval *a)
+{
+    LASSERT_ERR(a, a->count == 1 || a->count == 2, lval_err_code(LERR_ARG_COUNT, "memo", a->count, 1, 0));
+    LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+    LASSERT_STATIC(a, a->cell[0]->fun == builtin_eval && !a->cell[0]->memo,
+                   "Function 'memo' can only wrap eval");
+    LMEMO_BUDGET("memo", a, 1);
+
+    long budget = a->count > 1 ? (long)a->cell[1]->num : LMEMO_DEFAULT_BUDGET;
+
+    lval *f = lval_fun(a->cell[0]->fun);
+    f->memo = lmemo_new(budget);
+    f->memo->refs++;
+
+    lval_del(a);
+    return f;
+}
+
+//Implementation of memo-table
+//(memo-table {}) or (memo-table budget) returns a new empty memo table.
+lval *builtin_memo_table(lenv *e, lval *a)
+{
+    LASSERT_NUM("memo-table", a, 1);
+
+    long budget = LMEMO_DEFAULT_BUDGET;
+    if (a->cell[0]->type != LVAL_QEXPR)
+    {
+        LMEMO_BUDGET("memo-table", a, 0);
+        budget = (long)a->cell[0]->num;
+    }
+
+    lval_del(a);
+    return lval_memo(lmemo_new(budget));
+}
+
+//Implementation of memo-get
+//(memo-get table key) returns {value} if key is stored, otherwise {}.
+lval *builtin_memo_get(lenv *e, lval *a)
+{
+    LASSERT_NUM("memo-get", a, 2);
+    LASSERT_TYPE("memo-get", a, 0, LVAL_MEMO);
+
+    lval *x = lval_qexpr();
+    lmemo_entry *entry = lmemo_find(a->cell[0]->memo, a->cell[1], lval_hash(a->cell[1]));
+    if (entry)
+    {
+        lval_add(x, lval_copy(entry->value));
+    }
+
+    lval_del(a);
+    return x;
+}
+
+//Implementation of memo-put
+//(memo-put table key value) stores value under key.
+lval *builtin_memo_put(lenv *e, lval *a)
+{
+    LASSERT_NUM("memo-put", a, 3);
+    LASSERT_TYPE("memo-put", a, 0, LVAL_MEMO);
+
+    lmemo *m = a->cell[0]->memo;
+    lval *value = lval_pop(a, 2);
+    lval *key = lval_pop(a, 1);
+    lmemo_insert(m, key, value, lval_hash(key));
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/*The memo table behind a Memo Table or memoized function argument*/
+#define LMEMO_ARG(func, args, index)                                                          \
+    LASSERT_ERR(args, args->cell[index]->type == LVAL_MEMO ||                                 \
+                          (args->cell[index]->type == LVAL_FUN && args->cell[index]->memo), \
+                lval_err_code(LERR_ARG_TYPE, func, index, args->cell[index]->type, LVAL_MEMO))
+
+//Implementation of memo-budget
+//(memo-budget t bytes) changes the byte budget of a table or memoized function, evicting if needed.
+lval *builtin_memo_budget(lenv *e, lval *a)
+{
+    LASSERT_NUM("memo-budget", a, 2);
+    LMEMO_ARG("memo-budget", a, 0);
+    LMEMO_BUDGET("memo-budget", a, 1);
+
+    lmemo *m = a->cell[0]->memo;
+    m->budget = (long)a->cell[1]->num;
+    lmemo_shrink(m);
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+//Implementation of memo-clear
+lval *builtin_memo_clear(lenv *e, lval *a)
+{
+    LASSERT_NUM("memo-clear", a, 1);
+    LMEMO_ARG("memo-clear", a, 0);
+
+    lmemo_clear(a->cell[0]->memo);
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+//Implementation of memo-stats
+//(memo-stats t) returns {hits misses evictions bytes entries budget} for a table or memoized function.
+lval *builtin_memo_stats(lenv *e, lval *a)
+{
+    LASSERT_NUM("memo-stats", a, 1);
+    LMEMO_ARG("memo-stats", a, 0);
+
+    lmemo *m = a->cell[0]->memo;
+    lval *x = lval_qexpr();
+    lval_add(x, lval_num(m->hits));
+    lval_add(x, lval_num(m->misses));
+    lval_add(x, lval_num(m->evictions));
+    lval_add(x, lval_num(m->bytes));
+    lval_add(x, lval_num(m->count));
+    lval_add(x, lval_num(m->budget));
+
+    lval_del(a);
+    return x;
+}
+
+void lpromise_release(lpromise *p)
+{
+    if (--p->refs > 0)
+        return;
+
+    lval_del(p->code);
+    if (p->value)
+        lval_del(p->value);
+    free(p);
+}
+
+/*Evaluate a promise the first time it is forced, later forces return the remembered value*/
+lval *lpromise_force(lenv *e, lpromise *p)
+{
+    if (!p->value)
+    {
+        lval *x = lval_eval_const_sexpr(e, p->code);
+
+        /*Errors are not remembered, forcing again retries*/
+        if (x->type == LVAL_ERR)
+            return x;
+
+        p->value = x;
+    }
+
+    return lval_copy(p->value);
+}
+
+void lstream_release(lstream *s)
+{
+    if (--s->refs > 0)
+        return;
+
+    if (s->items)
+        lval_del(s->items);
+    if (s->binders)
+        lval_del(s->binders);
+    if (s->body)
+        lval_del(s->body);
+    if (s->tail)
+        lval_del(s->tail);
+    if (s->src)
+        lstream_release(s->src);
+    free(s);
+}
+
+lstream_iter *lstream_iter_new(lstream *s)
+{
+    lstream_iter *it = calloc(1, sizeof(lstream_iter));
+    it->s = s;
+    s->refs++;
+    it->n = s->n;
+
+    if (s->src)
+        it->src = lstream_iter_new(s->src);
+
+    if (s->kind == LSTREAM_CONS)
+    {
+        it->node = s;
+        s->refs++;
+    }
+
+    return it;
+}
+
+void lstream_iter_del(lstream_iter *it)
+{
+    if (it->src)
+        lstream_iter_del(it->src);
+    if (it->node)
+        lstream_release(it->node);
+    if (it->cur)
+        lval_del(it->cur);
+    lstream_release(it->s);
+    free(it);
+}
+
+/*Bind the symbols in 'binders' to the values of 'args', in order*/
+void lenv_bind(lenv *e, lval *binders, lval **args)
+{
+    for (int i = 0; i < binders->count; i++)
+    {
+        lenv_put(e, binders->cell[i], args[i]);
+    }
+}
+
+/*Evaluate 'body' with the single symbol in 'binders' bound to 'x'*/
+lval *lval_apply_body(lenv *e, lval *binders, lval *body, lval *x)
+{
+    lenv_bind(e, binders, &x);
+    return lval_eval_const_sexpr(e, body);
+}
+
+lstream *lstream_of(lval *v);
+
+/*
+Produce the next element of a stream.
+Returns NULL once the stream is exhausted, or an Error lval if producing the element failed.
+*/
+lval *lstream_next(lenv *e, lstream_iter *it)
+{
+    lstream *s = it->s;
+    lval *x;
+
+    switch (s->kind)
+    {
+    case LSTREAM_LIST:
+        if (it->index >= lval_len(s->items))
+            return NULL;
+        if (s->items->type == LVAL_RANGE)
+            return lval_num(lrange_nth(s->items, it->index++));
+        return lval_copy(s->items->cell[it->index++]);
+
+    case LSTREAM_ITERATE:
+        /*The next element is only computed when it is asked for*/
+        x = it->cur ? lval_apply_body(e, s->binders, s->body, it->cur) : lval_copy(s->items);
+        if (x->type == LVAL_ERR)
+            return x;
+        if (it->cur)
+            lval_del(it->cur);
+        it->cur = x;
+        return lval_copy(x);
+
+    case LSTREAM_CONS:
+        /*Once a tail has forced to another kind of stream, the rest comes from that*/
+        if (it->src)
+            return lstream_next(e, it->src);
+
+        if (!it->node)
+            return NULL;
+
+        /*Force the tail of the node we produced last time only now*/
+        if (it->cur)
+        {
+            lval *t = lpromise_force(e, it->node->tail->promise);
+            if (t->type == LVAL_ERR)
+                return t;
+
+            lval_del(it->cur);
+            it->cur = NULL;
+            lstream_release(it->node);
+            it->node = NULL;
+
+            if (t->type == LVAL_STREAM && t->stream->kind == LSTREAM_CONS)
+            {
+                it->node = t->stream;
+                it->node->refs++;
+            }
+            else if (t->type == LVAL_STREAM || t->type == LVAL_QEXPR || t->type == LVAL_RANGE)
+            {
+                lstream *rest = lstream_of(t);
+                it->src = lstream_iter_new(rest);
+                lstream_release(rest);
+                lval_del(t);
+                return lstream_next(e, it->src);
+            }
+            lval_del(t);
+
+            if (!it->node)
+                return NULL;
+        }
+
+        it->cur = lval_copy(it->node->items);
+        return lval_copy(it->cur);
+
+    case LSTREAM_MAP:
+        x = lstream_next(e, it->src);
+        if (!x || x->type == LVAL_ERR)
+            return x;
+        {
+            lval *y = lval_apply_body(e, s->binders, s->body, x);
+            lval_del(x);
+            return y;
+        }
+
+    case LSTREAM_FILTER:
+        while ((x = lstream_next(e, it->src)) && x->type != LVAL_ERR)
+        {
+            lval *c = lval_apply_body(e, s->binders, s->body, x);
+            if (c->type == LVAL_ERR)
+            {
+                lval_del(x);
+                return c;
+            }
+
+            int keep = lval_truthy(c);
+            lval_del(c);
+            if (keep)
+                return x;
+            lval_del(x);
+        }
+        return x;
+
+    case LSTREAM_TAKE:
+        if (it->n <= 0)
+            return NULL;
+        it->n--;
+        return lstream_next(e, it->src);
+
+    case LSTREAM_DROP:
+        while (it->n > 0)
+        {
+            it->n--;
+            x = lstream_next(e, it->src);
+            if (!x || x->type == LVAL_ERR)
+                return x;
+            lval_del(x);
+        }
+        return lstream_next(e, it->src);
+    }
+
+    return NULL;
+}
+
+/*Streams also accept a Q-Expression or Range, which streams its elements*/
+lstream *lstream_of(lval *v)
+{
+    if (v->type == LVAL_STREAM)
+    {
+        v->stream->refs++;
+        return v->stream;
+    }
+
+    lstream *x = calloc(1, sizeof(lstream));
+    x->refs = 1;
+    x->kind = LSTREAM_LIST;
+    x->items = lval_copy(v);
+    return x;
+}
+
+#define LASSERT_STREAM(func, args, index)                                                          \
+    LASSERT_ERR(args, args->cell[index]->type == LVAL_STREAM || args->cell[index]->type == LVAL_QEXPR || \
+                          args->cell[index]->type == LVAL_RANGE,                                   \
+                lval_err_code(LERR_ARG_TYPE, func, index, args->cell[index]->type, LVAL_STREAM))
+
+#define LASSERT_BINDERS(func, args, index, num)                                                   \
+    LASSERT_TYPE(func, args, index, LVAL_QEXPR);                                                  \
+    LASSERT_ERR(args, args->cell[index]->count == num,                                            \
+                lval_err_code(LERR_ARG_COUNT, func, args->cell[index]->count, num, 0));           \
+    for (int b = 0; b < num; b++)                                                                 \
+    {                                                                                             \
+        LASSERT_ERR(args, args->cell[index]->cell[b]->type == LVAL_SYM,                           \
+                    lval_err_code(LERR_ARG_TYPE, func, index, args->cell[index]->cell[b]->type, LVAL_SYM)); \
+    }
+
+//Implementation of delay
+//(delay {expr}) returns a promise to evaluate expr when it is first forced.
+lval *builtin_delay(lenv *e, lval *a)
+{
+    LASSERT_NUM("delay", a, 1);
+    LASSERT_TYPE("delay", a, 0, LVAL_QEXPR);
+
+    return lval_promise(lval_take(a, 0));
+}
+
+//Implementation of force
+//Forces a promise, any other value is returned as it is.
+lval *builtin_force(lenv *e, lval *a)
+{
+    LASSERT_NUM("force", a, 1);
+
+    if (a->cell[0]->type != LVAL_PROMISE)
+        return lval_take(a, 0);
+
+    lval *x = lpromise_force(e, a->cell[0]->promise);
+    lval_del(a);
+    return x;
+}
+
+//Implementation of stream-cons
+//(stream-cons x p) is the stream of x followed by the stream that promise p forces to.
+lval *builtin_stream_cons(lenv *e, lval *a)
+{
+    LASSERT_NUM("stream-cons", a, 2);
+    LASSERT_TYPE("stream-cons", a, 1, LVAL_PROMISE);
+
+    lval *s = lval_stream(LSTREAM_CONS);
+    s->stream->tail = lval_pop(a, 1);
+    s->stream->items = lval_take(a, 0);
+    return s;
+}
+
+//Implementation of stream-iterate
+//(stream-iterate {x} {body} seed) is the infinite stream seed, body of seed, body of that, ...
+lval *builtin_stream_iterate(lenv *e, lval *a)
+{
+    LASSERT_NUM("stream-iterate", a, 3);
+    LASSERT_BINDERS("stream-iterate", a, 0, 1);
+    LASSERT_TYPE("stream-iterate", a, 1, LVAL_QEXPR);
+
+    lval *s = lval_stream(LSTREAM_ITERATE);
+    s->stream->items = lval_pop(a, 2);
+    s->stream->body = lval_pop(a, 1);
+    s->stream->binders = lval_take(a, 0);
+    return s;
+}
+
+/*Shared implementation of stream-map and stream-filter*/
+lval *builtin_stream_stage(lenv *e, lval *a, char *func, int kind)
+{
+    LASSERT_NUM(func, a, 3);
+    LASSERT_BINDERS(func, a, 0, 1);
+    LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+    LASSERT_STREAM(func, a, 2);
+
+    lval *s = lval_stream(kind);
+    s->stream->src = lstream_of(a->cell[2]);
+    s->stream->body = lval_pop(a, 1);
+    s->stream->binders = lval_pop(a, 0);
+    lval_del(a);
+    return s;
+}
+
+//Implementation of stream-map
+//(stream-map {x} {body} s) is the stream of body evaluated for each element x of s.
+lval *builtin_stream_map(lenv *e, lval *a)
+{
+    return builtin_stream_stage(e, a, "stream-map", LSTREAM_MAP);
+}
+
+//Implementation of stream-filter
+//(stream-filter {x} {body} s) is the stream of the elements x of s for which body is non-zero.
+lval *builtin_stream_filter(lenv *e, lval *a)
+{
+    return builtin_stream_stage(e, a, "stream-filter", LSTREAM_FILTER);
+}
+
+/*Shared implementation of stream-take and stream-drop*/
+lval *builtin_stream_count(lenv *e, lval *a, char *func, int kind)
+{
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_NUM);
+    LASSERT_STREAM(func, a, 1);
+
+    lval *s = lval_stream(kind);
+    s->stream->n = a->cell[0]->num;
+    s->stream->src = lstream_of(a->cell[1]);
+    lval_del(a);
+    return s;
+}
+
+//Implementation of stream-take
+//(stream-take n s) is the stream of the first n elements of s.
+lval *builtin_stream_take(lenv *e, lval *a)
+{
+    return builtin_stream_count(e, a, "stream-take", LSTREAM_TAKE);
+}
+
+//Implementation of stream-drop
+//(stream-drop n s) is the stream of the elements of s after the first n.
+lval *builtin_stream_drop(lenv *e, lval *a)
+{
+    return builtin_stream_count(e, a, "stream-drop", LSTREAM_DROP);
+}
+
+//Implementation of stream-reduce
+//(stream-reduce {acc x} {body} init s) folds body over s one element at a time, in constant memory.
+lval *builtin_stream_reduce(lenv *e, lval *a)
+{
+    LASSERT_NUM("stream-reduce", a, 4);
+    LASSERT_BINDERS("stream-reduce", a, 0, 2);
+    LASSERT_TYPE("stream-reduce", a, 1, LVAL_QEXPR);
+    LASSERT_STREAM("stream-reduce", a, 3);
+
+    lstream *s = lstream_of(a->cell[3]);
+    lstream_iter *it = lstream_iter_new(s);
+    lstream_release(s);
+
+    lval *acc = lval_copy(a->cell[2]);
+    lval *x;
+    while ((x = lstream_next(e, it)))
+    {
+        if (x->type == LVAL_ERR)
+        {
+            lval_del(acc);
+            acc = x;
+            break;
+        }
+
+        lval *args[2] = {acc, x};
+        lenv_bind(e, a->cell[0], args);
+        lval_del(acc);
+        lval_del(x);
+
+        acc = lval_eval_const_sexpr(e, a->cell[1]);
+        if (acc->type == LVAL_ERR)
+            break;
+    }
+
+    lstream_iter_del(it);
+    lval_del(a);
+    return acc;
+}
+
+//Implementation of stream-list
+//Collects all elements of a (finite) stream into a Q-Expression.
+lval *builtin_stream_list(lenv *e, lval *a)
+{
+    LASSERT_NUM("stream-list", a, 1);
+    LASSERT_STREAM("stream-list", a, 0);
+
+    lstream *s = lstream_of(a->cell[0]);
+    lstream_iter *it = lstream_iter_new(s);
+    lstream_release(s);
+
+    lval *list = lval_qexpr();
+    lval *x;
+    while ((x = lstream_next(e, it)))
+    {
+        if (x->type == LVAL_ERR)
+        {
+            lval_del(list);
+            list = x;
+            break;
+        }
+        lval_add(list, x);
+    }
+
+    lstream_iter_del(it);
+    lval_del(a);
+    return list;
+}
+
+void lxform_release(lxform *t)
+{
+    if (--t->refs > 0)
+        return;
+
+    for (int i = 0; i < t->count; i++)
+    {
+        if (t->stages[i].binders)
+            lval_del(t->stages[i].binders);
+        if (t->stages[i].body)
+            lval_del(t->stages[i].body);
+    }
+    free(t->stages);
+    free(t);
+}
+
+/*
+Pass one element through every stage of a transducer, 'seen' holds the per stage counts of take and drop.
+Returns the transformed element, NULL if a stage dropped it, or an Error lval.
+'done' is set once a take stage has let through all it will, so no more input needs to be read.
+*/
+lval *lxform_step(lenv *e, lxform *t, double *seen, lval *x, int *done)
+{
+    for (int i = 0; i < t->count; i++)
+    {
+        lxform_stage *st = &t->stages[i];
+        lval *y;
+
+        switch (st->kind)
+        {
+        case LXFORM_MAP:
+            y = lval_apply_body(e, st->binders, st->body, x);
+            lval_del(x);
+            if (y->type == LVAL_ERR)
+                return y;
+            x = y;
+            break;
+
+        case LXFORM_FILTER:
+            y = lval_apply_body(e, st->binders, st->body, x);
+            if (y->type == LVAL_ERR)
+            {
+                lval_del(x);
+                return y;
+            }
+            if (!lval_truthy(y))
+            {
+                lval_del(y);
+                lval_del(x);
+                return NULL;
+            }
+            lval_del(y);
+            break;
+
+        case LXFORM_TAKE:
+            if (seen[i] >= st->n)
+            {
+                *done = 1;
+                lval_del(x);
+                return NULL;
+            }
+            if (++seen[i] >= st->n)
+                *done = 1;
+            break;
+
+        case LXFORM_DROP:
+            if (seen[i] < st->n)
+            {
+                seen[i]++;
+                lval_del(x);
+                return NULL;
+            }
+            break;
+        }
+    }
+
+    return x;
+}
+
+/*
+Run the elements of a Q-Expression, Range or Stream through transducer 't', handing each result to 'emit'.
+Nothing is collected in between stages, so a whole pipeline costs a single pass over 'coll'.
+*/
+lval *lxform_run(lenv *e, lxform *t, lval *coll, lval *(*emit)(lenv *, lval *, lval *, lval *), lval *ctx, lval *acc)
+{
+    double *seen = calloc(t->count ? t->count : 1, sizeof(double));
+    lstream_iter *it = NULL;
+    if (coll->type == LVAL_STREAM)
+        it = lstream_iter_new(coll->stream);
+
+    int done = 0;
+    long n = coll->type == LVAL_STREAM ? 0 : lval_len(coll);
+    for (long i = 0; !done && acc->type != LVAL_ERR; i++)
+    {
+        /*A take of nothing needs no input at all*/
+        if (i == 0 && t->count && t->stages[0].kind == LXFORM_TAKE && t->stages[0].n <= 0)
+            break;
+
+        lval *x;
+        if (it)
+        {
+            if (!(x = lstream_next(e, it)))
+                break;
+        }
+        else if (i >= n)
+            break;
+        else if (coll->type == LVAL_RANGE)
+            x = lval_num(lrange_nth(coll, i));
+        else
+            x = lval_copy(coll->cell[i]);
+
+        if (x->type != LVAL_ERR)
+            x = lxform_step(e, t, seen, x, &done);
+
+        if (!x)
+            continue;
+        if (x->type == LVAL_ERR)
+        {
+            lval_del(acc);
+            acc = x;
+            break;
+        }
+
+        acc = emit(e, ctx, acc, x);
+    }
+
+    if (it)
+        lstream_iter_del(it);
+    free(seen);
+    return acc;
+}
+
+/*Shared implementation of xmap and xfilter*/
+lval *builtin_xform_body(lenv *e, lval *a, char *func, int kind)
+{
+    LASSERT_NUM(func, a, 2);
+    LASSERT_BINDERS(func, a, 0, 1);
+    LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+
+    lval *t = lval_xform(1);
+    t->xform->stages[0].kind = kind;
+    t->xform->stages[0].body = lval_pop(a, 1);
+    t->xform->stages[0].binders = lval_take(a, 0);
+    return t;
+}
+
+//Implementation of xmap
+//(xmap {x} {body}) is the transducer replacing each element x by body.
+lval *builtin_xmap(lenv *e, lval *a)
+{
+    return builtin_xform_body(e, a, "xmap", LXFORM_MAP);
+}
+
+//Implementation of xfilter
+//(xfilter {x} {body}) is the transducer keeping the elements x for which body is non-zero.
+lval *builtin_xfilter(lenv *e, lval *a)
+{
+    return builtin_xform_body(e, a, "xfilter", LXFORM_FILTER);
+}
+
+/*Shared implementation of xtake and xdrop*/
+lval *builtin_xform_count(lenv *e, lval *a, char *func, int kind)
+{
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_NUM);
+
+    lval *t = lval_xform(1);
+    t->xform->stages[0].kind = kind;
+    t->xform->stages[0].n = a->cell[0]->num;
+    lval_del(a);
+    return t;
+}
+
+//Implementation of xtake
+//(xtake n) is the transducer letting through the first n elements, and then ending the pass.
+lval *builtin_xtake(lenv *e, lval *a)
+{
+    return builtin_xform_count(e, a, "xtake", LXFORM_TAKE);
+}
+
+//Implementation of xdrop
+//(xdrop n) is the transducer skipping the first n elements.
+lval *builtin_xdrop(lenv *e, lval *a)
+{
+    return builtin_xform_count(e, a, "xdrop", LXFORM_DROP);
+}
+
+//Implementation of comp
+//(comp t1 t2 ...) is the transducer applying t1, then t2, ... to each element, (comp {}) lets everything through.
+lval *builtin_comp(lenv *e, lval *a)
+{
+    if (a->count == 1 && a->cell[0]->type == LVAL_QEXPR && a->cell[0]->count == 0)
+        lval_del(lval_pop(a, 0));
+
+    int count = 0;
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT_TYPE("comp", a, i, LVAL_XFORM);
+        count += a->cell[i]->xform->count;
+    }
+
+    lval *t = lval_xform(count);
+    lxform_stage *st = t->xform->stages;
+    for (int i = 0; i < a->count; i++)
+    {
+        lxform *x = a->cell[i]->xform;
+        for (int j = 0; j < x->count; j++, st++)
+        {
+            *st = x->stages[j];
+            st->binders = st->binders ? lval_copy(st->binders) : NULL;
+            st->body = st->body ? lval_copy(st->body) : NULL;
+        }
+    }
+
+    lval_del(a);
+    return t;
+}
+
+#define LASSERT_COLL(func, args, index)                                                           \
+    LASSERT_ERR(args, args->cell[index]->type == LVAL_QEXPR || args->cell[index]->type == LVAL_RANGE || \
+                          args->cell[index]->type == LVAL_STREAM,                                 \
+                lval_err_code(LERR_ARG_TYPE, func, index, args->cell[index]->type, LVAL_QEXPR))
+
+/*Fold step of transduce, 'ctx' is its argument list holding the binders and body of the reducing function*/
+lval *lxform_fold(lenv *e, lval *ctx, lval *acc, lval *x)
+{
+    lval *args[2] = {acc, x};
+    lenv_bind(e, ctx->cell[1], args);
+    lval_del(acc);
+    lval_del(x);
+    return lval_eval_const_sexpr(e, ctx->cell[2]);
+}
+
+/*Collecting step of into*/
+lval *lxform_collect(lenv *e, lval *ctx, lval *acc, lval *x)
+{
+    return lval_add(acc, x);
+}
+
+//Implementation of transduce
+//(transduce t {acc x} {body} init coll) folds body over the elements of coll as transformed by t, in one pass.
+lval *builtin_transduce(lenv *e, lval *a)
+{
+    LASSERT_NUM("transduce", a, 5);
+    LASSERT_TYPE("transduce", a, 0, LVAL_XFORM);
+    LASSERT_BINDERS("transduce", a, 1, 2);
+    LASSERT_TYPE("transduce", a, 2, LVAL_QEXPR);
+    LASSERT_COLL("transduce", a, 4);
+
+    lval *acc = lxform_run(e, a->cell[0]->xform, a->cell[4], lxform_fold, a, lval_copy(a->cell[3]));
+
+    lval_del(a);
+    return acc;
+}
+
+//Implementation of into
+//(into t coll) is the Q-Expression of the elements of coll as transformed by t.
+lval *builtin_into(lenv *e, lval *a)
+{
+    LASSERT_NUM("into", a, 2);
+    LASSERT_TYPE("into", a, 0, LVAL_XFORM);
+    LASSERT_COLL("into", a, 1);
+
+    lval *x = lxform_run(e, a->cell[0]->xform, a->cell[1], lxform_collect, NULL, lval_qexpr());
+    lval_del(a);
+    return x;
+}
+
+/*Kinds of parallel collection builtin*/
+enum
+{
+    LPAR_MAP,
+    LPAR_FILTER,
+    LPAR_REDUCE
+};
+
+/*Chunks handed out per thread, so threads finishing early can steal the remaining ones*/
+#define LPAR_CHUNKS_PER_THREAD 4
+
+/*A slice [lo, hi) of a Q-Expression or Range processed by one task*/
+typedef struct
+{
+    ltask task;
+    lenv *e;
+    int isolate;
+    int kind;
+    lval *binders;
+    lval *body;
+    lval *coll;
+    long lo;
+    long hi;
+
+    /*Map writes element i to out[i], filter and reduce leave the chunk's list or total in result*/
+    lval **out;
+    lval *result;
+} lpar_chunk;
+
+/*Fold two values with the reducing function*/
+lval *lpar_combine(lenv *e, lval *binders, lval *body, lval *acc, lval *x)
+{
+    lval *args[2] = {acc, x};
+    lenv_bind(e, binders, args);
+    lval_del(acc);
+    lval_del(x);
+    return lval_eval_const_sexpr(e, body);
+}
+
+void lpar_chunk_run(ltask *t)
+{
+    lpar_chunk *c = (lpar_chunk *)t;
+    lenv *e = c->isolate ? lenv_child(c->e) : c->e;
+    int range = c->coll->type == LVAL_RANGE;
+
+    c->result = c->kind == LPAR_FILTER ? lval_qexpr() : NULL;
+    for (long i = c->lo; i < c->hi; i++)
+    {
+        lval *x = range ? lval_num(lrange_nth(c->coll, i)) : c->coll->cell[i];
+        lval *y = NULL;
+
+        switch (c->kind)
+        {
+        case LPAR_MAP:
+            y = lval_apply_body(e, c->binders, c->body, x);
+            c->out[i] = y;
+            break;
+
+        case LPAR_FILTER:
+            y = lval_apply_body(e, c->binders, c->body, x);
+            if (y->type != LVAL_ERR)
+            {
+                if (lval_truthy(y))
+                    lval_add(c->result, lval_copy(x));
+                lval_del(y);
+            }
+            else
+            {
+                lval_del(c->result);
+                c->result = y;
+            }
+            break;
+
+        case LPAR_REDUCE:
+            y = c->result ? lpar_combine(e, c->binders, c->body, c->result, lval_copy(x)) : lval_copy(x);
+            c->result = y;
+            break;
+        }
+
+        if (range)
+            lval_del(x);
+
+        /*The rest of the chunk is not needed once an error has occurred*/
+        if (y->type == LVAL_ERR)
+        {
+            for (long j = i + 1; c->kind == LPAR_MAP && j < c->hi; j++)
+            {
+                c->out[j] = NULL;
+            }
+            break;
+        }
+    }
+
+    if (c->isolate)
+        lenv_del(e);
+}
+
+/*
+Shared implementation of pmap, pfilter and preduce.
+The collection is cut into chunks processed on the pool, each in its own environment, and the
+results are put back together in order. Without a pool the whole collection is processed here as
+a single chunk, as is a body that is not safe to run beside other code, in 'e' itself.
+*/
+lval *builtin_par_coll(lenv *e, lval *a, char *func, int kind)
+{
+    int reduce = kind == LPAR_REDUCE;
+    int binders = reduce ? 2 : 1;
+    int count = reduce ? 4 : 3;
+    LASSERT_NUM(func, a, count);
+    LASSERT_BINDERS(func, a, 0, binders);
+    LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+    LASSERT_LIST(func, a, count - 1);
+
+    lval *coll = a->cell[count - 1];
+    long n = lval_len(coll);
+
+    /*A safe body also runs in its own environment without a pool, so its bindings never leak out either way*/
+    int pure = lval_par_cost(e, a->cell[1], 0) >= 0;
+    int par = lpar_on && pure;
+    long chunks = par ? (long)(lpar_pool->workers + 1) * LPAR_CHUNKS_PER_THREAD : 1;
+    if (chunks > n)
+        chunks = n ? n : 1;
+
+    lval **out = kind == LPAR_MAP ? malloc(sizeof(lval *) * (n ? n : 1)) : NULL;
+    lpar_chunk *c = malloc(sizeof(lpar_chunk) * chunks);
+    atomic_int pending = 0;
+    for (long k = chunks - 1; k >= 0; k--)
+    {
+        c[k].task.run = lpar_chunk_run;
+        c[k].task.pending = &pending;
+        c[k].e = e;
+        c[k].isolate = pure;
+        c[k].kind = kind;
+        c[k].binders = a->cell[0];
+        /*Call sites cache their macro expansions, so each chunk on the pool needs a body of its own*/
+        c[k].body = par && k > 0 ? lval_copy(a->cell[1]) : a->cell[1];
+        c[k].coll = coll;
+        c[k].lo = n * k / chunks;
+        c[k].hi = n * (k + 1) / chunks;
+        c[k].out = out;
+
+        /*We work on the first chunk ourselves*/
+        if (k > 0)
+        {
+            atomic_fetch_add(&pending, 1);
+            lpool_push(lpar_pool, &c[k].task);
+        }
+    }
+    lpar_chunk_run(&c[0].task);
+    if (par)
+    {
+        lpool_wait(lpar_pool, &pending);
+        for (long k = 1; k < chunks; k++)
+        {
+            lval_del(c[k].body);
+        }
+    }
+
+    /*Put the chunks back together, the first error in element order wins*/
+    lval *x = NULL;
+    if (kind == LPAR_MAP)
+    {
+        x = lval_qexpr();
+        x->cell = out;
+        x->count = n;
+        for (long i = 0; i < n; i++)
+        {
+            if (out[i] && out[i]->type == LVAL_ERR)
+            {
+                lval *err = out[i];
+                for (long j = 0; j < n; j++)
+                {
+                    if (out[j] && j != i)
+                        lval_del(out[j]);
+                }
+                x->count = 0;
+                lval_del(x);
+                x = err;
+                break;
+            }
+        }
+    }
+    else
+    {
+        lenv *ce = pure ? lenv_child(e) : e;
+        x = reduce ? lval_copy(a->cell[2]) : lval_qexpr();
+        for (long k = 0; k < chunks; k++)
+        {
+            lval *r = c[k].result;
+            if (!r || x->type == LVAL_ERR)
+            {
+                if (r)
+                    lval_del(r);
+                continue;
+            }
+            if (r->type == LVAL_ERR)
+            {
+                lval_del(x);
+                x = r;
+            }
+            else if (reduce)
+            {
+                x = lpar_combine(ce, a->cell[0], a->cell[1], x, r);
+            }
+            else
+            {
+                while (r->count)
+                {
+                    lval_add(x, lval_pop(r, 0));
+                }
+                lval_del(r);
+            }
+        }
+        if (pure)
+            lenv_del(ce);
+    }
+
+    free(c);
+    lval_del(a);
+    return x;
+}
+
+//Implementation of pmap
+//(pmap {x} {body} list) is the Q-Expression of body evaluated for each element x of list, on the pool.
+lval *builtin_pmap(lenv *e, lval *a)
+{
+    return builtin_par_coll(e, a, "pmap", LPAR_MAP);
+}
+
+//Implementation of pfilter
+//(pfilter {x} {body} list) is the Q-Expression of the elements x of list for which body is non-zero.
+lval *builtin_pfilter(lenv *e, lval *a)
+{
+    return builtin_par_coll(e, a, "pfilter", LPAR_FILTER);
+}
+
+//Implementation of preduce
+//(preduce {a b} {body} init list) folds body over list in chunks, so body has to be associative.
+lval *builtin_preduce(lenv *e, lval *a)
+{
+    return builtin_par_coll(e, a, "preduce", LPAR_REDUCE);
+}
+
+/*Number of workers the pool starts with when futures need it before parallel was called*/
+int lpool_default_workers(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+lmemo *lmemo_new(long budget);
+void lmemo_insert(lmemo *m, lval *key, lval *value, unsigned long hash);
+
+lval *lval_clone(lval *v);
+
+/*A table with copies of the entries of 'm', in the same recency order*/
+lmemo *lmemo_clone(lmemo *m)
+{
+    lmemo *c = lmemo_new(m->budget);
+    c->refs = 1;
+    for (lmemo_entry *x = m->oldest; x; x = x->newer)
+    {
+        lmemo_insert(c, lval_clone(x->key), lval_clone(x->value), x->hash);
+    }
+    return c;
+}
+
+lstream *lstream_clone(lstream *s)
+{
+    lstream *c = calloc(1, sizeof(lstream));
+    c->refs = 1;
+    c->kind = s->kind;
+    c->n = s->n;
+    c->items = s->items ? lval_clone(s->items) : NULL;
+    c->binders = s->binders ? lval_clone(s->binders) : NULL;
+    c->body = s->body ? lval_clone(s->body) : NULL;
+    c->tail = s->tail ? lval_clone(s->tail) : NULL;
+    c->src = s->src ? lstream_clone(s->src) : NULL;
+    return c;
+}
+
+/*
+Deep copy of 'v' sharing nothing that can change: memo tables, promises and streams are copied too.
+Promises come back unforced, as a forced value may refer back to the stream holding the promise.
+Transducers never change, so they are still shared, as are coroutines and actors which cannot be copied,
+and refs which exist to be shared.
+*/
+lval *lval_clone(lval *v)
+{
+    lval *x;
+
+    switch (v->type)
+    {
+    case LVAL_FUN:
+    case LVAL_MEMO:
+        if (!v->memo)
+            return lval_copy(v);
+        x = lval_alloc();
+        x->type = v->type;
+        x->fun = v->fun;
+        x->memo = lmemo_clone(v->memo);
+        return x;
+
+    case LVAL_PROMISE:
+        return lval_promise(lval_clone(v->promise->code));
+
+    case LVAL_STREAM:
+        x = lval_alloc();
+        x->type = LVAL_STREAM;
+        x->stream = lstream_clone(v->stream);
+        return x;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_MACRO:
+        x = lval_alloc();
+        x->type = v->type;
+        x->expansion = NULL;
+        x->count = v->count;
+        x->cell = malloc(sizeof(lval *) * x->count);
+        for (int i = 0; i < x->count; i++)
+        {
+            x->cell[i] = lval_clone(v->cell[i]);
+        }
+        return x;
+    }
+
+    return lval_copy(v);
+}
+
+void lenv_put(lenv *e, lval *k, lval *v);
+
+/*A new environment holding clones of everything visible from 'e', so nothing done in either affects the other*/
+lenv *lenv_snapshot(lenv *e)
+{
+    lenv *s = e->par ? lenv_snapshot(e->par) : lenv_new();
+
+    for (int i = 0; i < e->count; i++)
+    {
+        lval *k = lval_sym(e->syms[i]);
+        lval *v = lval_clone(e->vals[i]);
+        lenv_put(s, k, v);
+        lval_del(k);
+        lval_del(v);
+    }
+
+    return s;
+}
+
+void lfuture_release(lfuture *f)
+{
+    if (--f->refs > 0)
+        return;
+
+    if (f->env)
+        lenv_del(f->env);
+    if (f->code)
+        lval_del(f->code);
+    if (f->value)
+        lval_del(f->value);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+    free(f);
+}
+
+void lfuture_run(ltask *t)
+{
+    lfuture *f = (lfuture *)t;
+
+    lval *code = f->code;
+    f->code = NULL;
+    code->type = LVAL_SEXPR;
+    lval *x = lval_eval(f->env, code);
+    lenv_del(f->env);
+    f->env = NULL;
+
+    /*Whoever touches 'f' may resize the pool next, so it stops counting as a user first*/
+    atomic_fetch_sub(&lpool_users, 1);
+
+    pthread_mutex_lock(&f->lock);
+    f->value = x;
+    atomic_store(&f->done, 1);
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+
+    /*Drop the reference the pool held*/
+    lfuture_release(f);
+}
+
+/*
+Wait for 'f' until it is done or 'ms' milliseconds have passed, a negative 'ms' waits as long as it takes.
+Waiting as long as it takes runs queued tasks meanwhile, which may well be 'f' itself.
+*/
+int lfuture_wait(lfuture *f, double ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (ms > 0)
+    {
+        long ns = deadline.tv_nsec + (long)(ms * 1000000);
+        deadline.tv_sec += ns / 1000000000;
+        deadline.tv_nsec = ns % 1000000000;
+    }
+
+    while (!atomic_load(&f->done) && ms != 0)
+    {
+        ltask *t = ms < 0 ? lpool_take(lpar_pool) : NULL;
+        if (t)
+        {
+            lpool_run(t);
+            continue;
+        }
+
+        /*Nothing left to help with, so 'f' is running somewhere and we sleep until it signals*/
+        pthread_mutex_lock(&f->lock);
+        int timeout = 0;
+        while (!atomic_load(&f->done) && !timeout)
+        {
+            if (ms < 0)
+                pthread_cond_wait(&f->cond, &f->lock);
+            else
+                timeout = pthread_cond_timedwait(&f->cond, &f->lock, &deadline) != 0;
+        }
+        pthread_mutex_unlock(&f->lock);
+        if (timeout)
+            break;
+    }
+
+    return atomic_load(&f->done);
+}
+
+//Implementation of future
+//(future {expr}) starts evaluating expr on the pool, in a snapshot of the environment, and returns a handle to it.
+lval *builtin_future(lenv *e, lval *a)
+{
+    LASSERT_NUM("future", a, 1);
+    LASSERT_TYPE("future", a, 0, LVAL_QEXPR);
+
+    if (!lpar_pool)
+        lpool_start(lpool_default_workers());
+
+    lfuture *f = calloc(1, sizeof(lfuture));
+    f->task.run = lfuture_run;
+    f->env = lenv_snapshot(e);
+    f->code = lval_take(a, 0);
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+
+    /*One reference for the handle, one for the pool until the task has run*/
+    f->refs = 2;
+
+    lval *v = lval_alloc();
+    v->type = LVAL_FUTURE;
+    v->future = f;
+
+    atomic_fetch_add(&lpool_users, 1);
+    lpool_push(lpar_pool, &f->task);
+    return v;
+}
+
+//Implementation of touch
+//(touch f) waits for future f and returns its value, any other value is returned as it is.
+lval *builtin_touch(lenv *e, lval *a)
+{
+    LASSERT_NUM("touch", a, 1);
+
+    if (a->cell[0]->type != LVAL_FUTURE)
+        return lval_take(a, 0);
+
+    lfuture *f = a->cell[0]->future;
+    lfuture_wait(f, -1);
+
+    lval *x = lval_copy(f->value);
+    lval_del(a);
+    return x;
+}
+
+//Implementation of await
+//(await f ms) waits at most ms milliseconds for future f, returning {value} if it is done by then and {} if not.
+//(await f 0) only checks.
+lval *builtin_await(lenv *e, lval *a)
+{
+    LASSERT_NUM("await", a, 2);
+    LASSERT_TYPE("await", a, 0, LVAL_FUTURE);
+    LASSERT_TYPE("await", a, 1, LVAL_NUM);
+    LASSERT_STATIC(a, a->cell[1]->num >= 0, "Function 'await' passed a negative timeout");
+
+    lfuture *f = a->cell[0]->future;
+    lval *x = lval_qexpr();
+    if (lfuture_wait(f, a->cell[1]->num))
+        lval_add(x, lval_copy(f->value));
+
+    lval_del(a);
+    return x;
+}
+
+#ifdef LCTX_ASM
+/*Save the callee saved registers on the current stack, store its pointer in *from, and continue on *to*/
+void lctx_switch(lctx *from, lctx *to);
+
+#if defined(__x86_64__)
+__asm__(".text\n"
+        ".globl lctx_switch\n"
+        ".type lctx_switch, @function\n"
+        "lctx_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq (%rsi), %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size lctx_switch, .-lctx_switch\n");
+#else
+__asm__(".text\n"
+        ".globl lctx_switch\n"
+        ".type lctx_switch, %function\n"
+        "lctx_switch:\n"
+        "    sub sp, sp, #160\n"
+        "    stp x19, x20, [sp, #0]\n"
+        "    stp x21, x22, [sp, #16]\n"
+        "    stp x23, x24, [sp, #32]\n"
+        "    stp x25, x26, [sp, #48]\n"
+        "    stp x27, x28, [sp, #64]\n"
+        "    stp x29, x30, [sp, #80]\n"
+        "    stp d8, d9, [sp, #96]\n"
+        "    stp d10, d11, [sp, #112]\n"
+        "    stp d12, d13, [sp, #128]\n"
+        "    stp d14, d15, [sp, #144]\n"
+        "    mov x2, sp\n"
+        "    str x2, [x0]\n"
+        "    ldr x2, [x1]\n"
+        "    mov sp, x2\n"
+        "    ldp x19, x20, [sp, #0]\n"
+        "    ldp x21, x22, [sp, #16]\n"
+        "    ldp x23, x24, [sp, #32]\n"
+        "    ldp x25, x26, [sp, #48]\n"
+        "    ldp x27, x28, [sp, #64]\n"
+        "    ldp x29, x30, [sp, #80]\n"
+        "    ldp d8, d9, [sp, #96]\n"
+        "    ldp d10, d11, [sp, #112]\n"
+        "    ldp d12, d13, [sp, #128]\n"
+        "    ldp d14, d15, [sp, #144]\n"
+        "    add sp, sp, #160\n"
+        "    ret\n"
+        ".size lctx_switch, .-lctx_switch\n");
+#endif
+
+/*Prepare 'c' so that switching to it calls 'entry' at the top of 'stack'*/
+void lctx_make(lctx *c, char *stack, size_t size, void (*entry)(void))
+{
+    void **sp = (void **)(((unsigned long)stack + size) & ~15UL);
+
+#if defined(__x86_64__)
+    /*A zero return address for entry, entry itself for the ret of lctx_switch, then six registers*/
+    *--sp = NULL;
+    *--sp = (void *)entry;
+    for (int i = 0; i < 6; i++)
+    {
+        *--sp = NULL;
+    }
+#else
+    /*The register frame popped by lctx_switch, with entry as the link register x30*/
+    sp -= 20;
+    memset(sp, 0, sizeof(void *) * 20);
+    sp[11] = (void *)entry;
+#endif
+
+    *c = sp;
+}
+#else
+void lctx_switch(lctx *from, lctx *to)
+{
+    swapcontext(from, to);
+}
+
+void lctx_make(lctx *c, char *stack, size_t size, void (*entry)(void))
+{
+    getcontext(c);
+    c->uc_stack.ss_sp = stack;
+    c->uc_stack.ss_size = size;
+    c->uc_link = NULL;
+    makecontext(c, entry, 0);
+}
+#endif
+
+/*
+Pool of coroutine stacks. Stacks are carved out of slabs mapped in one go and kept once freed,
+so creating a coroutine costs no system call in the common case and the number of mappings stays small.
+Below each stack is an inaccessible guard, so code that recurses without checking the stack
+(copying, printing or deleting a deeply nested value) faults instead of writing over the next stack.
+*/
+#define LCORO_SLAB_STACKS 256
+#define LCORO_GUARD_MIN (16 * 1024)
+
+/*Size of the guard, a whole number of pages*/
+size_t lcoro_guard_size(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    return page > LCORO_GUARD_MIN ? (size_t)page : LCORO_GUARD_MIN;
+}
+
+pthread_mutex_t lcoro_stack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Free stacks are listed outside of the stacks, so a stack's pages are only touched once it is used*/
+char **lcoro_stack_free = NULL;
+int lcoro_stack_free_count = 0;
+int lcoro_stack_free_cap = 0;
+
+void lcoro_stack_release(char *stack)
+{
+    pthread_mutex_lock(&lcoro_stack_lock);
+    if (lcoro_stack_free_count == lcoro_stack_free_cap)
+    {
+        lcoro_stack_free_cap = lcoro_stack_free_cap ? lcoro_stack_free_cap * 2 : LCORO_SLAB_STACKS;
+        lcoro_stack_free = realloc(lcoro_stack_free, sizeof(char *) * lcoro_stack_free_cap);
+    }
+    lcoro_stack_free[lcoro_stack_free_count++] = stack;
+    pthread_mutex_unlock(&lcoro_stack_lock);
+}
+
+char *lcoro_stack_alloc(void)
+{
+    pthread_mutex_lock(&lcoro_stack_lock);
+    while (lcoro_stack_free_count == 0)
+    {
+        size_t guard = lcoro_guard_size();
+        size_t slot = guard + LCORO_STACK_SIZE;
+        char *slab = mmap(NULL, (size_t)LCORO_SLAB_STACKS * slot, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        pthread_mutex_unlock(&lcoro_stack_lock);
+        if (slab == MAP_FAILED)
+            return NULL;
+
+        for (int i = LCORO_SLAB_STACKS - 1; i >= 0; i--)
+        {
+            char *base = slab + (size_t)i * slot;
+            mprotect(base, guard, PROT_NONE);
+            lcoro_stack_release(base + guard);
+        }
+        pthread_mutex_lock(&lcoro_stack_lock);
+    }
+
+    char *stack = lcoro_stack_free[--lcoro_stack_free_count];
+    pthread_mutex_unlock(&lcoro_stack_lock);
+    return stack;
+}
+
+/*First code run on a coroutine stack, it evaluates the body and never returns*/
+void lcoro_entry(void)
+{
+    lcoro *c = lcoro_current;
+
+    lval *code = c->code;
+    c->code = NULL;
+    code->type = LVAL_SEXPR;
+    lval *x = lval_eval(c->env, code);
+
+    /*The value of the body itself is not passed on, only an error is*/
+    if (x->type == LVAL_ERR)
+    {
+        c->transfer = x;
+    }
+    else
+    {
+        lval_del(x);
+    }
+
+    c->state = LCORO_DONE;
+    lctx_switch(&c->ctx, &c->caller);
+}
+
+/*Continue 'c' until it yields or finishes, handing it 'x' (which may be NULL)*/
+void lcoro_switch_in(lcoro *c, lenv *e, lval *x)
+{
+    if (c->state == LCORO_NEW)
+        lctx_make(&c->ctx, c->stack, LCORO_STACK_SIZE, lcoro_entry);
+
+    c->env->par = e;
+    c->transfer = x;
+    c->state = LCORO_RUNNING;
+    c->prev = lcoro_current;
+    lcoro_current = c;
+
+    lctx_switch(&c->caller, &c->ctx);
+
+    lcoro_current = c->prev;
+    c->env->par = NULL;
+}
+
+void lcoro_release(lcoro *c)
+{
+    if (--c->refs > 0)
+        return;
+
+    /*A suspended body still owns the values on its stack, let it unwind with an error to free them*/
+    if (c->state == LCORO_SUSPENDED)
+    {
+        c->refs = 1;
+        c->cancel = 1;
+        lcoro_switch_in(c, NULL, NULL);
+    }
+
+    if (c->transfer)
+        lval_del(c->transfer);
+    if (c->code)
+        lval_del(c->code);
+    lenv_del(c->env);
+    lcoro_stack_release(c->stack);
+    free(c);
+}
+
+/*A new coroutine evaluating a copy of 'code' in 'env', which it takes over. NULL if no stack is left*/
+lcoro *lcoro_new(lval *code, lenv *env)
+{
+    char *stack = lcoro_stack_alloc();
+    if (!stack)
+    {
+        lenv_del(env);
+        return NULL;
+    }
+
+    lcoro *c = calloc(1, sizeof(lcoro));
+    c->refs = 1;
+    c->state = LCORO_NEW;
+    c->stack = stack;
+    c->env = env;
+    c->code = lval_copy(code);
+    return c;
+}
+
+/*Switch from the running coroutine 'c' back to whoever resumed it. Returns 0 if 'c' was cancelled meanwhile*/
+int lcoro_suspend(lcoro *c)
+{
+    c->state = LCORO_SUSPENDED;
+    lctx_switch(&c->ctx, &c->caller);
+    return !c->cancel;
+}
+
+/*Copy into 'dst' the bindings of the private environments between 'e' and the outermost one*/
+void lenv_capture(lenv *dst, lenv *e)
+{
+    if (!e->par)
+        return;
+
+    lenv_capture(dst, e->par);
+    for (int i = 0; i < e->count; i++)
+    {
+        lval *k = lval_sym(e->syms[i]);
+        lenv_put(dst, k, e->vals[i]);
+        lval_del(k);
+    }
+}
+
+//Implementation of coroutine
+//(coroutine {body}) returns a coroutine that evaluates body when first resumed, and pauses at each yield.
+//Bindings private to the creating code (e.g. of pmap) are kept, everything else is looked up where it is resumed.
+lval *builtin_coroutine(lenv *e, lval *a)
+{
+    LASSERT_NUM("coroutine", a, 1);
+    LASSERT_TYPE("coroutine", a, 0, LVAL_QEXPR);
+
+    lenv *env = lenv_new();
+    lenv_capture(env, e);
+    lcoro *c = lcoro_new(a->cell[0], env);
+    LASSERT_STATIC(a, c, "Out of memory for coroutine stacks");
+    lval_del(a);
+
+    lval *v = lval_alloc();
+    v->type = LVAL_CORO;
+    v->coro = c;
+    return v;
+}
+
+//Implementation of resume
+//(resume c) or (resume c x) runs coroutine c until it yields, returning {value} or {} once c has finished.
+//x becomes the value of the yield c is paused at.
+lval *builtin_resume(lenv *e, lval *a)
+{
+    LASSERT_ERR(a, a->count == 1 || a->count == 2, lval_err_code(LERR_ARG_COUNT, "resume", a->count, 1, 0));
+    LASSERT_TYPE("resume", a, 0, LVAL_CORO);
+
+    lcoro *c = a->cell[0]->coro;
+    LASSERT_STATIC(a, c->state != LCORO_RUNNING, "Function 'resume' passed a coroutine that is running");
+
+    if (c->state == LCORO_DONE)
+    {
+        lval_del(a);
+        return lval_qexpr();
+    }
+
+    /*Keep 'c' alive while it runs, even if its body drops the last other reference*/
+    c->refs++;
+    lcoro_switch_in(c, e, a->count == 2 ? lval_pop(a, 1) : NULL);
+
+    lval *x = c->transfer;
+    c->transfer = NULL;
+    lval_del(a);
+
+    if (c->state == LCORO_DONE)
+    {
+        lcoro_release(c);
+        return x ? x : lval_qexpr();
+    }
+
+    lcoro_release(c);
+    return lval_add(lval_qexpr(), x);
+}
+
+//Implementation of yield
+//(yield x) pauses the running coroutine, handing x to its resume, and returns what the next resume passes in.
+lval *builtin_yield(lenv *e, lval *a)
+{
+    LASSERT_NUM("yield", a, 1);
+
+    lcoro *c = lcoro_current;
+    LASSERT_STATIC(a, c, "Function 'yield' called outside of a coroutine");
+    LASSERT_STATIC(a, !ltx_current, "Function 'yield' called inside a transaction");
+
+    c->transfer = lval_take(a, 0);
+    if (!lcoro_suspend(c))
+        return lval_err_code(LERR_STATIC, "Coroutine cancelled", 0, 0, 0);
+
+    lval *x = c->transfer;
+    c->transfer = NULL;
+    return x ? x : lval_sexpr();
+}
+
+void lmailbox_init(lmailbox *q)
+{
+    atomic_store(&q->stub.next, NULL);
+    atomic_store(&q->head, &q->stub);
+    atomic_store(&q->tail, &q->stub);
+}
+
+/*Add 'm' to the mailbox, safe to call from any number of threads at once*/
+void lmailbox_push(lmailbox *q, lmsg *m)
+{
+    atomic_store_explicit(&m->next, NULL, memory_order_relaxed);
+    lmsg *prev = atomic_exchange_explicit(&q->head, m, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, m, memory_order_release);
+}
+
+/*
+Take the oldest message, only ever called by the owner of the mailbox.
+Returns NULL if the mailbox is empty, or while a sender is halfway through adding the only message,
+in which case that sender schedules the owner again once it is done.
+*/
+lmsg *lmailbox_pop(lmailbox *q)
+{
+    lmsg *tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    lmsg *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub)
+    {
+        if (!next)
+            return NULL;
+        atomic_store_explicit(&q->tail, next, memory_order_relaxed);
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next)
+    {
+        atomic_store_explicit(&q->tail, next, memory_order_relaxed);
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;
+
+    /*'tail' is the last message, put the stub behind it so it can be taken out*/
+    lmailbox_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next)
+    {
+        atomic_store_explicit(&q->tail, next, memory_order_relaxed);
+        return tail;
+    }
+    return NULL;
+}
+
+/*
+Whether the mailbox holds no message. The owner's scheduler may ask this while another thread has
+already started running the owner, the answer then does not matter and 'tail' is atomic only for that.
+*/
+int lmailbox_empty(lmailbox *q)
+{
+    return atomic_load_explicit(&q->tail, memory_order_relaxed) == &q->stub &&
+           !atomic_load_explicit(&q->stub.next, memory_order_acquire);
+}
+
+/*Actor whose body is running on the calling thread, NULL if none is*/
+static __thread lactor *lactor_current = NULL;
+
+/*The external actor standing for the calling thread when it is not running an actor*/
+static __thread lactor *lactor_thread = NULL;
+
+lactor *lactor_new(void)
+{
+    lactor *a = calloc(1, sizeof(lactor));
+    a->refs = 1;
+    lmailbox_init(&a->mailbox);
+    return a;
+}
+
+void lactor_release(lactor *a)
+{
+    if (--a->refs > 0)
+        return;
+
+    /*Cancelling a body waiting in receive lets it unwind*/
+    if (a->coro)
+    {
+        lcoro_release(a->coro);
+        atomic_fetch_sub(&lpool_users, 1);
+    }
+
+    lmsg *m;
+    while ((m = lmailbox_pop(&a->mailbox)))
+    {
+        lval_del(m->v);
+        free(m);
+    }
+
+    if (a->external)
+    {
+        pthread_mutex_destroy(&a->lock);
+        pthread_cond_destroy(&a->cond);
+    }
+    free(a);
+}
+
+void lactor_run(ltask *t);
+
+/*Queue 'a' on the pool unless it already is, the queued task holds a reference*/
+void lactor_schedule(lactor *a)
+{
+    if (atomic_exchange(&a->scheduled, 1))
+        return;
+
+    a->refs++;
+    lpool_push(lpar_pool, &a->task);
+}
+
+/*Run the body of 'a' until it waits for a message that is not there, yields, or finishes*/
+void lactor_run(ltask *t)
+{
+    lactor *a = (lactor *)t;
+
+    lactor *prev = lactor_current;
+    lactor_current = a;
+    lcoro_switch_in(a->coro, NULL, NULL);
+    lactor_current = prev;
+
+    /*Whatever the body yielded or failed with goes nowhere*/
+    if (a->coro->transfer)
+    {
+        lval_del(a->coro->transfer);
+        a->coro->transfer = NULL;
+    }
+
+    if (a->coro->state == LCORO_DONE)
+    {
+        atomic_store(&a->done, 1);
+    }
+    else if (!a->waiting)
+    {
+        /*A yield only gives the other actors a turn*/
+        lpool_push(lpar_pool, &a->task);
+        return;
+    }
+    else
+    {
+        /*Go idle, unless a message arrived after receive found the mailbox empty*/
+        atomic_store(&a->scheduled, 0);
+        if (!lmailbox_empty(&a->mailbox) && !atomic_exchange(&a->scheduled, 1))
+        {
+            lpool_push(lpar_pool, &a->task);
+            return;
+        }
+    }
+
+    lactor_release(a);
+}
+
+/*The actor the calling code runs as*/
+lactor *lactor_self(void)
+{
+    if (lactor_current)
+        return lactor_current;
+
+    if (!lactor_thread)
+    {
+        lactor_thread = lactor_new();
+        lactor_thread->external = 1;
+        pthread_mutex_init(&lactor_thread->lock, NULL);
+        pthread_cond_init(&lactor_thread->cond, NULL);
+    }
+    return lactor_thread;
+}
+
+lval *lval_actor(lactor *a)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_ACTOR;
+    v->actor = a;
+    a->refs++;
+    return v;
+}
+
+//Implementation of spawn
+//(spawn {body}) starts an actor evaluating body in a snapshot of the environment, and returns it.
+lval *builtin_spawn(lenv *e, lval *a)
+{
+    LASSERT_NUM("spawn", a, 1);
+    LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
+
+    lcoro *c = lcoro_new(a->cell[0], lenv_snapshot(e));
+    LASSERT_STATIC(a, c, "Out of memory for coroutine stacks");
+    lval_del(a);
+
+    if (!lpar_pool)
+        lpool_start(lpool_default_workers());
+
+    lactor *actor = lactor_new();
+    actor->task.run = lactor_run;
+    actor->coro = c;
+    atomic_fetch_add(&lpool_users, 1);
+
+    lval *v = lval_actor(actor);
+    lactor_release(actor);
+    lactor_schedule(actor);
+    return v;
+}
+
+//Implementation of send
+//(send actor x) puts a copy of x, sharing nothing with the sender, in the mailbox of actor.
+lval *builtin_send(lenv *e, lval *a)
+{
+    LASSERT_NUM("send", a, 2);
+    LASSERT_TYPE("send", a, 0, LVAL_ACTOR);
+
+    lactor *to = a->cell[0]->actor;
+    lmsg *m = malloc(sizeof(lmsg));
+    m->v = lval_clone(a->cell[1]);
+    lmailbox_push(&to->mailbox, m);
+
+    if (to->external)
+    {
+        pthread_mutex_lock(&to->lock);
+        pthread_cond_signal(&to->cond);
+        pthread_mutex_unlock(&to->lock);
+    }
+    else if (!atomic_load(&to->done))
+    {
+        lactor_schedule(to);
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+//Implementation of receive
+//(receive {}) returns the oldest message sent to the running actor, waiting for one if there is none.
+lval *builtin_receive(lenv *e, lval *a)
+{
+    LASSERT_NUM("receive", a, 1);
+    LASSERT_STATIC(a, !ltx_current, "Function 'receive' called inside a transaction");
+    lval_del(a);
+
+    lactor *self = lactor_self();
+    lmsg *m;
+
+    if (self->external)
+    {
+        pthread_mutex_lock(&self->lock);
+        while (!(m = lmailbox_pop(&self->mailbox)))
+        {
+            pthread_cond_wait(&self->cond, &self->lock);
+        }
+        pthread_mutex_unlock(&self->lock);
+    }
+    else
+    {
+        if (lcoro_current != self->coro)
+            return lval_err_code(LERR_STATIC, "Function 'receive' called inside a coroutine of an actor", 0, 0, 0);
+
+        while (!(m = lmailbox_pop(&self->mailbox)))
+        {
+            self->waiting = 1;
+            int live = lcoro_suspend(self->coro);
+            self->waiting = 0;
+            if (!live)
+                return lval_err_code(LERR_STATIC, "Actor cancelled", 0, 0, 0);
+        }
+    }
+
+    lval *x = m->v;
+    free(m);
+    return x;
+}
 
+//Implementation of self
+//(self {}) returns the running actor, outside of actors the calling thread has one of its own to receive with.
+lval *builtin_self(lenv *e, lval *a)
+{
+    LASSERT_NUM("self", a, 1);
     lval_del(a);
-    return x;
+    return lval_actor(lactor_self());
 }
 
-lval *builtin_add(lenv *e, lval *a)
+/*Version clock of the transactions, every commit that writes moves it forward by one*/
+atomic_long lstm_clock = 0;
+
+/*Counters reported by stm-stats*/
+atomic_long lstm_commits = 0;
+atomic_long lstm_retries = 0;
+
+/*A conflicting transaction yields at most this many times before it starts again*/
+#define LSTM_MAX_BACKOFF 32
+
+lref_box *lref_box_new(lval *v)
 {
-    return builtin_op(e, a, "+");
+    lref_box *b = malloc(sizeof(lref_box));
+    b->refs = 1;
+    b->v = v;
+    return b;
 }
 
-lval *builtin_sub(lenv *e, lval *a)
+void lref_box_release(lref_box *b)
 {
-    return builtin_op(e, a, "-");
+    if (--b->refs > 0)
+        return;
+
+    lval_del(b->v);
+    free(b);
 }
 
-lval *builtin_mul(lenv *e, lval *a)
+void lref_release(lref *r)
 {
-    return builtin_op(e, a, "*");
+    if (--r->refs > 0)
+        return;
+
+    lref_box_release(r->box);
+    free(r);
 }
 
-lval *builtin_div(lenv *e, lval *a)
+/*Take a reference to the value 'r' holds right now*/
+lref_box *lref_pin(lref *r)
 {
-    return builtin_op(e, a, "/");
+    while (atomic_flag_test_and_set_explicit(&r->pin, memory_order_acquire))
+        sched_yield();
+
+    lref_box *b = r->box;
+    b->refs++;
+    atomic_flag_clear_explicit(&r->pin, memory_order_release);
+    return b;
 }
 
-//Implementation of head function
-lval *builtin_head(lenv *e, lval *a)
+/*Make 'v' the value of 'r', only called by the commit holding the lock of 'r'*/
+void lref_install(lref *r, lval *v)
 {
-    /*Check Error Conditions*/
-    LASSERT_NUM("head", a, 1);
-    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("head", a, 0);
+    lref_box *b = lref_box_new(v);
 
-    /*Otherwise take first argument*/
-    lval *v = lval_take(a, 0);
+    while (atomic_flag_test_and_set_explicit(&r->pin, memory_order_acquire))
+        sched_yield();
 
-    /* Delete all elements that are not head and return */
-    while (v->count > 1)
+    lref_box *old = r->box;
+    r->box = b;
+    atomic_flag_clear_explicit(&r->pin, memory_order_release);
+
+    lref_box_release(old);
+}
+
+int ltx_find(lref **refs, int count, lref *r)
+{
+    for (int i = 0; i < count; i++)
     {
-        lval_del(lval_pop(v, 1));
+        if (refs[i] == r)
+            return i;
     }
-    return v;
+    return -1;
 }
 
-//Implementation of tail function
-lval *builtin_tail(lenv *e, lval *a)
+/*Forget everything 't' read and wrote, so it can start again*/
+void ltx_reset(ltx *t)
 {
-    /* Check Error Conditions */
-    LASSERT_NUM("tail", a, 1);
-    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("tail", a, 0);
-
-    /* Take first argument */
-    lval *v = lval_take(a, 0);
+    for (int i = 0; i < t->reads_count; i++)
+    {
+        lref_release(t->reads[i]);
+    }
+    for (int i = 0; i < t->writes_count; i++)
+    {
+        if (t->written[i])
+            lval_del(t->written[i]);
+        lref_release(t->writes[i]);
+    }
 
-    /* Delete first element and return */
-    lval_del(lval_pop(v, 0));
-    return v;
+    free(t->reads);
+    free(t->writes);
+    free(t->written);
+    t->reads_count = 0;
+    t->writes_count = 0;
+    t->reads = NULL;
+    t->writes = NULL;
+    t->written = NULL;
 }
 
-//Implementation of list function
-//It just converts the input S-Expression to a Q-Expression and returns it.
-lval *builtin_list(lenv *e, lval *a)
+/*
+The value of 'r' as seen by 't': what 't' wrote to it, or else the value committed before 't' started.
+If a later commit got there first, returns a retry error for dosync to start 't' again.
+*/
+lval *ltx_read(ltx *t, lref *r)
 {
-    a->type = LVAL_QEXPR;
-    return a;
+    int i = ltx_find(t->writes, t->writes_count, r);
+    if (i >= 0)
+        return lval_copy(t->written[i]);
+
+    long pre = atomic_load(&r->lock);
+    if ((pre & 1) || (pre >> 1) > t->rv)
+        return lval_err_code(LERR_RETRY, NULL, 0, 0, 0);
+
+    lref_box *b = lref_pin(r);
+    if (atomic_load(&r->lock) != pre)
+    {
+        lref_box_release(b);
+        return lval_err_code(LERR_RETRY, NULL, 0, 0, 0);
+    }
+
+    if (ltx_find(t->reads, t->reads_count, r) < 0)
+    {
+        t->reads_count++;
+        t->reads = realloc(t->reads, sizeof(lref *) * t->reads_count);
+        t->reads[t->reads_count - 1] = r;
+        r->refs++;
+    }
+
+    lval *x = lval_clone(b->v);
+    lref_box_release(b);
+    return x;
 }
 
-//Implementation of eval function
-//It takes as input some single Q-Expression, which it converts to an S-Expression, and evaluates using lval_eval.
-lval *builtin_eval(lenv *e, lval *a)
+/*Set the value of 'r' to 'v' within 't', taking 'v' over*/
+void ltx_write(ltx *t, lref *r, lval *v)
 {
-    LASSERT_NUM("eval", a, 1);
-    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+    int i = ltx_find(t->writes, t->writes_count, r);
+    if (i >= 0)
+    {
+        lval_del(t->written[i]);
+        t->written[i] = v;
+        return;
+    }
 
-    lval *x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    t->writes_count++;
+    t->writes = realloc(t->writes, sizeof(lref *) * t->writes_count);
+    t->written = realloc(t->written, sizeof(lval *) * t->writes_count);
+    t->writes[t->writes_count - 1] = r;
+    t->written[t->writes_count - 1] = v;
+    r->refs++;
 }
 
-//Implementation of join function
-lval *builtin_join(lenv *e, lval *a)
+/*
+Publish the writes of 't'. Returns 0 without changing anything if another commit wrote a ref
+that 't' read, or holds the lock of one 't' writes; waiting for locks instead could deadlock.
+*/
+int ltx_commit(ltx *t)
 {
+    /*Every read was checked against 'rv' when it was made*/
+    if (t->writes_count == 0)
+        return 1;
 
-    for (int i = 0; i < a->count; i++)
+    int locked;
+    for (locked = 0; locked < t->writes_count; locked++)
     {
-        LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+        lref *r = t->writes[locked];
+        long w = atomic_load(&r->lock);
+        if ((w & 1) || !atomic_compare_exchange_strong(&r->lock, &w, w | 1))
+            break;
     }
 
-    lval *x = lval_pop(a, 0);
+    if (locked == t->writes_count)
+    {
+        long wv = ++lstm_clock;
+        int valid = 1;
 
-    while (a->count)
+        /*No commit in between means nothing read can have changed*/
+        if (wv != t->rv + 1)
+        {
+            for (int i = 0; i < t->reads_count && valid; i++)
+            {
+                long w = atomic_load(&t->reads[i]->lock);
+                if ((w >> 1) > t->rv || ((w & 1) && ltx_find(t->writes, t->writes_count, t->reads[i]) < 0))
+                    valid = 0;
+            }
+        }
+
+        if (valid)
+        {
+            for (int i = 0; i < t->writes_count; i++)
+            {
+                lref_install(t->writes[i], t->written[i]);
+                t->written[i] = NULL;
+                atomic_store(&t->writes[i]->lock, wv << 1);
+            }
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < locked; i++)
     {
-        x = lval_join(x, lval_pop(a, 0));
+        atomic_fetch_and(&t->writes[i]->lock, ~1L);
     }
+    return 0;
+}
 
+//Implementation of ref
+//(ref x) returns a new transactional reference holding x, threads share it and change it through dosync.
+lval *builtin_ref(lenv *e, lval *a)
+{
+    LASSERT_NUM("ref", a, 1);
+
+    lref *r = calloc(1, sizeof(lref));
+    r->refs = 1;
+    atomic_flag_clear(&r->pin);
+    r->box = lref_box_new(lval_clone(a->cell[0]));
     lval_del(a);
-    return x;
+
+    lval *v = lval_alloc();
+    v->type = LVAL_REF;
+    v->ref = r;
+    return v;
 }
 
-//Implemented the builtin function len
-lval *builtin_len(lenv *e, lval *a)
+//Implementation of deref
+//(deref r) returns the value of ref r, inside dosync as of the start of the transaction plus its own changes.
+lval *builtin_deref(lenv *e, lval *a)
 {
-    /* Check Error Conditions */
-    LASSERT_NUM("len", a, 1);
-    LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+    LASSERT_NUM("deref", a, 1);
+    LASSERT_TYPE("deref", a, 0, LVAL_REF);
 
-    int listLen = a->cell[0]->count;
+    lref *r = a->cell[0]->ref;
+    lval *x;
+    if (ltx_current)
+    {
+        x = ltx_read(ltx_current, r);
+    }
+    else
+    {
+        lref_box *b = lref_pin(r);
+        x = lval_clone(b->v);
+        lref_box_release(b);
+    }
 
-    return lval_num(listLen);
+    lval_del(a);
+    return x;
 }
 
-//Implemented the builtin function init
-//It returns all of a Q-Expression except the final element.
-lval *builtin_init(lenv *e, lval *a)
+//Implementation of alter
+//(alter {x} {body} r) sets ref r to body evaluated with x bound to its value, and returns the new value.
+//Only allowed inside dosync, other transactions see the change once this one commits.
+lval *builtin_alter(lenv *e, lval *a)
 {
-    /* Check Error Conditions */
-    LASSERT_NUM("init", a, 1);
-    LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("init", a, 0);
+    LASSERT_NUM("alter", a, 3);
+    LASSERT_BINDERS("alter", a, 0, 1);
+    LASSERT_TYPE("alter", a, 1, LVAL_QEXPR);
+    LASSERT_TYPE("alter", a, 2, LVAL_REF);
+    LASSERT_STATIC(a, ltx_current, "Function 'alter' called outside of a transaction");
+
+    lref *r = a->cell[2]->ref;
+    lval *x = ltx_read(ltx_current, r);
+    if (x->type == LVAL_ERR)
+    {
+        lval_del(a);
+        return x;
+    }
 
-    int lastItemIndex = a->cell[0]->count - 1;
+    lenv *c = lenv_child(e);
+    lval *y = lval_apply_body(c, a->cell[0], a->cell[1], x);
+    lenv_del(c);
+    lval_del(x);
 
-    lval *v = lval_take(a, 0);
-    lval_pop(v, lastItemIndex);
-    return v;
-}
+    if (y->type != LVAL_ERR)
+        ltx_write(ltx_current, r, lval_clone(y));
 
-void lenv_put(lenv *e, lval *k, lval *v);
+    lval_del(a);
+    return y;
+}
 
-lval *builtin_def(lenv *e, lval *a)
+//Implementation of dosync
+//(dosync {body}) evaluates body as one transaction: its changes to refs take effect together or not at all.
+//A transaction that conflicts with another one is started again, so body may be evaluated more than once.
+lval *builtin_dosync(lenv *e, lval *a)
 {
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'def' passed incorrect type!");
+    LASSERT_NUM("dosync", a, 1);
+    LASSERT_TYPE("dosync", a, 0, LVAL_QEXPR);
 
-    /* First argument is symbol list */
-    lval *syms = a->cell[0];
+    /*A nested dosync is part of the transaction around it*/
+    if (ltx_current)
+    {
+        lval *x = lval_eval_const_sexpr(e, a->cell[0]);
+        lval_del(a);
+        return x;
+    }
 
-    /* Ensure all elements of first list are symbols */
-    for (int i = 0; i < syms->count; i++)
+    ltx t = {0};
+    ltx_current = &t;
+
+    lval *x;
+    for (int attempt = 0;; attempt++)
     {
-        LASSERT(a, syms->cell[i]->type == LVAL_SYM,
-                "Function 'def' cannot define non-symbol");
+        t.rv = atomic_load(&lstm_clock);
+        x = lval_eval_const_sexpr(e, a->cell[0]);
+
+        /*Any other error abandons the transaction with nothing written*/
+        if (x->type == LVAL_ERR && x->errcode != LERR_RETRY)
+            break;
+        if (x->type != LVAL_ERR && ltx_commit(&t))
+        {
+            lstm_commits++;
+            break;
+        }
+
+        lval_del(x);
+        ltx_reset(&t);
+        lstm_retries++;
+
+        /*Back off longer after each conflict so the transactions in the way can finish*/
+        for (int i = 0; i < attempt && i < LSTM_MAX_BACKOFF; i++)
+        {
+            sched_yield();
+        }
     }
 
-    /* Check correct number of symbols and values */
-    LASSERT(a, syms->count == a->count - 1,
-            "Function 'def' cannot define incorrect "
-            "number of values to symbols");
+    ltx_reset(&t);
+    ltx_current = NULL;
+    lval_del(a);
+    return x;
+}
 
-    /* Assign copies of values to symbols */
-    for (int i = 0; i < syms->count; i++)
+/*Implementation of stm-stats, (stm-stats {}) returns {commits retries}*/
+lval *builtin_stm_stats(lenv *e, lval *a)
+{
+    LASSERT_NUM("stm-stats", a, 1);
+    lval_del(a);
+    lval *x = lval_qexpr();
+    lval_add(x, lval_num(lstm_commits));
+    lval_add(x, lval_num(lstm_retries));
+    return x;
+}
+
+//Implementation of parallel
+//(parallel n) evaluates independent arguments of pure builtins on n worker threads from now on, 0 turns it off.
+//(parallel {}) returns the current number of workers.
+lval *builtin_parallel(lenv *e, lval *a)
+{
+    LASSERT_NUM("parallel", a, 1);
+    if (a->cell[0]->type == LVAL_QEXPR)
     {
-        lenv_put(e, syms->cell[i], a->cell[i + 1]);
+        lval_del(a);
+        return lval_num(lpar_on ? lpar_pool->workers : 0);
     }
 
+    LASSERT_TYPE("parallel", a, 0, LVAL_NUM);
+
+    int n = a->cell[0]->num;
+    LASSERT_STATIC(a, n >= 0 && n <= 1024, "Function 'parallel' passed an invalid number of workers");
+
+    /*Turning parallel evaluation off keeps the workers, actors and futures still run on them*/
+    if (n > 0 && lpar_pool && lpar_pool->workers != n)
+    {
+        LASSERT_STATIC(a, atomic_load(&lpool_users) == 0,
+                       "Function 'parallel' cannot change the number of workers while actors or futures are running");
+        lpool_stop();
+    }
+    if (n > 0 && !lpar_pool)
+        lpool_start(n);
+    lpar_on = n > 0;
+
     lval_del(a);
-    return lval_sexpr();
+    return lval_num(n);
 }
 
 void lenv_add_builtin(lenv *e, char *name, lbuiltin func)
@@ -749,10 +5896,81 @@ void lenv_add_builtins(lenv *e)
     lenv_add_builtin(e, "tail", builtin_tail);
     lenv_add_builtin(e, "eval", builtin_eval);
     lenv_add_builtin(e, "join", builtin_join);
+    lenv_add_builtin(e, "len", builtin_len);
+    lenv_add_builtin(e, "init", builtin_init);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "range", builtin_range);
 
     /* Variable Functions */
     lenv_add_builtin(e, "def", builtin_def);
 
+    /* Macro Functions */
+    lenv_add_builtin(e, "defmacro", builtin_defmacro);
+    lenv_add_builtin(e, "macroexpand", builtin_macroexpand);
+    lenv_add_builtin(e, "macro-stats", builtin_macro_stats);
+
+    /* Memo Functions */
+    lenv_add_builtin(e, "memo", builtin_memo);
+    lenv_add_builtin(e, "memo-table", builtin_memo_table);
+    lenv_add_builtin(e, "memo-get", builtin_memo_get);
+    lenv_add_builtin(e, "memo-put", builtin_memo_put);
+    lenv_add_builtin(e, "memo-budget", builtin_memo_budget);
+    lenv_add_builtin(e, "memo-clear", builtin_memo_clear);
+    lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+
+    /* Stream Functions */
+    lenv_add_builtin(e, "delay", builtin_delay);
+    lenv_add_builtin(e, "force", builtin_force);
+    lenv_add_builtin(e, "stream-cons", builtin_stream_cons);
+    lenv_add_builtin(e, "stream-iterate", builtin_stream_iterate);
+    lenv_add_builtin(e, "stream-map", builtin_stream_map);
+    lenv_add_builtin(e, "stream-filter", builtin_stream_filter);
+    lenv_add_builtin(e, "stream-take", builtin_stream_take);
+    lenv_add_builtin(e, "stream-drop", builtin_stream_drop);
+    lenv_add_builtin(e, "stream-reduce", builtin_stream_reduce);
+    lenv_add_builtin(e, "stream-list", builtin_stream_list);
+
+    /* Transducer Functions */
+    lenv_add_builtin(e, "xmap", builtin_xmap);
+    lenv_add_builtin(e, "xfilter", builtin_xfilter);
+    lenv_add_builtin(e, "xtake", builtin_xtake);
+    lenv_add_builtin(e, "xdrop", builtin_xdrop);
+    lenv_add_builtin(e, "comp", builtin_comp);
+    lenv_add_builtin(e, "transduce", builtin_transduce);
+    lenv_add_builtin(e, "into", builtin_into);
+
+    /* Loop Functions */
+    lenv_add_builtin(e, "while", builtin_while);
+    lenv_add_builtin(e, "dotimes", builtin_dotimes);
+    lenv_add_builtin(e, "for-each", builtin_for_each);
+
+    /* Parallel Functions */
+    lenv_add_builtin(e, "parallel", builtin_parallel);
+    lenv_add_builtin(e, "pmap", builtin_pmap);
+    lenv_add_builtin(e, "pfilter", builtin_pfilter);
+    lenv_add_builtin(e, "preduce", builtin_preduce);
+    lenv_add_builtin(e, "future", builtin_future);
+    lenv_add_builtin(e, "touch", builtin_touch);
+    lenv_add_builtin(e, "await", builtin_await);
+
+    /* Coroutine Functions */
+    lenv_add_builtin(e, "coroutine", builtin_coroutine);
+    lenv_add_builtin(e, "resume", builtin_resume);
+    lenv_add_builtin(e, "yield", builtin_yield);
+
+    /* Actor Functions */
+    lenv_add_builtin(e, "spawn", builtin_spawn);
+    lenv_add_builtin(e, "send", builtin_send);
+    lenv_add_builtin(e, "receive", builtin_receive);
+    lenv_add_builtin(e, "self", builtin_self);
+
+    /* Transaction Functions */
+    lenv_add_builtin(e, "ref", builtin_ref);
+    lenv_add_builtin(e, "deref", builtin_deref);
+    lenv_add_builtin(e, "alter", builtin_alter);
+    lenv_add_builtin(e, "dosync", builtin_dosync);
+    lenv_add_builtin(e, "stm-stats", builtin_stm_stats);
+
     /* Mathematical Functions */
     lenv_add_builtin(e, "+", builtin_add);
     lenv_add_builtin(e, "-", builtin_sub);
@@ -764,9 +5982,28 @@ lenv *lenv_new(void)
 {
     lenv *e = malloc(sizeof(lenv));
     e->count = 0;
+    e->cap = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->index = NULL;
+    e->shared = 0;
+
+    e->par = NULL;
 
+    e->running = 0;
+    e->running_cap = 0;
+    e->running_code = NULL;
+    e->retired_count = 0;
+    e->retired = NULL;
+
+    return e;
+}
+
+/*A private environment for work running beside others, its definitions stay local and lookups fall back to 'par'*/
+lenv *lenv_child(lenv *par)
+{
+    lenv *e = lenv_new();
+    e->par = par;
     return e;
 }
 
@@ -778,56 +6015,221 @@ void lenv_del(lenv *e)
         lval_del(e->vals[i]);
     }
 
+    lenv_release(e);
+
+    free(e->running_code);
     free(e->syms);
     free(e->vals);
+    free(e->index);
     free(e);
 }
 
+/*Delete values retired while stored code was running*/
+void lenv_release(lenv *e)
+{
+    for (int i = 0; i < e->retired_count; i++)
+    {
+        lenv_retire(e, e->retired[i], lrcu_free_lval);
+    }
+
+    free(e->retired);
+    e->retired_count = 0;
+    e->retired = NULL;
+}
+
+/*Value of entry 'i', as it may be replaced by another thread meanwhile*/
+lval *lenv_val(lenv *e, int i)
+{
+    _Atomic(lval *) *vals = atomic_load_explicit(&e->vals, memory_order_acquire);
+    return atomic_load_explicit(&vals[i], memory_order_acquire);
+}
+
+/*Return the value bound to 'k' without copying it, or NULL if it is unbound*/
+lval *lenv_lookup(lenv *e, lval *k)
+{
+    for (; e; e = e->par)
+    {
+        int i = lenv_index(e, k);
+        if (i >= 0)
+            return lenv_val(e, i);
+    }
+    return NULL;
+}
+
 lval *lenv_get(lenv *e, lval *k)
 {
+    /*Look in this environment, then in the ones it is nested in*/
+    for (; e; e = e->par)
+    {
+        int i = lenv_index(e, k);
+        if (i >= 0)
+            return lval_copy(lenv_val(e, i));
+    }
+
+    /*If no symbol found return error*/
+    return lval_err_unbound(k->sym);
+}
+
+/*Index of the entry for symbol 'k' in 'e' itself, or -1 if it is unbound there. Entries are never removed, so the index stays valid*/
+int lenv_index(lenv *e, lval *k)
+{
+    lenv_hindex *x = atomic_load_explicit(&e->index, memory_order_acquire);
+
+    if (!x)
+    {
+        int n = atomic_load_explicit(&e->count, memory_order_acquire);
+        char **syms = atomic_load_explicit(&e->syms, memory_order_acquire);
+        for (int i = 0; i < n; i++)
+        {
+            if (strcmp(syms[i], k->sym) == 0)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    for (unsigned long h = lenv_hash(k->sym);; h++)
+    {
+        int i = atomic_load_explicit(&x->slots[h & x->mask], memory_order_acquire);
+        if (i < 0)
+            return -1;
+        if (strcmp(atomic_load_explicit(&e->syms, memory_order_acquire)[i], k->sym) == 0)
+            return i;
+    }
+}
+
+/*Make room for one more entry, readers keep using the old arrays until they are done with them*/
+void lenv_grow(lenv *e)
+{
+    int cap = e->cap ? e->cap * 2 : 8;
+    char **syms = malloc(sizeof(char *) * cap);
+    _Atomic(lval *) *vals = malloc(sizeof(lval *) * cap);
 
-    /*Iterate over all items in the environment*/
     for (int i = 0; i < e->count; i++)
     {
-        /* Check if the stored string matches the symbol string */
-        /* If it does, return a copy of the value */
-        if (strcmp(e->syms[i], k->sym) == 0)
+        syms[i] = e->syms[i];
+        atomic_init(&vals[i], atomic_load_explicit(&e->vals[i], memory_order_relaxed));
+    }
+
+    char **old_syms = e->syms;
+    _Atomic(lval *) *old_vals = e->vals;
+    e->syms = syms;
+    e->vals = vals;
+    e->cap = cap;
+
+    if (old_syms)
+    {
+        lenv_retire(e, old_syms, free);
+        lenv_retire(e, (void *)old_vals, free);
+    }
+}
+
+/*Add entry 'n' to the index of 'e', first building a bigger index if it is getting full*/
+void lenv_index_add(lenv *e, int n)
+{
+    lenv_hindex *x = e->index;
+
+    if (!x && n + 1 < LENV_INDEX_MIN)
+        return;
+
+    if (!x || 2 * (n + 1) > x->mask + 1)
+    {
+        int size = 4 * LENV_INDEX_MIN;
+        while (size < 4 * (n + 1))
+        {
+            size *= 2;
+        }
+
+        lenv_hindex *y = malloc(sizeof(lenv_hindex) + sizeof(atomic_int) * size);
+        y->mask = size - 1;
+        for (int j = 0; j < size; j++)
+        {
+            atomic_init(&y->slots[j], -1);
+        }
+        for (int i = 0; i <= n; i++)
         {
-            return lval_copy(e->vals[i]);
+            unsigned long h = lenv_hash(e->syms[i]);
+            while (atomic_load_explicit(&y->slots[h & y->mask], memory_order_relaxed) >= 0)
+            {
+                h++;
+            }
+            atomic_init(&y->slots[h & y->mask], i);
         }
+
+        atomic_store_explicit(&e->index, y, memory_order_release);
+        if (x)
+            lenv_retire(e, x, free);
+        return;
     }
 
-    /*If no symbol found return error*/
-    return lval_err("Unbound Symbol '%s'", k->sym);
+    unsigned long h = lenv_hash(e->syms[n]);
+    while (atomic_load_explicit(&x->slots[h & x->mask], memory_order_relaxed) >= 0)
+    {
+        h++;
+    }
+    atomic_store_explicit(&x->slots[h & x->mask], n, memory_order_release);
+}
+
+/*Whether 'v' is stored code that is running in place in 'e'*/
+int lenv_running(lenv *e, lval *v)
+{
+    for (int i = 0; i < e->running; i++)
+    {
+        if (e->running_code[i] == v)
+            return 1;
+    }
+    return 0;
 }
 
 void lenv_put(lenv *e, lval *k, lval *v)
 {
+    /*Readers of a shared environment never wait, only writers take turns*/
+    if (e->shared)
+        pthread_mutex_lock(&lenv_write_lock);
 
-    /* Iterate over all items in environment */
-    /* This is to see if variable already exists */
-    for (int i = 0; i < e->count; i++)
+    /*If the variable already exists, replace its value*/
+    int i = lenv_index(e, k);
+    if (i >= 0)
     {
+        lval *old = e->vals[i];
 
-        /* if the variable is found delete the item at that position */
-        /* And replace with variable supplied by the user */
-        if (strcmp(e->syms[i], k->sym) == 0)
+        /*Cached expansions of a macro go stale once its name is rebound*/
+        if (old->type == LVAL_MACRO)
         {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
+            lmacro_epoch++;
+        }
+
+        atomic_store_explicit(&e->vals[i], lval_copy(v), memory_order_release);
+
+        if (lenv_running(e, old))
+        {
+            e->retired_count++;
+            e->retired = realloc(e->retired, sizeof(lval *) * e->retired_count);
+            e->retired[e->retired_count - 1] = old;
+        }
+        else
+        {
+            lenv_retire(e, old, lrcu_free_lval);
         }
     }
+    else
+    {
+        /*Otherwise fill in a new entry, and only then make it visible*/
+        int n = e->count;
+        if (n == e->cap)
+            lenv_grow(e);
+
+        e->syms[n] = malloc(strlen(k->sym) + 1);
+        strcpy(e->syms[n], k->sym);
+        atomic_init(&e->vals[n], lval_copy(v));
 
-    /* if no existing entry found, allocate space for new entry */
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-    e->syms = realloc(e->syms, sizeof(lval *) * e->count);
+        lenv_index_add(e, n);
+        atomic_store_explicit(&e->count, n + 1, memory_order_release);
+    }
 
-    /* Copy contents of lval and symbol string into new location */
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+    if (e->shared)
+        pthread_mutex_unlock(&lenv_write_lock);
 }
 
 int main(int argc, char **argv)
@@ -858,8 +6260,13 @@ int main(int argc, char **argv)
     puts("Press Ctrl+C to Exit\n");
 
     lenv *e = lenv_new();
+    e->shared = 1;
     lenv_add_builtins(e);
 
+    /*Input is read directly into lvals, unless --mpc asks for the grammar above*/
+    int use_mpc = argc > 1 && strcmp(argv[1], "--mpc") == 0;
+    mpc_context_t *ctx = mpc_context_new();
+
     /*REPL Loop*/
     while (1)
     {
@@ -870,26 +6277,42 @@ int main(int argc, char **argv)
         /*Add input to history*/
         add_history(input);
 
-        /*Parse the user input*/
-        mpc_result_t r;
-        if (mpc_parse("<stdin>", input, DivLisp, &r))
+        /*Read the user input*/
+        lval *v = NULL;
+        if (use_mpc)
         {
-            /*On success print result and delete the AST*/
-            /*lval result = eval(r.output);
-            lval_println(result);
-            //mpc_ast_print(r.output);
-            mpc_ast_delete(r.output);*/
-            lval *x = lval_eval(e, lval_read(r.output));
-            lval_println(x);
-            lval_del(x);
-
-            mpc_ast_delete(r.output);
+            mpc_result_t r;
+            if (mpc_parse_context(ctx, "<stdin>", input, DivLisp, MPC_PARSE_SLICES, &r))
+            {
+                v = lval_read(r.output);
+                mpc_ast_delete(r.output);
+            }
+            else
+            {
+                /*Otherwise print and delete the Error*/
+                mpc_err_print(r.error);
+                mpc_err_delete(r.error);
+            }
         }
         else
         {
-            /*Otherwise print and delete the Error*/
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
+            char *err = NULL;
+            v = lval_read_text("<stdin>", input, strlen(input), &err);
+            if (!v)
+            {
+                puts(err);
+                free(err);
+            }
+        }
+
+        /*On success print the result*/
+        if (v)
+        {
+            lrcu_online();
+            lval *x = lval_eval(e, lval_expand(e, v));
+            lval_println(x);
+            lval_del(x);
+            lrcu_offline();
         }
 
         /*Free retrieved input*/
@@ -897,6 +6320,7 @@ int main(int argc, char **argv)
     }
 
     /* Cleanup our parser*/
+    mpc_context_delete(ctx);
     mpc_cleanup(6, DivLisp, Sexpr, Qexpr, Expr, Number, Symbol);
 
     return 0;